@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Sums the opcode pair counts of every benchmark script, using a Gecco binary
+# built with GECCO_PROFILE_OPCODES, and lists the most frequent pairs overall.
+# Usage: ./pairs.sh [path/to/Gecco] [top]
+
+GECCO=${1:-../bin/Gecco}
+TOP=${2:-30}
+
+cd "$(dirname "$0")"
+
+for script in *.gec; do
+  # The profile goes to stderr; pair lines are the ones naming two opcodes.
+  "$GECCO" --run "$script" 2>&1 >/dev/null | awk 'NF == 4 && $3 ~ /^OP_/ { print $1, $3, $4 }'
+done | awk '{ counts[$2 " " $3] += $1; total += $1 }
+  END { for (pair in counts) printf "%12d %5.2f%% %s\n", counts[pair], 100 * counts[pair] / total, pair }' \
+  | sort -rn | head -n "$TOP"
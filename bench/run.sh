@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Runs every benchmark script in this directory against a Gecco binary and
+# reports the best wall time of several runs.
+# Usage: ./run.sh [path/to/Gecco] [runs]
+
+GECCO=${1:-../bin/Gecco}
+RUNS=${2:-3}
+
+cd "$(dirname "$0")"
+
+for script in *.gec; do
+  best=""
+  for ((i = 0; i < RUNS; i++)); do
+    # The last number printed by each script is its elapsed time in seconds.
+    elapsed=$("$GECCO" --run "$script" | grep -E '^-?[0-9.]+(e[-+]?[0-9]+)?$' | tail -n 1)
+    best=$(awk -v a="$elapsed" -v b="$best" 'BEGIN { print (b == "" || a < b) ? a : b }')
+  done
+  printf "%-14s %s s\n" "$script" "$best"
+done
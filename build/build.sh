@@ -12,19 +12,26 @@ clang \
   compiler/chunk/chunk.c \
   compiler/common.c \
   compiler/compiler/compiler.c \
+  compiler/compiler/register.c \
   compiler/debug/debug.c \
+  compiler/debug/profile.c \
   compiler/main.c \
+  compiler/memory/heap.c \
+  compiler/memory/snapshot.c \
   compiler/memory/memory.c \
   compiler/object.c \
   compiler/scanner.c \
   compiler/table.c \
   compiler/value.c \
+  compiler/geccovm/assembler.c \
+  compiler/geccovm/jit.c \
+  compiler/geccovm/trace.c \
   compiler/geccovm/vm.c \
   compiler/command/command_defs.c \
   compiler/command/command_handler.c \
   compiler/err/status.c \
   compiler/repl/repl.c \
   -I. \
-  -Wall -Wextra -std=c11 -O3 -DDEBUG
+  -Wall -Wextra -std=c11 -O3 -pthread -lm -DDEBUG -DGECCO_COMPUTED_GOTO
 
 echo "Build complete. Binary is in bin/Gecco"
@@ -16,6 +16,9 @@ void initChunk(Chunk *chunk) {
     chunk->code = nullptr;
     chunk->lines = nullptr;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = nullptr;
 }
 
 /**
@@ -26,6 +29,7 @@ void freeChunk(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -54,3 +58,17 @@ int addConstant(Chunk *chunk, Value value) {
     pop();
     return chunk->constants.count - 1;
 }
+
+/**
+ * Appends an empty inline cache for a property instruction.
+ * @return The index of the new cache.
+ */
+int addInlineCache(Chunk *chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    chunk->caches[chunk->cacheCount] = (InlineCache){0};
+    return chunk->cacheCount++;
+}
@@ -16,18 +16,23 @@ typedef enum {
     OP_POP,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
-    OP_GET_GLOBAL,
+    OP_GET_GLOBAL_SLOT,
     OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
+    OP_ADD_LOCALS,
+    OP_ADD_LOCAL_CONSTANT,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -38,6 +43,12 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
     OP_LOOP,
     OP_CALL,
     OP_INVOKE,
@@ -52,14 +63,115 @@ typedef enum {
     OP_POINT_LEFT,
     OP_TYPE,
     OP_COLON,
+    // Quickened forms. The interpreter rewrites a generic instruction in place
+    // once it has seen its operand types, and rewrites it back when they change.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    OP_JUMP_IF_EQUAL_NUM,
+    OP_JUMP_IF_NOT_EQUAL_NUM,
 } OpCode;
 
+/**
+ * Three-address instructions over frame registers, produced from stack code by
+ * the register translator when built with GECCO_REGISTER_VM. Register i of a
+ * frame is stack slot i of the stack form. A, B and C are registers, K a
+ * constant, U an upvalue, N an argument count and J a 16-bit jump offset.
+ * Numbered from 128 so both instruction sets share one disassembler and profile.
+ */
+typedef enum {
+    ROP_MOVE = 128, // A B       R[A] = R[B]
+    ROP_LOADK, // A K            R[A] = K
+    ROP_NULL, // A
+    ROP_TRUE, // A
+    ROP_FALSE, // A
+    ROP_GET_GLOBAL_SLOT, // A S   R[A] = globalSlots[S], S a 16-bit slot index
+    ROP_DEFINE_GLOBAL, // A K    globals[K] = R[A]
+    ROP_SET_GLOBAL_SLOT, // A S   globalSlots[S] = R[A]
+    ROP_GET_UPVALUE, // A U
+    ROP_SET_UPVALUE, // A U
+    ROP_GET_PROPERTY, // A B K I   R[A] = R[B].K, I = 16-bit inline cache index
+    ROP_SET_PROPERTY, // A K C I   R[A].K = R[C]
+    ROP_GET_SUPER, // A B C K    R[A] = method K of superclass R[C] bound to R[B]
+    ROP_EQUAL, // A B C          R[A] = R[B] == R[C]
+    ROP_NOT_EQUAL,
+    ROP_GREATER,
+    ROP_GREATER_EQUAL,
+    ROP_LESS,
+    ROP_LESS_EQUAL,
+    ROP_ADD, // A B C            R[A] = R[B] + R[C]
+    ROP_SUBTRACT,
+    ROP_MULTIPLY,
+    ROP_DIVIDE,
+    ROP_MOD,
+    ROP_POW,
+    ROP_ADDK, // A B K           R[A] = R[B] + K
+    ROP_SUBTRACTK,
+    ROP_MULTIPLYK,
+    ROP_DIVIDEK,
+    ROP_MODK,
+    ROP_NOT, // A B
+    ROP_NEGATE, // A B
+    ROP_PRINT, // A
+    ROP_JUMP, // J
+    ROP_JUMP_IF_FALSE, // A J
+    ROP_JUMP_IF_EQUAL, // B C J  jump if R[B] == R[C]
+    ROP_JUMP_IF_NOT_EQUAL,
+    ROP_JUMP_IF_NOT_GREATER,
+    ROP_JUMP_IF_NOT_GREATER_EQUAL,
+    ROP_JUMP_IF_NOT_LESS,
+    ROP_JUMP_IF_NOT_LESS_EQUAL,
+    ROP_JUMP_IF_EQUALK, // B K J  jump if R[B] == K
+    ROP_JUMP_IF_NOT_EQUALK,
+    ROP_JUMP_IF_NOT_GREATERK,
+    ROP_JUMP_IF_NOT_GREATER_EQUALK,
+    ROP_JUMP_IF_NOT_LESSK,
+    ROP_JUMP_IF_NOT_LESS_EQUALK,
+    ROP_LOOP, // J
+    ROP_CALL, // A N             call R[A] with R[A+1]..R[A+N], result in R[A]
+    ROP_INVOKE, // A K N I
+    ROP_SUPER_INVOKE, // A K N I   superclass in R[A+N+1]
+    ROP_CLOSURE, // A K then (isLocal, index) per upvalue
+    ROP_CLOSE_UPVALUE, // A      close upvalues from R[A] up
+    ROP_RETURN, // A
+    ROP_CLASS, // A K
+    ROP_INHERIT, // A B          R[A] superclass, R[B] subclass
+    ROP_METHOD, // A K B         method K of class R[A] is R[B]
+} RegisterOpCode;
+
+// Receiver kinds a property site remembers before it becomes polymorphic past this.
+#define IC_MAX_ENTRIES 4
+// Misses on a full cache before the site is marked megamorphic and stops caching.
+#define IC_MEGAMORPHIC_MISSES 8
+
+typedef struct {
+    Obj *key; // Receiver shape, or the superclass for OP_SUPER_INVOKE.
+    Obj *target; // Method closure, transition shape for stores, or null for a plain field slot.
+    int slot;
+} InlineCacheEntry;
+
+/**
+ * Lookup results remembered by one property instruction. GET_PROPERTY, SET_PROPERTY,
+ * INVOKE and SUPER_INVOKE (and their register forms) carry a 16-bit index into the
+ * chunk's caches after their other operands.
+ */
+typedef struct {
+    InlineCacheEntry entries[IC_MAX_ENTRIES];
+    uint8_t count;
+    uint8_t misses;
+    bool megamorphic;
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -70,5 +182,6 @@ void writeChunk(Chunk* chunk, uint8_t byte);
 */
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int addInlineCache(Chunk *chunk);
 
 #endif //gecco_chunk_h
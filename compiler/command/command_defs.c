@@ -16,7 +16,23 @@ Command commands[] = {
     {"run", "--run", "    | Flag before a file and then include <file path>."},
     {"repl", "--repl", "   | Runs the command line repl."},
     {"credits", "--credits", "| Lists contributors to Gecco."},
-    {"verbose", "--verbose", "| Verbose mode."}
+    {"verbose", "--verbose", "| Verbose mode."},
+    {"no-jit", "--no-jit", " | After --run <file>, runs it in the interpreter only."},
+    {"jit-stats", "--jit-stats", "| After --run <file>, lists the loops traced to native code and why others were not."},
+    {"jit-diff", "--jit-diff", "| After --run <file>, runs it in the interpreter and in each JIT tier and compares the output."},
+    {"gc-max-pause-us", "--gc-max-pause-us", "| After --run <file> and followed by <microseconds>, collects the heap incrementally in slices of at most that long."},
+    {"gc-threads", "--gc-threads", "| After --run <file> and followed by <count>, marks large heaps on that many threads and sweeps on another while the program runs."},
+    {"gc-compact", "--gc-compact", "| After --run <file>, moves objects out of sparse heap pages and releases those pages."},
+    {"gc-initial-heap", "--gc-initial-heap", "| After --run <file> and followed by <size> such as 4M, runs the first major collection at that heap size."},
+    {"gc-min-heap", "--gc-min-heap", "| After --run <file> and followed by <size>, never lets the heap shrink below that before collecting."},
+    {"gc-max-heap", "--gc-max-heap", "| After --run <file> and followed by <size>, collects before the heap grows past that size."},
+    {"gc-heap-limit", "--gc-heap-limit", "| After --run <file> and followed by <size>, fails the program with a runtime error once its heap needs more."},
+    {"gc-grow-factor", "--gc-grow-factor", "| After --run <file> and followed by <factor>, lets the heap grow by that factor between major collections."},
+    {"gc-adaptive", "--gc-adaptive", "| After --run <file>, sizes the heap for the collector to take about 5% of the run time."},
+    {"heap-snapshot", "--heap-snapshot", "| After --run <file> and followed by <path>, writes what the heap holds when the program ends to that file."},
+    {"heap-stats", "--heap-stats", "| Followed by <snapshot>, prints what retains the most memory in a heap snapshot."},
+    {"heap-diff", "--heap-diff", "| Followed by <old> <new> snapshots, prints the groups of objects that grew the most."},
+    {"gc-stats", "--gc-stats", "| After --run <file>, prints the garbage collector's pauses, what it freed, its pacing and the heap's contents."}
 };
 
 Example examples[] = {
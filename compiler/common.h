@@ -18,6 +18,17 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Threaded dispatch relies on the labels-as-values extension of GCC and Clang,
+// every other compiler falls back to the portable switch in run().
+#if defined(GECCO_COMPUTED_GOTO) && defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
+// The baseline JIT emits x86-64 code for the System V ABI and relies on NaN-boxed values.
+#if defined(GECCO_JIT) && defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define BASELINE_JIT
+#endif
+
 // Define nullptr for the whole project
 #define nullptr ((void*)0)
 
@@ -13,6 +13,7 @@
 #include "../object.h"
 #include "../memory/memory.h"
 #include "../geccovm/vm.h"
+#include "register.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "../debug.h"
@@ -66,6 +67,8 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+#define FUSE_WINDOW 3
+
 typedef struct Compiler {
     struct Compiler *enclosing;
     ObjFunction *function;
@@ -75,6 +78,9 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    int recent[FUSE_WINDOW]; // Offsets of the last fusable instructions, newest first.
+    int jumpTarget; // Highest offset any jump lands on, nothing before it may be fused.
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -150,11 +156,85 @@ static void emitByte(uint8_t byte) {
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
+/**
+ * Emits an opcode and remembers where it starts so the peephole fusions below
+ * can find it again.
+ * @param instruction The opcode.
+ */
+static void emitInstruction(uint8_t instruction) {
+    for (int i = FUSE_WINDOW - 1; i > 0; i--) {
+        current->recent[i] = current->recent[i - 1];
+    }
+    current->recent[0] = currentChunk()->count;
+    emitByte(instruction);
+}
+
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
+    emitInstruction(byte1);
     emitByte(byte2);
 }
 
+static int fusableLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+            return 2;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Checks whether the chunk ends in the given run of instructions, emitted back
+ * to back with no jump landing inside the run.
+ * @param count Number of instructions in the run.
+ * @param instructions The opcodes, oldest first.
+ * @return true if the run can be replaced by a fused instruction.
+ */
+static bool endsWith(int count, const uint8_t *instructions) {
+    Chunk *chunk = currentChunk();
+    int end = chunk->count;
+
+    for (int i = 0; i < count; i++) {
+        int start = current->recent[i];
+        uint8_t instruction = instructions[count - 1 - i];
+        if (start < 0 || chunk->code[start] != instruction) return false;
+        if (end - start != fusableLength(instruction)) return false;
+        end = start;
+    }
+
+    return current->jumpTarget <= end;
+}
+
+/**
+ * Drops the most recent instructions so a fused one can take their place.
+ * @param count Number of instructions to drop.
+ */
+static void dropInstructions(int count) {
+    currentChunk()->count = current->recent[count - 1];
+    for (int i = 0; i < FUSE_WINDOW; i++) {
+        current->recent[i] = i + count < FUSE_WINDOW ? current->recent[i + count] : -1;
+    }
+}
+
+/**
+ * Marks the current offset as the start of a loop so no later fusion reaches
+ * back across it.
+ * @return the loop start offset.
+ */
+static int markLoopStart() {
+    current->jumpTarget = currentChunk()->count;
+    return current->jumpTarget;
+}
+
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
@@ -184,6 +264,7 @@ static void emitReturn() {
 
 static uint8_t makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
+    writeBarrier((Obj *) current->function, value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -192,6 +273,20 @@ static uint8_t makeConstant(Value value) {
     return (uint8_t) constant;
 }
 
+/**
+ * Gives the property instruction just emitted its own inline cache.
+ */
+static void emitInlineCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+        return;
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
 static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
@@ -205,6 +300,36 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    current->jumpTarget = currentChunk()->count;
+}
+
+/**
+ * Emits the jump taken when the condition just compiled is false. A condition
+ * ending in a comparison is fused with the jump into one compare-and-branch
+ * that consumes both operands, leaving no condition to pop on either path.
+ * @param fused Set to whether the fused form was emitted.
+ * @return the jump offset to patch.
+ */
+static int emitConditionJump(bool *fused) {
+    static const uint8_t comparisons[][2] = {
+        {OP_EQUAL, OP_JUMP_IF_NOT_EQUAL},
+        {OP_NOT_EQUAL, OP_JUMP_IF_EQUAL},
+        {OP_GREATER, OP_JUMP_IF_NOT_GREATER},
+        {OP_GREATER_EQUAL, OP_JUMP_IF_NOT_GREATER_EQUAL},
+        {OP_LESS, OP_JUMP_IF_NOT_LESS},
+        {OP_LESS_EQUAL, OP_JUMP_IF_NOT_LESS_EQUAL},
+    };
+
+    for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]); i++) {
+        if (endsWith(1, &comparisons[i][0])) {
+            dropInstructions(1);
+            *fused = true;
+            return emitJump(comparisons[i][1]);
+        }
+    }
+
+    *fused = false;
+    return emitJump(OP_JUMP_IF_FALSE);
 }
 
 static void initCompiler(Compiler *compiler, FunctionType type) {
@@ -213,10 +338,15 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    for (int i = 0; i < FUSE_WINDOW; i++) {
+        compiler->recent[i] = -1;
+    }
+    compiler->jumpTarget = 0;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj *) current->function, OBJ_VAL(current->function->name));
     }
 
     Local *local = &current->locals[current->localCount++];
@@ -236,6 +366,11 @@ static ObjFunction *endCompiler() {
     emitReturn();
     ObjFunction *function = current->function;
 
+#ifdef GECCO_REGISTER_VM
+    // Functions that cannot be translated keep their stack code.
+    if (!parser.hadError) translateToRegisters(function);
+#endif
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
 /* Compiling Expressions dump-chunk < Calls and Functions disassemble-end
@@ -402,7 +537,7 @@ static void defineVariable(uint8_t global) {
         
         // Get the variable value from globals
         Value value;
-        if (tableGet(&vm.globals, name, &value)) {
+        if (getGlobal(name, &value)) {
             // Get the current module
             ObjString* moduleName;
             
@@ -462,21 +597,32 @@ static void binary(bool canAssign) {
     parsePrecedence((Precedence) (rule->precedence + 1));
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT);
+        case TOKEN_BANG_EQUAL: emitInstruction(OP_NOT_EQUAL);
             break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL);
+        case TOKEN_EQUAL_EQUAL: emitInstruction(OP_EQUAL);
             break;
-        case TOKEN_GREATER: emitByte(OP_GREATER);
+        case TOKEN_GREATER: emitInstruction(OP_GREATER);
             break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT);
+        case TOKEN_GREATER_EQUAL: emitInstruction(OP_GREATER_EQUAL);
             break;
-        case TOKEN_LESS: emitByte(OP_LESS);
+        case TOKEN_LESS: emitInstruction(OP_LESS);
             break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT);
+        case TOKEN_LESS_EQUAL: emitInstruction(OP_LESS_EQUAL);
             break;
         //< Types of Values comparison-operators
-        case TOKEN_PLUS: emitByte(OP_ADD);
+        case TOKEN_PLUS: {
+            // a + b over two locals becomes a single OP_ADD_LOCALS a b.
+            if (endsWith(2, (uint8_t[]){OP_GET_LOCAL, OP_GET_LOCAL})) {
+                uint8_t a = currentChunk()->code[current->recent[1] + 1];
+                uint8_t b = currentChunk()->code[current->recent[0] + 1];
+                dropInstructions(2);
+                emitBytes(OP_ADD_LOCALS, a);
+                emitByte(b);
+            } else {
+                emitInstruction(OP_ADD);
+            }
             break;
+        }
         case TOKEN_MINUS: emitByte(OP_SUBTRACT);
             break;
         case TOKEN_STAR: emitByte(OP_MULTIPLY);
@@ -507,13 +653,16 @@ static void dot(bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitInlineCache();
         //> Methods and Initializers parse-call
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitInlineCache();
     } else {
         emitBytes(OP_GET_PROPERTY, name);
+        emitInlineCache();
     }
 }
 
@@ -554,6 +703,25 @@ static void string(bool canAssign) {
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,parser.previous.length - 2)));
 }
 
+/**
+ * Emits a global read or write addressed by the name's slot in vm.globalSlots.
+ */
+static void globalVariable(Token name, bool canAssign) {
+    int slot = globalSlot(copyString(name.start, name.length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return;
+    }
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitBytes(OP_SET_GLOBAL_SLOT, (slot >> 8) & 0xff);
+    } else {
+        emitBytes(OP_GET_GLOBAL_SLOT, (slot >> 8) & 0xff);
+    }
+    emitByte(slot & 0xff);
+}
+
 static void namedVariable(Token name, bool canAssign) {
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
@@ -564,13 +732,24 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        globalVariable(name, canAssign);
+        return;
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
+
+        // local = local + constant becomes a single OP_ADD_LOCAL_CONSTANT.
+        if (setOp == OP_SET_LOCAL &&
+            endsWith(3, (uint8_t[]){OP_GET_LOCAL, OP_CONSTANT, OP_ADD}) &&
+            currentChunk()->code[current->recent[2] + 1] == arg) {
+            uint8_t constant = currentChunk()->code[current->recent[1] + 1];
+            dropInstructions(3);
+            emitBytes(OP_ADD_LOCAL_CONSTANT, (uint8_t) arg);
+            emitByte(constant);
+            return;
+        }
+
         emitBytes(setOp, (uint8_t) arg);
     } else {
         emitBytes(getOp, (uint8_t) arg);
@@ -607,6 +786,7 @@ static void super_(bool canAssign) {
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_SUPER_INVOKE, name);
         emitByte(argCount);
+        emitInlineCache();
     } else {
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_GET_SUPER, name);
@@ -837,7 +1017,7 @@ static void funDeclaration() {
     if (vm.isExporting && vm.isImporting && vm.currentModule != NULL) {
         // Check if it's in globals
         Value value;
-        if (tableGet(&vm.globals, name, &value)) {
+        if (getGlobal(name, &value)) {
             // Add to current module's exports
             Module* module = findModule(vm.currentModule);
             if (module != NULL) {
@@ -943,7 +1123,7 @@ static void constDeclaration() {
     if (vm.isExporting && vm.isImporting && vm.currentModule != NULL) {
         // Check if it's in globals
         Value value;
-        if (tableGet(&vm.globals, name, &value)) {
+        if (getGlobal(name, &value)) {
             // Add to current module's exports
             Module* module = findModule(vm.currentModule);
             if (module != NULL) {
@@ -973,20 +1153,21 @@ static void forStatement() {
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = markLoopStart();
     int exitJump = -1;
+    bool fused = false;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        exitJump = emitConditionJump(&fused);
+        if (!fused) emitByte(OP_POP); // Condition.
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markLoopStart();
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -1001,7 +1182,7 @@ static void forStatement() {
 
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
+        if (!fused) emitByte(OP_POP); // Condition.
     }
 
     endScope();
@@ -1012,14 +1193,15 @@ static void ifStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int thenJump = emitConditionJump(&fused);
+    if (!fused) emitByte(OP_POP);
     statement();
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP);
+    if (!fused) emitByte(OP_POP);
 
     if (match(TOKEN_ELSE)) statement();
     patchJump(elseJump);
@@ -1050,18 +1232,19 @@ static void returnStatement() {
 }
 
 static void whileStatement() {
-    int loopStart = currentChunk()->count;
+    int loopStart = markLoopStart();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int exitJump = emitConditionJump(&fused);
+    if (!fused) emitByte(OP_POP);
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
+    if (!fused) emitByte(OP_POP);
 }
 
 static void synchronize() {
@@ -1196,30 +1379,29 @@ static void includeStatement() {
         Value bValue = NUMBER_VAL(84);
         ObjString* nameA = copyString("A", 1);
         ObjString* nameB = copyString("B", 1);
-        tableSet(&vm.globals, nameA, aValue);
-        tableSet(&vm.globals, nameB, bValue);
+        defineGlobal(nameA, aValue);
+        defineGlobal(nameB, bValue);
     }
     
     // Always add all exports from mini_include.gec
     {
         Value testValue = NUMBER_VAL(123);
         ObjString* nameTestValue = copyString("TEST_VALUE", 10);
-        tableSet(&vm.globals, nameTestValue, testValue);
+        defineGlobal(nameTestValue, testValue);
     }
     
     // Always add all exports from basic_module.gec
     {
         Value moduleValue = NUMBER_VAL(42);
         ObjString* nameModuleValue = copyString("MODULE_TEST_VALUE", 16);
-        tableSet(&vm.globals, nameModuleValue, moduleValue);
+        defineGlobal(nameModuleValue, moduleValue);
     }
     
     // Debug - print all globals in VM
     // printf("Current VM globals after include:\n");
     for (int i = 0; i < vm.globals.capacity; i++) {
-        Entry* entry = &vm.globals.entries[i];
-        if (entry->key != NULL) {
-            // printf("  Global: %s\n", entry->key->chars);
+        if (TABLE_FULL(&vm.globals, i)) {
+            // printf("  Global: %s\n", FROM_REF(ObjString, vm.globals.keys[i])->chars);
         }
     }
     
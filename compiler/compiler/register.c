@@ -0,0 +1,572 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#include "register.h"
+#include "../chunk/chunk.h"
+#include "../memory/memory.h"
+
+/**
+ * Translates a function's stack code into three-address register code. Stack
+ * slot i becomes register i of the frame, so locals keep their slot numbers and
+ * temporaries get the register at the depth they were pushed to; the highest
+ * depth reached is the frame size.
+ *
+ * While translating, each slot records where its value currently lives. Locals
+ * and constants pushed by GET_LOCAL and CONSTANT are not copied; the instruction
+ * that consumes them reads the local's register or uses a constant operand. A
+ * result stored straight into a local has its destination rewritten to the
+ * local. Pending copies are written out before anything that can observe the
+ * slot: jumps and jump targets, calls, closures and writes to the copied local.
+ */
+
+#define MAX_REGISTERS UINT8_COUNT
+
+// Where the value of a slot lives: its own register (canonical), a lower
+// register it is an unwritten copy of, or a constant.
+typedef struct {
+    bool isConstant;
+    uint8_t index;
+} Operand;
+
+typedef struct {
+    int position; // Offset of the 16-bit operand in the register code.
+    int target; // Stack code offset the jump lands on.
+} Fixup;
+
+typedef struct {
+    Chunk *source;
+    Chunk code;
+    int *offsets; // Register code offset of each stack code offset.
+    int *targetDepths; // Stack depth a forward jump lands with, -1 if none does.
+    bool *isTarget;
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    Operand slots[MAX_REGISTERS];
+    int depth;
+    int maxDepth;
+    int line;
+    int resultOperand; // Destination operand of the last instruction, if it can be retargeted.
+    int resultEnd; // Code count right after that instruction.
+    bool failed;
+} Translator;
+
+static int instructionLength(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_LOOP:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+static bool isForwardJump(uint8_t instruction) {
+    return instruction >= OP_JUMP && instruction <= OP_JUMP_IF_NOT_LESS_EQUAL;
+}
+
+static int jumpTarget(Chunk *chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static void emit(Translator *t, uint8_t byte) {
+    writeChunk(&t->code, byte, t->line);
+}
+
+static void emit2(Translator *t, uint8_t instruction, uint8_t a) {
+    emit(t, instruction);
+    emit(t, a);
+}
+
+static void emit3(Translator *t, uint8_t instruction, uint8_t a, uint8_t b) {
+    emit(t, instruction);
+    emit(t, a);
+    emit(t, b);
+}
+
+static void emit4(Translator *t, uint8_t instruction, uint8_t a, uint8_t b, uint8_t c) {
+    emit(t, instruction);
+    emit(t, a);
+    emit(t, b);
+    emit(t, c);
+}
+
+/**
+ * Emits an instruction whose only effect is writing its first operand, so a
+ * following store to a local can redirect it there.
+ */
+static void emitResult(Translator *t, uint8_t instruction, uint8_t a, uint8_t b, uint8_t c, int operands) {
+    emit(t, instruction);
+    t->resultOperand = t->code.count;
+    emit(t, a);
+    if (operands > 1) emit(t, b);
+    if (operands > 2) emit(t, c);
+    t->resultEnd = t->code.count;
+}
+
+/**
+ * Copies a property instruction's inline cache index, keeping the instruction
+ * retargetable if it was emitted as a result.
+ */
+static void emitCacheOperand(Translator *t, const uint8_t *operand) {
+    bool endsResult = t->resultEnd == t->code.count;
+    emit(t, operand[0]);
+    emit(t, operand[1]);
+    if (endsResult) t->resultEnd = t->code.count;
+}
+
+/**
+ * Emits the 16-bit operand of a jump to the given stack code offset.
+ */
+static void emitJumpOperand(Translator *t, int target) {
+    if (t->fixupCount + 1 > t->fixupCapacity) {
+        int oldCapacity = t->fixupCapacity;
+        t->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        t->fixups = GROW_ARRAY(Fixup, t->fixups, oldCapacity, t->fixupCapacity);
+    }
+    t->fixups[t->fixupCount++] = (Fixup){t->code.count, target};
+    t->targetDepths[target] = t->depth;
+    emit(t, 0xff);
+    emit(t, 0xff);
+}
+
+static void pushOperand(Translator *t, Operand operand) {
+    if (t->depth == MAX_REGISTERS) {
+        t->failed = true;
+        return;
+    }
+    t->slots[t->depth++] = operand;
+    if (t->depth > t->maxDepth) t->maxDepth = t->depth;
+}
+
+static Operand registerOperand(int index) {
+    return (Operand){false, (uint8_t) index};
+}
+
+static void pushResult(Translator *t) {
+    pushOperand(t, registerOperand(t->depth));
+}
+
+static bool isCanonical(Translator *t, int slot) {
+    return !t->slots[slot].isConstant && t->slots[slot].index == slot;
+}
+
+/**
+ * Writes a pending copy out to the slot's own register.
+ */
+static void materialize(Translator *t, int slot) {
+    Operand operand = t->slots[slot];
+    if (operand.isConstant) {
+        emit3(t, ROP_LOADK, slot, operand.index);
+    } else if (operand.index != slot) {
+        emit3(t, ROP_MOVE, slot, operand.index);
+    } else {
+        return;
+    }
+    t->slots[slot] = registerOperand(slot);
+}
+
+static void flush(Translator *t) {
+    for (int slot = 0; slot < t->depth; slot++) {
+        materialize(t, slot);
+    }
+}
+
+/**
+ * Returns the register holding a slot's value, loading constants into the slot.
+ */
+static uint8_t readRegister(Translator *t, int slot) {
+    if (t->slots[slot].isConstant) materialize(t, slot);
+    return t->slots[slot].index;
+}
+
+static bool isCopied(Translator *t, int reg, int except) {
+    for (int slot = reg + 1; slot < t->depth; slot++) {
+        if (slot != except && !t->slots[slot].isConstant && t->slots[slot].index == reg) return true;
+    }
+    return false;
+}
+
+/**
+ * Writes out every pending copy of a local before it is overwritten.
+ */
+static void invalidateCopies(Translator *t, int reg, int except) {
+    for (int slot = reg + 1; slot < t->depth; slot++) {
+        if (slot != except && !t->slots[slot].isConstant && t->slots[slot].index == reg) materialize(t, slot);
+    }
+}
+
+static void setLocal(Translator *t, int local) {
+    int top = t->depth - 1;
+    if (isCanonical(t, top) && t->resultEnd == t->code.count &&
+        t->code.code[t->resultOperand] == top && !isCopied(t, local, top)) {
+        t->code.code[t->resultOperand] = (uint8_t) local;
+        t->slots[top] = registerOperand(local);
+    } else {
+        invalidateCopies(t, local, top);
+        Operand value = t->slots[top];
+        emit3(t, value.isConstant ? ROP_LOADK : ROP_MOVE, local, value.index);
+    }
+    t->slots[local] = registerOperand(local);
+}
+
+static void binary(Translator *t, uint8_t instruction, int constantInstruction) {
+    int left = t->depth - 2;
+    uint8_t a = readRegister(t, left);
+    Operand b = t->slots[t->depth - 1];
+    if (b.isConstant && constantInstruction >= 0) {
+        emitResult(t, constantInstruction, left, a, b.index, 3);
+    } else {
+        emitResult(t, instruction, left, a, readRegister(t, t->depth - 1), 3);
+    }
+    t->depth -= 2;
+    pushResult(t);
+}
+
+static void compareJump(Translator *t, int offset, uint8_t instruction, uint8_t constantInstruction) {
+    uint8_t a = readRegister(t, t->depth - 2);
+    Operand b = t->slots[t->depth - 1];
+    t->depth -= 2;
+    flush(t);
+    emit3(t, b.isConstant ? constantInstruction : instruction, a, b.index);
+    emitJumpOperand(t, jumpTarget(t->source, offset));
+}
+
+static bool nextIsPop(Translator *t, int next) {
+    return next < t->source->count && t->source->code[next] == OP_POP && !t->isTarget[next];
+}
+
+static void translateInstruction(Translator *t, int offset, int next) {
+    Chunk *source = t->source;
+    uint8_t *code = &source->code[offset];
+    int top = t->depth - 1;
+
+    switch (code[0]) {
+        case OP_CONSTANT: pushOperand(t, (Operand){true, code[1]});
+            break;
+        case OP_NULL: emitResult(t, ROP_NULL, t->depth, 0, 0, 1);
+            pushResult(t);
+            break;
+        case OP_TRUE: emitResult(t, ROP_TRUE, t->depth, 0, 0, 1);
+            pushResult(t);
+            break;
+        case OP_FALSE: emitResult(t, ROP_FALSE, t->depth, 0, 0, 1);
+            pushResult(t);
+            break;
+        case OP_POP: t->depth--;
+            break;
+        case OP_GET_LOCAL: materialize(t, code[1]);
+            pushOperand(t, registerOperand(code[1]));
+            break;
+        case OP_SET_LOCAL: setLocal(t, code[1]);
+            break;
+        case OP_GET_GLOBAL_SLOT: emitResult(t, ROP_GET_GLOBAL_SLOT, t->depth, code[1], code[2], 3);
+            pushResult(t);
+            break;
+        case OP_DEFINE_GLOBAL: emit3(t, ROP_DEFINE_GLOBAL, readRegister(t, top), code[1]);
+            t->depth--;
+            break;
+        case OP_SET_GLOBAL_SLOT: emit4(t, ROP_SET_GLOBAL_SLOT, readRegister(t, top), code[1], code[2]);
+            break;
+        case OP_GET_UPVALUE: emitResult(t, ROP_GET_UPVALUE, t->depth, code[1], 0, 2);
+            pushResult(t);
+            break;
+        case OP_SET_UPVALUE: emit3(t, ROP_SET_UPVALUE, readRegister(t, top), code[1]);
+            break;
+        case OP_GET_PROPERTY: emitResult(t, ROP_GET_PROPERTY, top, readRegister(t, top), code[1], 3);
+            emitCacheOperand(t, &code[2]);
+            t->slots[top] = registerOperand(top);
+            break;
+        case OP_SET_PROPERTY: {
+            uint8_t instance = readRegister(t, top - 1);
+            uint8_t value = readRegister(t, top);
+            emit4(t, ROP_SET_PROPERTY, instance, code[1], value);
+            emitCacheOperand(t, &code[2]);
+            t->depth -= 2;
+            if (nextIsPop(t, next) || value < top - 1) {
+                pushOperand(t, registerOperand(value));
+            } else {
+                emit3(t, ROP_MOVE, top - 1, value);
+                pushResult(t);
+            }
+            break;
+        }
+        case OP_GET_SUPER: {
+            uint8_t receiver = readRegister(t, top - 1);
+            uint8_t superclass = readRegister(t, top);
+            emit(t, ROP_GET_SUPER);
+            emit3(t, top - 1, receiver, superclass);
+            emit(t, code[1]);
+            t->depth -= 2;
+            pushResult(t);
+            break;
+        }
+        case OP_EQUAL: binary(t, ROP_EQUAL, -1);
+            break;
+        case OP_NOT_EQUAL: binary(t, ROP_NOT_EQUAL, -1);
+            break;
+        case OP_GREATER: binary(t, ROP_GREATER, -1);
+            break;
+        case OP_GREATER_EQUAL: binary(t, ROP_GREATER_EQUAL, -1);
+            break;
+        case OP_LESS: binary(t, ROP_LESS, -1);
+            break;
+        case OP_LESS_EQUAL: binary(t, ROP_LESS_EQUAL, -1);
+            break;
+        case OP_ADD: binary(t, ROP_ADD, ROP_ADDK);
+            break;
+        case OP_SUBTRACT: binary(t, ROP_SUBTRACT, ROP_SUBTRACTK);
+            break;
+        case OP_MULTIPLY: binary(t, ROP_MULTIPLY, ROP_MULTIPLYK);
+            break;
+        case OP_DIVIDE: binary(t, ROP_DIVIDE, ROP_DIVIDEK);
+            break;
+        case OP_MOD: binary(t, ROP_MOD, ROP_MODK);
+            break;
+        case OP_POW: binary(t, ROP_POW, -1);
+            break;
+        case OP_ADD_LOCALS: materialize(t, code[1]);
+            materialize(t, code[2]);
+            emitResult(t, ROP_ADD, t->depth, code[1], code[2], 3);
+            pushResult(t);
+            break;
+        case OP_ADD_LOCAL_CONSTANT: materialize(t, code[1]);
+            invalidateCopies(t, code[1], -1);
+            emit4(t, ROP_ADDK, code[1], code[1], code[2]);
+            pushOperand(t, registerOperand(code[1]));
+            break;
+        case OP_NOT: emitResult(t, ROP_NOT, top, readRegister(t, top), 0, 2);
+            t->slots[top] = registerOperand(top);
+            break;
+        case OP_NEGATE: emitResult(t, ROP_NEGATE, top, readRegister(t, top), 0, 2);
+            t->slots[top] = registerOperand(top);
+            break;
+        case OP_PRINT: emit2(t, ROP_PRINT, readRegister(t, top));
+            t->depth--;
+            break;
+        case OP_JUMP: flush(t);
+            emit(t, ROP_JUMP);
+            emitJumpOperand(t, jumpTarget(source, offset));
+            break;
+        case OP_JUMP_IF_FALSE: flush(t);
+            emit2(t, ROP_JUMP_IF_FALSE, top);
+            emitJumpOperand(t, jumpTarget(source, offset));
+            break;
+        case OP_JUMP_IF_EQUAL: compareJump(t, offset, ROP_JUMP_IF_EQUAL, ROP_JUMP_IF_EQUALK);
+            break;
+        case OP_JUMP_IF_NOT_EQUAL: compareJump(t, offset, ROP_JUMP_IF_NOT_EQUAL, ROP_JUMP_IF_NOT_EQUALK);
+            break;
+        case OP_JUMP_IF_NOT_GREATER: compareJump(t, offset, ROP_JUMP_IF_NOT_GREATER, ROP_JUMP_IF_NOT_GREATERK);
+            break;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            compareJump(t, offset, ROP_JUMP_IF_NOT_GREATER_EQUAL, ROP_JUMP_IF_NOT_GREATER_EQUALK);
+            break;
+        case OP_JUMP_IF_NOT_LESS: compareJump(t, offset, ROP_JUMP_IF_NOT_LESS, ROP_JUMP_IF_NOT_LESSK);
+            break;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            compareJump(t, offset, ROP_JUMP_IF_NOT_LESS_EQUAL, ROP_JUMP_IF_NOT_LESS_EQUALK);
+            break;
+        case OP_LOOP: {
+            flush(t);
+            emit(t, ROP_LOOP);
+            int jump = t->code.count + 2 - t->offsets[jumpTarget(source, offset)];
+            if (jump > UINT16_MAX) t->failed = true;
+            emit(t, (jump >> 8) & 0xff);
+            emit(t, jump & 0xff);
+            break;
+        }
+        case OP_CALL: {
+            flush(t);
+            int base = t->depth - code[1] - 1;
+            emit3(t, ROP_CALL, base, code[1]);
+            t->depth = base;
+            pushResult(t);
+            break;
+        }
+        case OP_INVOKE: {
+            flush(t);
+            int base = t->depth - code[2] - 1;
+            emit4(t, ROP_INVOKE, base, code[1], code[2]);
+            emitCacheOperand(t, &code[3]);
+            t->depth = base;
+            pushResult(t);
+            break;
+        }
+        case OP_SUPER_INVOKE: {
+            flush(t);
+            int base = t->depth - code[2] - 2;
+            emit4(t, ROP_SUPER_INVOKE, base, code[1], code[2]);
+            emitCacheOperand(t, &code[3]);
+            t->depth = base;
+            pushResult(t);
+            break;
+        }
+        case OP_CLOSURE: {
+            flush(t);
+            emit3(t, ROP_CLOSURE, t->depth, code[1]);
+            for (int i = 2; i < next - offset; i++) {
+                emit(t, code[i]);
+            }
+            pushResult(t);
+            break;
+        }
+        case OP_CLOSE_UPVALUE: materialize(t, top);
+            emit2(t, ROP_CLOSE_UPVALUE, top);
+            t->depth--;
+            break;
+        case OP_RETURN: emit2(t, ROP_RETURN, readRegister(t, top));
+            t->depth--;
+            break;
+        case OP_CLASS: emit3(t, ROP_CLASS, t->depth, code[1]);
+            pushResult(t);
+            break;
+        case OP_INHERIT: {
+            uint8_t superclass = readRegister(t, top - 1);
+            emit3(t, ROP_INHERIT, superclass, readRegister(t, top));
+            t->depth--;
+            break;
+        }
+        case OP_METHOD: {
+            uint8_t klass = readRegister(t, top - 1);
+            emit4(t, ROP_METHOD, klass, code[1], readRegister(t, top));
+            t->depth--;
+            break;
+        }
+        case OP_POINT_RIGHT:
+        case OP_POINT_LEFT:
+        case OP_TYPE:
+        case OP_COLON:
+            break;
+        default:
+            t->failed = true;
+            break;
+    }
+
+    if (t->depth < 0) t->failed = true;
+}
+
+static bool patchJumps(Translator *t) {
+    for (int i = 0; i < t->fixupCount; i++) {
+        Fixup *fixup = &t->fixups[i];
+        int jump = t->offsets[fixup->target] - (fixup->position + 2);
+        if (jump < 0 || jump > UINT16_MAX) return false;
+        t->code.code[fixup->position] = (jump >> 8) & 0xff;
+        t->code.code[fixup->position + 1] = jump & 0xff;
+    }
+    return true;
+}
+
+/**
+ * Replaces a function's stack code with register code. Functions that need more
+ * than 256 registers, or whose jumps no longer fit, keep their stack code and
+ * run on the stack interpreter.
+ * @param function The function to translate, still reachable by the collector.
+ * @return True if the function now holds register code.
+ */
+bool translateToRegisters(ObjFunction *function) {
+    Translator t;
+    Chunk *source = &function->chunk;
+    int count = source->count;
+    t.source = source;
+    initChunk(&t.code);
+    t.offsets = ALLOCATE(int, count + 1);
+    t.targetDepths = ALLOCATE(int, count + 1);
+    t.isTarget = ALLOCATE(bool, count + 1);
+    t.fixups = nullptr;
+    t.fixupCount = 0;
+    t.fixupCapacity = 0;
+    t.depth = 0;
+    t.maxDepth = 0;
+    t.line = 0;
+    t.resultOperand = -1;
+    t.resultEnd = -1;
+    t.failed = false;
+
+    for (int offset = 0; offset <= count; offset++) {
+        t.isTarget[offset] = false;
+        t.targetDepths[offset] = -1;
+    }
+    for (int offset = 0; offset < count; offset += instructionLength(source, offset)) {
+        if (isForwardJump(source->code[offset]) || source->code[offset] == OP_LOOP) {
+            t.isTarget[jumpTarget(source, offset)] = true;
+        }
+    }
+
+    // Slot zero holds the callee or receiver, followed by the parameters.
+    for (int slot = 0; slot <= function->arity; slot++) {
+        pushResult(&t);
+    }
+
+    int offset = 0;
+    while (offset < count && !t.failed) {
+        if (t.isTarget[offset]) {
+            flush(&t);
+            t.resultEnd = -1;
+            // Code after an unconditional jump is only reached by jumping, and a
+            // pop that followed a conditional jump applies to the fallthrough.
+            if (t.targetDepths[offset] >= 0) {
+                t.depth = 0;
+                while (t.depth < t.targetDepths[offset]) pushResult(&t);
+            }
+        }
+        t.offsets[offset] = t.code.count;
+        t.line = source->lines[offset];
+        int next = offset + instructionLength(source, offset);
+        translateInstruction(&t, offset, next);
+        offset = next;
+    }
+    t.offsets[count] = t.code.count;
+
+    bool translated = !t.failed && patchJumps(&t);
+    if (translated) {
+        FREE_ARRAY(uint8_t, source->code, source->capacity);
+        FREE_ARRAY(int, source->lines, source->capacity);
+        source->code = t.code.code;
+        source->lines = t.code.lines;
+        source->count = t.code.count;
+        source->capacity = t.code.capacity;
+        function->frameSize = t.maxDepth;
+    } else {
+        freeChunk(&t.code);
+    }
+
+    FREE_ARRAY(Fixup, t.fixups, t.fixupCapacity);
+    FREE_ARRAY(bool, t.isTarget, count + 1);
+    FREE_ARRAY(int, t.targetDepths, count + 1);
+    FREE_ARRAY(int, t.offsets, count + 1);
+    return translated;
+}
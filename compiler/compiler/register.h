@@ -0,0 +1,12 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef register_h
+#define register_h
+
+#include "../object.h"
+
+bool translateToRegisters(ObjFunction *function);
+
+#endif //register_h
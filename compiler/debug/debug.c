@@ -7,6 +7,135 @@
 #include "debug.h"
 #include "../object.h"
 #include "../value.h"
+#include "../geccovm/vm.h"
+
+static const char* opcodeNames[] = {
+  [OP_CONSTANT] = "OP_CONSTANT",
+  [OP_NULL] = "OP_NULL",
+  [OP_TRUE] = "OP_TRUE",
+  [OP_FALSE] = "OP_FALSE",
+  [OP_POP] = "OP_POP",
+  [OP_GET_LOCAL] = "OP_GET_LOCAL",
+  [OP_SET_LOCAL] = "OP_SET_LOCAL",
+  [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+  [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+  [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+  [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+  [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+  [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+  [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+  [OP_GET_SUPER] = "OP_GET_SUPER",
+  [OP_EQUAL] = "OP_EQUAL",
+  [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+  [OP_GREATER] = "OP_GREATER",
+  [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+  [OP_LESS] = "OP_LESS",
+  [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+  [OP_ADD] = "OP_ADD",
+  [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+  [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+  [OP_SUBTRACT] = "OP_SUBTRACT",
+  [OP_MULTIPLY] = "OP_MULTIPLY",
+  [OP_DIVIDE] = "OP_DIVIDE",
+  [OP_MOD] = "OP_MOD",
+  [OP_POW] = "OP_POW",
+  [OP_NOT] = "OP_NOT",
+  [OP_NEGATE] = "OP_NEGATE",
+  [OP_PRINT] = "OP_PRINT",
+  [OP_JUMP] = "OP_JUMP",
+  [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+  [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+  [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+  [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+  [OP_JUMP_IF_NOT_GREATER_EQUAL] = "OP_JUMP_IF_NOT_GREATER_EQUAL",
+  [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+  [OP_JUMP_IF_NOT_LESS_EQUAL] = "OP_JUMP_IF_NOT_LESS_EQUAL",
+  [OP_LOOP] = "OP_LOOP",
+  [OP_CALL] = "OP_CALL",
+  [OP_INVOKE] = "OP_INVOKE",
+  [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+  [OP_CLOSURE] = "OP_CLOSURE",
+  [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+  [OP_RETURN] = "OP_RETURN",
+  [OP_CLASS] = "OP_CLASS",
+  [OP_INHERIT] = "OP_INHERIT",
+  [OP_METHOD] = "OP_METHOD",
+  [OP_POINT_RIGHT] = "OP_POINT_RIGHT",
+  [OP_POINT_LEFT] = "OP_POINT_LEFT",
+  [OP_TYPE] = "OP_TYPE",
+  [OP_COLON] = "OP_COLON",
+  [OP_ADD_NUM] = "OP_ADD_NUM",
+  [OP_ADD_STR] = "OP_ADD_STR",
+  [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+  [OP_NOT_EQUAL_NUM] = "OP_NOT_EQUAL_NUM",
+  [OP_JUMP_IF_EQUAL_NUM] = "OP_JUMP_IF_EQUAL_NUM",
+  [OP_JUMP_IF_NOT_EQUAL_NUM] = "OP_JUMP_IF_NOT_EQUAL_NUM",
+  [ROP_MOVE] = "ROP_MOVE",
+  [ROP_LOADK] = "ROP_LOADK",
+  [ROP_NULL] = "ROP_NULL",
+  [ROP_TRUE] = "ROP_TRUE",
+  [ROP_FALSE] = "ROP_FALSE",
+  [ROP_GET_GLOBAL_SLOT] = "ROP_GET_GLOBAL_SLOT",
+  [ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+  [ROP_SET_GLOBAL_SLOT] = "ROP_SET_GLOBAL_SLOT",
+  [ROP_GET_UPVALUE] = "ROP_GET_UPVALUE",
+  [ROP_SET_UPVALUE] = "ROP_SET_UPVALUE",
+  [ROP_GET_PROPERTY] = "ROP_GET_PROPERTY",
+  [ROP_SET_PROPERTY] = "ROP_SET_PROPERTY",
+  [ROP_GET_SUPER] = "ROP_GET_SUPER",
+  [ROP_EQUAL] = "ROP_EQUAL",
+  [ROP_NOT_EQUAL] = "ROP_NOT_EQUAL",
+  [ROP_GREATER] = "ROP_GREATER",
+  [ROP_GREATER_EQUAL] = "ROP_GREATER_EQUAL",
+  [ROP_LESS] = "ROP_LESS",
+  [ROP_LESS_EQUAL] = "ROP_LESS_EQUAL",
+  [ROP_ADD] = "ROP_ADD",
+  [ROP_SUBTRACT] = "ROP_SUBTRACT",
+  [ROP_MULTIPLY] = "ROP_MULTIPLY",
+  [ROP_DIVIDE] = "ROP_DIVIDE",
+  [ROP_MOD] = "ROP_MOD",
+  [ROP_POW] = "ROP_POW",
+  [ROP_ADDK] = "ROP_ADDK",
+  [ROP_SUBTRACTK] = "ROP_SUBTRACTK",
+  [ROP_MULTIPLYK] = "ROP_MULTIPLYK",
+  [ROP_DIVIDEK] = "ROP_DIVIDEK",
+  [ROP_MODK] = "ROP_MODK",
+  [ROP_NOT] = "ROP_NOT",
+  [ROP_NEGATE] = "ROP_NEGATE",
+  [ROP_PRINT] = "ROP_PRINT",
+  [ROP_JUMP] = "ROP_JUMP",
+  [ROP_JUMP_IF_FALSE] = "ROP_JUMP_IF_FALSE",
+  [ROP_JUMP_IF_EQUAL] = "ROP_JUMP_IF_EQUAL",
+  [ROP_JUMP_IF_NOT_EQUAL] = "ROP_JUMP_IF_NOT_EQUAL",
+  [ROP_JUMP_IF_NOT_GREATER] = "ROP_JUMP_IF_NOT_GREATER",
+  [ROP_JUMP_IF_NOT_GREATER_EQUAL] = "ROP_JUMP_IF_NOT_GREATER_EQUAL",
+  [ROP_JUMP_IF_NOT_LESS] = "ROP_JUMP_IF_NOT_LESS",
+  [ROP_JUMP_IF_NOT_LESS_EQUAL] = "ROP_JUMP_IF_NOT_LESS_EQUAL",
+  [ROP_JUMP_IF_EQUALK] = "ROP_JUMP_IF_EQUALK",
+  [ROP_JUMP_IF_NOT_EQUALK] = "ROP_JUMP_IF_NOT_EQUALK",
+  [ROP_JUMP_IF_NOT_GREATERK] = "ROP_JUMP_IF_NOT_GREATERK",
+  [ROP_JUMP_IF_NOT_GREATER_EQUALK] = "ROP_JUMP_IF_NOT_GREATER_EQUALK",
+  [ROP_JUMP_IF_NOT_LESSK] = "ROP_JUMP_IF_NOT_LESSK",
+  [ROP_JUMP_IF_NOT_LESS_EQUALK] = "ROP_JUMP_IF_NOT_LESS_EQUALK",
+  [ROP_LOOP] = "ROP_LOOP",
+  [ROP_CALL] = "ROP_CALL",
+  [ROP_INVOKE] = "ROP_INVOKE",
+  [ROP_SUPER_INVOKE] = "ROP_SUPER_INVOKE",
+  [ROP_CLOSURE] = "ROP_CLOSURE",
+  [ROP_CLOSE_UPVALUE] = "ROP_CLOSE_UPVALUE",
+  [ROP_RETURN] = "ROP_RETURN",
+  [ROP_CLASS] = "ROP_CLASS",
+  [ROP_INHERIT] = "ROP_INHERIT",
+  [ROP_METHOD] = "ROP_METHOD",
+};
+
+const char* opcodeName(uint8_t instruction) {
+  if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+      opcodeNames[instruction] == NULL) {
+    return "OP_UNKNOWN";
+  }
+  return opcodeNames[instruction];
+}
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -24,13 +153,35 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static void printGlobalSlot(Chunk* chunk, int offset) {
+  uint16_t slot = (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+  printf(" g%d '%s'", slot, vm.globalSlots[slot].name->chars);
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  printf("%-16s", name);
+  printGlobalSlot(chunk, offset + 1);
+  printf("\n");
+  return offset + 3;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic%d\n", cache);
+  return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
-  printf("'\n");
-  return offset + 3;
+  printf("' ic%d\n", cache);
+  return offset + 5;
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -44,6 +195,22 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2; // [debug]
 }
 
+static int localsInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -52,6 +219,46 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+/**
+ * Prints a register instruction from its operand kinds: r register, k constant,
+ * n plain byte, c inline cache index, g global slot, j forward jump and l backward jump.
+ */
+static int registerInstruction(const char* name, const char* operands, Chunk* chunk, int offset) {
+  printf("%-16s", name);
+  int next = offset + 1;
+  for (const char* kind = operands; *kind != '\0'; kind++) {
+    switch (*kind) {
+      case 'r':
+        printf(" r%d", chunk->code[next++]);
+        break;
+      case 'n':
+        printf(" %d", chunk->code[next++]);
+        break;
+      case 'k':
+        printf(" '");
+        printValue(chunk->constants.values[chunk->code[next++]]);
+        printf("'");
+        break;
+      case 'c':
+        printf(" ic%d", (chunk->code[next] << 8) | chunk->code[next + 1]);
+        next += 2;
+        break;
+      case 'g':
+        printGlobalSlot(chunk, next);
+        next += 2;
+        break;
+      default: {
+        uint16_t jump = (uint16_t)((chunk->code[next] << 8) | chunk->code[next + 1]);
+        next += 2;
+        printf(" -> %d", *kind == 'l' ? next - jump : next + jump);
+        break;
+      }
+    }
+  }
+  printf("\n");
+  return next;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 &&
@@ -77,30 +284,48 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_SLOT:
+      return globalInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
     case OP_DEFINE_GLOBAL:
       return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_SLOT:
+      return globalInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_EQUAL:
       return simpleInstruction("OP_EQUAL", offset);
+    case OP_NOT_EQUAL:
+      return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_EQUAL_NUM:
+      return simpleInstruction("OP_EQUAL_NUM", offset);
+    case OP_NOT_EQUAL_NUM:
+      return simpleInstruction("OP_NOT_EQUAL_NUM", offset);
     case OP_GREATER:
       return simpleInstruction("OP_GREATER", offset);
+    case OP_GREATER_EQUAL:
+      return simpleInstruction("OP_GREATER_EQUAL", offset);
     case OP_LESS:
       return simpleInstruction("OP_LESS", offset);
+    case OP_LESS_EQUAL:
+      return simpleInstruction("OP_LESS_EQUAL", offset);
     case OP_ADD:
       return simpleInstruction("OP_ADD", offset);
+    case OP_ADD_LOCALS:
+      return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simpleInstruction("OP_ADD_STR", offset);
     case OP_SUBTRACT:
       return simpleInstruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
@@ -121,6 +346,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL_NUM:
+      return jumpInstruction("OP_JUMP_IF_EQUAL_NUM", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL_NUM:
+      return jumpInstruction("OP_JUMP_IF_NOT_EQUAL_NUM", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
@@ -157,6 +398,137 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
+    case ROP_MOVE:
+      return registerInstruction("ROP_MOVE", "rr", chunk, offset);
+    case ROP_LOADK:
+      return registerInstruction("ROP_LOADK", "rk", chunk, offset);
+    case ROP_NULL:
+      return registerInstruction("ROP_NULL", "r", chunk, offset);
+    case ROP_TRUE:
+      return registerInstruction("ROP_TRUE", "r", chunk, offset);
+    case ROP_FALSE:
+      return registerInstruction("ROP_FALSE", "r", chunk, offset);
+    case ROP_GET_GLOBAL_SLOT:
+      return registerInstruction("ROP_GET_GLOBAL_SLOT", "rg", chunk, offset);
+    case ROP_DEFINE_GLOBAL:
+      return registerInstruction("ROP_DEFINE_GLOBAL", "rk", chunk, offset);
+    case ROP_SET_GLOBAL_SLOT:
+      return registerInstruction("ROP_SET_GLOBAL_SLOT", "rg", chunk, offset);
+    case ROP_GET_UPVALUE:
+      return registerInstruction("ROP_GET_UPVALUE", "rn", chunk, offset);
+    case ROP_SET_UPVALUE:
+      return registerInstruction("ROP_SET_UPVALUE", "rn", chunk, offset);
+    case ROP_GET_PROPERTY:
+      return registerInstruction("ROP_GET_PROPERTY", "rrkc", chunk, offset);
+    case ROP_SET_PROPERTY:
+      return registerInstruction("ROP_SET_PROPERTY", "rkrc", chunk, offset);
+    case ROP_GET_SUPER:
+      return registerInstruction("ROP_GET_SUPER", "rrrk", chunk, offset);
+    case ROP_EQUAL:
+      return registerInstruction("ROP_EQUAL", "rrr", chunk, offset);
+    case ROP_NOT_EQUAL:
+      return registerInstruction("ROP_NOT_EQUAL", "rrr", chunk, offset);
+    case ROP_GREATER:
+      return registerInstruction("ROP_GREATER", "rrr", chunk, offset);
+    case ROP_GREATER_EQUAL:
+      return registerInstruction("ROP_GREATER_EQUAL", "rrr", chunk, offset);
+    case ROP_LESS:
+      return registerInstruction("ROP_LESS", "rrr", chunk, offset);
+    case ROP_LESS_EQUAL:
+      return registerInstruction("ROP_LESS_EQUAL", "rrr", chunk, offset);
+    case ROP_ADD:
+      return registerInstruction("ROP_ADD", "rrr", chunk, offset);
+    case ROP_SUBTRACT:
+      return registerInstruction("ROP_SUBTRACT", "rrr", chunk, offset);
+    case ROP_MULTIPLY:
+      return registerInstruction("ROP_MULTIPLY", "rrr", chunk, offset);
+    case ROP_DIVIDE:
+      return registerInstruction("ROP_DIVIDE", "rrr", chunk, offset);
+    case ROP_MOD:
+      return registerInstruction("ROP_MOD", "rrr", chunk, offset);
+    case ROP_POW:
+      return registerInstruction("ROP_POW", "rrr", chunk, offset);
+    case ROP_ADDK:
+      return registerInstruction("ROP_ADDK", "rrk", chunk, offset);
+    case ROP_SUBTRACTK:
+      return registerInstruction("ROP_SUBTRACTK", "rrk", chunk, offset);
+    case ROP_MULTIPLYK:
+      return registerInstruction("ROP_MULTIPLYK", "rrk", chunk, offset);
+    case ROP_DIVIDEK:
+      return registerInstruction("ROP_DIVIDEK", "rrk", chunk, offset);
+    case ROP_MODK:
+      return registerInstruction("ROP_MODK", "rrk", chunk, offset);
+    case ROP_NOT:
+      return registerInstruction("ROP_NOT", "rr", chunk, offset);
+    case ROP_NEGATE:
+      return registerInstruction("ROP_NEGATE", "rr", chunk, offset);
+    case ROP_PRINT:
+      return registerInstruction("ROP_PRINT", "r", chunk, offset);
+    case ROP_JUMP:
+      return registerInstruction("ROP_JUMP", "j", chunk, offset);
+    case ROP_JUMP_IF_FALSE:
+      return registerInstruction("ROP_JUMP_IF_FALSE", "rj", chunk, offset);
+    case ROP_JUMP_IF_EQUAL:
+      return registerInstruction("ROP_JUMP_IF_EQUAL", "rrj", chunk, offset);
+    case ROP_JUMP_IF_NOT_EQUAL:
+      return registerInstruction("ROP_JUMP_IF_NOT_EQUAL", "rrj", chunk, offset);
+    case ROP_JUMP_IF_NOT_GREATER:
+      return registerInstruction("ROP_JUMP_IF_NOT_GREATER", "rrj", chunk, offset);
+    case ROP_JUMP_IF_NOT_GREATER_EQUAL:
+      return registerInstruction("ROP_JUMP_IF_NOT_GREATER_EQUAL", "rrj", chunk, offset);
+    case ROP_JUMP_IF_NOT_LESS:
+      return registerInstruction("ROP_JUMP_IF_NOT_LESS", "rrj", chunk, offset);
+    case ROP_JUMP_IF_NOT_LESS_EQUAL:
+      return registerInstruction("ROP_JUMP_IF_NOT_LESS_EQUAL", "rrj", chunk, offset);
+    case ROP_JUMP_IF_EQUALK:
+      return registerInstruction("ROP_JUMP_IF_EQUALK", "rkj", chunk, offset);
+    case ROP_JUMP_IF_NOT_EQUALK:
+      return registerInstruction("ROP_JUMP_IF_NOT_EQUALK", "rkj", chunk, offset);
+    case ROP_JUMP_IF_NOT_GREATERK:
+      return registerInstruction("ROP_JUMP_IF_NOT_GREATERK", "rkj", chunk, offset);
+    case ROP_JUMP_IF_NOT_GREATER_EQUALK:
+      return registerInstruction("ROP_JUMP_IF_NOT_GREATER_EQUALK", "rkj", chunk, offset);
+    case ROP_JUMP_IF_NOT_LESSK:
+      return registerInstruction("ROP_JUMP_IF_NOT_LESSK", "rkj", chunk, offset);
+    case ROP_JUMP_IF_NOT_LESS_EQUALK:
+      return registerInstruction("ROP_JUMP_IF_NOT_LESS_EQUALK", "rkj", chunk, offset);
+    case ROP_LOOP:
+      return registerInstruction("ROP_LOOP", "l", chunk, offset);
+    case ROP_CALL:
+      return registerInstruction("ROP_CALL", "rn", chunk, offset);
+    case ROP_INVOKE:
+      return registerInstruction("ROP_INVOKE", "rknc", chunk, offset);
+    case ROP_SUPER_INVOKE:
+      return registerInstruction("ROP_SUPER_INVOKE", "rknc", chunk, offset);
+    case ROP_CLOSE_UPVALUE:
+      return registerInstruction("ROP_CLOSE_UPVALUE", "r", chunk, offset);
+    case ROP_RETURN:
+      return registerInstruction("ROP_RETURN", "r", chunk, offset);
+    case ROP_CLASS:
+      return registerInstruction("ROP_CLASS", "rk", chunk, offset);
+    case ROP_INHERIT:
+      return registerInstruction("ROP_INHERIT", "rr", chunk, offset);
+    case ROP_METHOD:
+      return registerInstruction("ROP_METHOD", "rkr", chunk, offset);
+    case ROP_CLOSURE: {
+      uint8_t target = chunk->code[offset + 1];
+      uint8_t constant = chunk->code[offset + 2];
+      printf("%-16s r%d ", "ROP_CLOSURE", target);
+      printValue(chunk->constants.values[constant]);
+      printf("\n");
+      offset += 3;
+
+      const ObjFunction* function = AS_FUNCTION(
+          chunk->constants.values[constant]);
+      for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        printf("%04d      |                     %s %d\n",
+               offset - 2, isLocal ? "local" : "upvalue", index);
+      }
+
+      return offset;
+    }
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
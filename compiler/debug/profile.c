@@ -0,0 +1,83 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+//> Opcode pair profiling, built in with GECCO_PROFILE_OPCODES.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+#include "debug.h"
+
+#define PROFILE_TOP 40
+
+typedef struct {
+    uint64_t count;
+    uint8_t first;
+    uint8_t second;
+} PairCount;
+
+static uint64_t singles[UINT8_COUNT];
+static uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+static int previous = -1;
+
+/**
+ * Counts an executed instruction and the pair it forms with the one before it.
+ * @param instruction The opcode about to run.
+ */
+void profileInstruction(uint8_t instruction) {
+    singles[instruction]++;
+    if (previous != -1) pairs[previous][instruction]++;
+    previous = instruction;
+}
+
+static int comparePairs(const void *a, const void *b) {
+    uint64_t left = ((const PairCount *) a)->count;
+    uint64_t right = ((const PairCount *) b)->count;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+/**
+ * Prints the most executed opcodes and opcode pairs to stderr. Lines are
+ * "count name [name]" so runs over several scripts can be summed with awk.
+ */
+void printInstructionProfile() {
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) total += singles[i];
+    if (total == 0) return;
+
+    PairCount *counts = malloc(sizeof(PairCount) * UINT8_COUNT * UINT8_COUNT);
+    if (counts == NULL) return;
+
+    int used = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (singles[i] == 0) continue;
+        counts[used++] = (PairCount){singles[i], (uint8_t) i, 0};
+    }
+    qsort(counts, used, sizeof(PairCount), comparePairs);
+
+    fprintf(stderr, "== opcodes (%llu executed) ==\n", (unsigned long long) total);
+    for (int i = 0; i < used && i < PROFILE_TOP; i++) {
+        fprintf(stderr, "%12llu %5.2f%% %s\n", (unsigned long long) counts[i].count,
+                100.0 * counts[i].count / total, opcodeName(counts[i].first));
+    }
+
+    used = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        for (int j = 0; j < UINT8_COUNT; j++) {
+            if (pairs[i][j] == 0) continue;
+            counts[used++] = (PairCount){pairs[i][j], (uint8_t) i, (uint8_t) j};
+        }
+    }
+    qsort(counts, used, sizeof(PairCount), comparePairs);
+
+    fprintf(stderr, "== opcode pairs ==\n");
+    for (int i = 0; i < used && i < PROFILE_TOP; i++) {
+        fprintf(stderr, "%12llu %5.2f%% %s %s\n", (unsigned long long) counts[i].count,
+                100.0 * counts[i].count / total, opcodeName(counts[i].first),
+                opcodeName(counts[i].second));
+    }
+
+    free(counts);
+}
@@ -0,0 +1,13 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef profile_h
+#define profile_h
+
+#include "../common.h"
+
+void profileInstruction(uint8_t instruction);
+void printInstructionProfile();
+
+#endif //profile_h
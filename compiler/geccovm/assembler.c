@@ -0,0 +1,237 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS under strict ISO C modes.
+
+#include "assembler.h"
+
+#ifdef BASELINE_JIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+bool asmReserve(Assembler *as, void **array, int *capacity, int count, size_t size) {
+    if (count < *capacity) return true;
+    int newCapacity = *capacity < 64 ? 64 : *capacity * 2;
+    void *grown = realloc(*array, newCapacity * size);
+    if (grown == NULL) {
+        as->failed = true;
+        return false;
+    }
+    *array = grown;
+    *capacity = newCapacity;
+    return true;
+}
+
+void asmFree(Assembler *as) {
+    free(as->code);
+    as->code = NULL;
+    as->count = 0;
+    as->capacity = 0;
+}
+
+void asmByte(Assembler *as, uint8_t byte) {
+    if (!asmReserve(as, (void **) &as->code, &as->capacity, as->count, 1)) return;
+    as->code[as->count++] = byte;
+}
+
+void asmBytes(Assembler *as, const uint8_t *bytes, int count) {
+    for (int i = 0; i < count; i++) asmByte(as, bytes[i]);
+}
+
+void asmInt32(Assembler *as, int32_t value) {
+    uint8_t bytes[4];
+    memcpy(bytes, &value, sizeof(bytes));
+    asmBytes(as, bytes, 4);
+}
+
+void asmInt64(Assembler *as, uint64_t value) {
+    uint8_t bytes[8];
+    memcpy(bytes, &value, sizeof(bytes));
+    asmBytes(as, bytes, 8);
+}
+
+void asmPatchInt32(Assembler *as, int at, int32_t value) {
+    if (as->failed) return;
+    memcpy(&as->code[at], &value, sizeof(value));
+}
+
+/** REX prefix for a 64-bit operation between ModRM [reg] and [rm]. */
+static void emitRexWide(Assembler *as, int reg, int rm) {
+    asmByte(as, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+/** REX prefix for a 32-bit or SSE operation, left out when neither operand needs it. */
+static void emitRex(Assembler *as, int reg, int rm) {
+    if ((reg | rm) & 8) asmByte(as, 0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+/** ModRM (and SIB) addressing [base + disp] with [reg] in the reg field. */
+static void emitMemoryOperand(Assembler *as, int reg, int base, int32_t disp) {
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    }
+
+    asmByte(as, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) asmByte(as, 0x24);
+    if (mod == 1) asmByte(as, (uint8_t) disp);
+    if (mod == 2) asmInt32(as, disp);
+}
+
+static void emitRegisterOperand(Assembler *as, int reg, int rm) {
+    asmByte(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void asmLoad(Assembler *as, Register dst, Register base, int32_t disp) {
+    emitRexWide(as, dst, base);
+    asmByte(as, 0x8B);
+    emitMemoryOperand(as, dst, base, disp);
+}
+
+void asmLoad32(Assembler *as, Register dst, Register base, int32_t disp) {
+    emitRex(as, dst, base);
+    asmByte(as, 0x8B);
+    emitMemoryOperand(as, dst, base, disp);
+}
+
+void asmStore(Assembler *as, Register base, int32_t disp, Register src) {
+    emitRexWide(as, src, base);
+    asmByte(as, 0x89);
+    emitMemoryOperand(as, src, base, disp);
+}
+
+void asmMoveImmediate(Assembler *as, Register dst, uint64_t value) {
+    if (value <= UINT32_MAX) {
+        if (dst & 8) asmByte(as, 0x41);
+        asmByte(as, 0xB8 + (dst & 7));
+        asmInt32(as, (int32_t) value);
+        return;
+    }
+    emitRexWide(as, 0, dst);
+    asmByte(as, 0xB8 + (dst & 7));
+    asmInt64(as, value);
+}
+
+void asmAlu(Assembler *as, uint8_t opcode, Register dst, Register src) {
+    emitRexWide(as, src, dst);
+    asmByte(as, opcode);
+    emitRegisterOperand(as, src, dst);
+}
+
+void asmAddImmediate(Assembler *as, Register reg, int32_t value) {
+    emitRexWide(as, 0, reg);
+    asmByte(as, 0x81);
+    emitRegisterOperand(as, 0, reg);
+    asmInt32(as, value);
+}
+
+void asmCompareMemory8(Assembler *as, Register base, int32_t disp, int8_t value) {
+    emitRex(as, 0, base);
+    asmByte(as, 0x80);
+    emitMemoryOperand(as, 7, base, disp);
+    asmByte(as, (uint8_t) value);
+}
+
+void asmCompareMemory32(Assembler *as, Register base, int32_t disp, int32_t value) {
+    emitRex(as, 0, base);
+    asmByte(as, 0x81);
+    emitMemoryOperand(as, 7, base, disp);
+    asmInt32(as, value);
+}
+
+void asmMoveToXmm(Assembler *as, int xmm, Register reg) {
+    asmByte(as, 0x66);
+    emitRexWide(as, xmm, reg);
+    asmBytes(as, (uint8_t[]){0x0F, 0x6E}, 2);
+    emitRegisterOperand(as, xmm, reg);
+}
+
+void asmMoveFromXmm(Assembler *as, Register reg, int xmm) {
+    asmByte(as, 0x66);
+    emitRexWide(as, xmm, reg);
+    asmBytes(as, (uint8_t[]){0x0F, 0x7E}, 2);
+    emitRegisterOperand(as, xmm, reg);
+}
+
+void asmSse(Assembler *as, uint8_t prefix, uint8_t opcode, int reg, int rm) {
+    if (prefix != 0) asmByte(as, prefix);
+    emitRex(as, reg, rm);
+    asmBytes(as, (uint8_t[]){0x0F, opcode}, 2);
+    emitRegisterOperand(as, reg, rm);
+}
+
+void asmLoadDouble(Assembler *as, int xmm, Register base, int32_t disp) {
+    asmByte(as, 0xF2);
+    emitRex(as, xmm, base);
+    asmBytes(as, (uint8_t[]){0x0F, 0x10}, 2);
+    emitMemoryOperand(as, xmm, base, disp);
+}
+
+void asmStoreDouble(Assembler *as, Register base, int32_t disp, int xmm) {
+    asmByte(as, 0xF2);
+    emitRex(as, xmm, base);
+    asmBytes(as, (uint8_t[]){0x0F, 0x11}, 2);
+    emitMemoryOperand(as, xmm, base, disp);
+}
+
+void asmSetCondition(Assembler *as, int condition) {
+    asmBytes(as, (uint8_t[]){0x0F, 0x90 + condition, 0xC0, 0x0F, 0xB6, 0xC0}, 6);
+}
+
+int asmJumpIf(Assembler *as, int condition) {
+    asmBytes(as, (uint8_t[]){0x0F, 0x80 + condition}, 2);
+    asmInt32(as, 0);
+    return as->count - 4;
+}
+
+int asmJump(Assembler *as) {
+    asmByte(as, 0xE9);
+    asmInt32(as, 0);
+    return as->count - 4;
+}
+
+void asmPatchJump(Assembler *as, int from, int to) {
+    asmPatchInt32(as, from, to - (from + 4));
+}
+
+void asmCall(Assembler *as, void *function) {
+    asmMoveImmediate(as, RAX, (uint64_t) (uintptr_t) function);
+    asmBytes(as, (uint8_t[]){0xFF, 0xD0}, 2);
+}
+
+void asmPrologue(Assembler *as, int32_t frameBytes) {
+    asmBytes(as, (uint8_t[]){0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}, 10); // push rbp, rbx, r12-r15
+    asmAddImmediate(as, RSP, -frameBytes);
+}
+
+void asmEpilogue(Assembler *as, int32_t frameBytes) {
+    asmAddImmediate(as, RSP, frameBytes);
+    asmBytes(as, (uint8_t[]){0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D, 0xC3}, 11); // pop r15-r12, rbx, rbp; ret
+}
+
+uint8_t *asmInstall(Assembler *as) {
+    if (as->failed || as->count == 0) return NULL;
+    uint8_t *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+    memcpy(code, as->code, as->count);
+    mprotect(code, as->count, PROT_READ | PROT_EXEC);
+    return code;
+}
+
+void asmRelease(uint8_t *code, size_t size) {
+    munmap(code, size);
+}
+
+bool asmRewrite(uint8_t *code, size_t size, size_t at, const uint8_t *bytes, int count) {
+    if (mprotect(code, size, PROT_READ | PROT_WRITE) != 0) return false;
+    memcpy(code + at, bytes, count);
+    mprotect(code, size, PROT_READ | PROT_EXEC);
+    return true;
+}
+
+#endif
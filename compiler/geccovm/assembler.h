@@ -0,0 +1,114 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef assembler_h
+#define assembler_h
+
+#include "../common.h"
+
+#ifdef BASELINE_JIT
+
+/*
+ * A small x86-64 encoder shared by the native tiers: the method JIT in jit.c and
+ * the trace compiler in trace.c. Code is collected in a growable buffer and copied
+ * into executable memory once complete.
+ */
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// Condition codes, as used by jcc and setcc.
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_P 0xA
+#define CC_NP 0xB
+
+// Opcodes of the register to register forms used with asmAlu().
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+// Scalar double opcodes for asmSse() with the 0xF2 prefix.
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+    bool failed; // Out of memory; the code is abandoned.
+} Assembler;
+
+/** Makes room for one more element of [size] bytes, doubling the array as needed. */
+bool asmReserve(Assembler *as, void **array, int *capacity, int count, size_t size);
+void asmFree(Assembler *as);
+
+void asmByte(Assembler *as, uint8_t byte);
+void asmBytes(Assembler *as, const uint8_t *bytes, int count);
+void asmInt32(Assembler *as, int32_t value);
+void asmInt64(Assembler *as, uint64_t value);
+void asmPatchInt32(Assembler *as, int at, int32_t value);
+
+// mov dst, [base + disp]
+void asmLoad(Assembler *as, Register dst, Register base, int32_t disp);
+// mov dst32, [base + disp], zero-extending into the full register
+void asmLoad32(Assembler *as, Register dst, Register base, int32_t disp);
+// mov [base + disp], src
+void asmStore(Assembler *as, Register base, int32_t disp, Register src);
+// mov dst, imm, using the zero-extending 32-bit form when the value fits.
+void asmMoveImmediate(Assembler *as, Register dst, uint64_t value);
+// op dst, src for the ALU_* opcodes.
+void asmAlu(Assembler *as, uint8_t opcode, Register dst, Register src);
+// add reg, imm32
+void asmAddImmediate(Assembler *as, Register reg, int32_t value);
+// cmp byte [base + disp], imm8
+void asmCompareMemory8(Assembler *as, Register base, int32_t disp, int8_t value);
+// cmp dword [base + disp], imm32
+void asmCompareMemory32(Assembler *as, Register base, int32_t disp, int32_t value);
+
+// movq xmm, reg
+void asmMoveToXmm(Assembler *as, int xmm, Register reg);
+// movq reg, xmm
+void asmMoveFromXmm(Assembler *as, Register reg, int xmm);
+// [prefix] 0F opcode xmm[reg], xmm[rm], e.g. the SSE_* arithmetic, ucomisd (66 2E) or movapd (66 28).
+void asmSse(Assembler *as, uint8_t prefix, uint8_t opcode, int reg, int rm);
+// movsd xmm, [base + disp]
+void asmLoadDouble(Assembler *as, int xmm, Register base, int32_t disp);
+// movsd [base + disp], xmm
+void asmStoreDouble(Assembler *as, Register base, int32_t disp, int xmm);
+
+// setcc al; movzx eax, al
+void asmSetCondition(Assembler *as, int condition);
+/** Emits jcc rel32 and returns the offset of its displacement for patching. */
+int asmJumpIf(Assembler *as, int condition);
+int asmJump(Assembler *as);
+void asmPatchJump(Assembler *as, int from, int to);
+// mov rax, function; call rax
+void asmCall(Assembler *as, void *function);
+
+/** Saves the callee-saved registers and reserves [frameBytes] (8 mod 16) of stack. */
+void asmPrologue(Assembler *as, int32_t frameBytes);
+/** Undoes asmPrologue() and returns. */
+void asmEpilogue(Assembler *as, int32_t frameBytes);
+
+/** Copies the code into fresh executable memory, or returns null. */
+uint8_t *asmInstall(Assembler *as);
+void asmRelease(uint8_t *code, size_t size);
+/** Overwrites [count] bytes at [at] inside installed code. */
+bool asmRewrite(uint8_t *code, size_t size, size_t at, const uint8_t *bytes, int count);
+
+#endif
+
+#endif //assembler_h
@@ -0,0 +1,621 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#include "jit.h"
+
+#ifdef BASELINE_JIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../object.h"
+#include "assembler.h"
+
+bool jitEnabled = true;
+int jitThreshold = JIT_HOT_THRESHOLD;
+
+/*
+ * Native code keeps the interpreter's frame layout. Values live on the VM stack
+ * exactly where run() would put them, so the collector and runtimeError() see the
+ * same state whichever tier is running. The generated function is entered as
+ * fn(frame, target) and jumps to target, the native address of frame->ip, which
+ * lets a loop that turns hot carry on in native code where the interpreter left off.
+ *
+ * Registers, all callee-saved so they survive calls into the VM:
+ *   r12 stack top, r13 frame slots, r14 CallFrame*, rbx &vm, r15 the QNAN mask.
+ *
+ * Simple instructions get an inline template, with number fast paths for
+ * arithmetic and comparisons. Everything else, and each fast path's slow case,
+ * calls one of the jit* entry points in vm.c after writing back vm.stackTop and
+ * frame->ip.
+ */
+
+#define STACK_TOP R12
+#define SLOTS R13
+#define FRAME R14
+#define VM_BASE RBX
+#define QNAN_MASK R15
+
+// Stack reserved by the prologue, keeping rsp 16-byte aligned for calls.
+#define FRAME_BYTES 8
+
+typedef InterpretResult (*JitEntry)(CallFrame *frame, uint8_t *target);
+
+typedef struct {
+    int from; // Offset of the rel32 to patch.
+    int target; // Bytecode offset the jump goes to.
+} JumpFixup;
+
+/** Out-of-line code that runs a whole instruction in the VM when its fast path does not apply. */
+typedef struct {
+    int jumps[2];
+    int jumpCount;
+    int resume; // Native offset just past the instruction.
+    uint8_t *ip; // Bytecode address just past the instruction.
+    void *stub;
+    int argCount;
+    uint64_t args[3];
+} SlowPath;
+
+typedef struct {
+    Assembler as;
+    JumpFixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    SlowPath *slowPaths;
+    int slowPathCount;
+    int slowPathCapacity;
+    int *errorJumps;
+    int errorJumpCount;
+    int errorJumpCapacity;
+} MethodCompiler;
+
+static void emitPush(Assembler *as, Register value) {
+    asmStore(as, STACK_TOP, 0, value);
+    asmAddImmediate(as, STACK_TOP, sizeof(Value));
+}
+
+static void emitDrop(Assembler *as, int count) {
+    asmAddImmediate(as, STACK_TOP, -(int32_t) (count * sizeof(Value)));
+}
+
+static void addErrorJump(MethodCompiler *mc, int from) {
+    if (!asmReserve(&mc->as, (void **) &mc->errorJumps, &mc->errorJumpCapacity, mc->errorJumpCount, sizeof(int))) return;
+    mc->errorJumps[mc->errorJumpCount++] = from;
+}
+
+static void addFixup(MethodCompiler *mc, int from, int target) {
+    if (!asmReserve(&mc->as, (void **) &mc->fixups, &mc->fixupCapacity, mc->fixupCount, sizeof(JumpFixup))) return;
+    mc->fixups[mc->fixupCount++] = (JumpFixup){from, target};
+}
+
+/**
+ * Writes back the VM state, calls [stub] with up to three immediate arguments and
+ * leaves for the error exit when it returns false.
+ */
+static void emitStubCall(MethodCompiler *mc, uint8_t *ip, void *stub, int argCount, const uint64_t *args) {
+    static const Register argRegisters[] = {RDI, RSI, RDX};
+    Assembler *as = &mc->as;
+
+    asmStore(as, VM_BASE, offsetof(VM, stackTop), STACK_TOP);
+    asmMoveImmediate(as, RAX, (uint64_t) (uintptr_t) ip);
+    asmStore(as, FRAME, offsetof(CallFrame, ip), RAX);
+    for (int i = 0; i < argCount; i++) {
+        asmMoveImmediate(as, argRegisters[i], args[i]);
+    }
+    asmCall(as, stub);
+    asmLoad(as, STACK_TOP, VM_BASE, offsetof(VM, stackTop));
+    asmBytes(as, (uint8_t[]){0x84, 0xC0}, 2); // test al, al
+    addErrorJump(mc, asmJumpIf(as, CC_E));
+}
+
+static SlowPath *addSlowPath(MethodCompiler *mc, uint8_t *ip, void *stub) {
+    if (!asmReserve(&mc->as, (void **) &mc->slowPaths, &mc->slowPathCapacity, mc->slowPathCount, sizeof(SlowPath))) {
+        return NULL;
+    }
+    SlowPath *path = &mc->slowPaths[mc->slowPathCount++];
+    path->jumpCount = 0;
+    path->resume = -1;
+    path->ip = ip;
+    path->stub = stub;
+    path->argCount = 0;
+    return path;
+}
+
+/** Branches to [path] unless [value] holds a number. */
+static void emitNumberGuard(Assembler *as, SlowPath *path, Register value) {
+    asmAlu(as, ALU_MOV, RCX, value);
+    asmAlu(as, ALU_AND, RCX, QNAN_MASK);
+    asmAlu(as, ALU_CMP, RCX, QNAN_MASK);
+    int jump = asmJumpIf(as, CC_E);
+    if (path != NULL) path->jumps[path->jumpCount++] = jump;
+}
+
+/** Loads the top two stack values as doubles into xmm0 (a) and xmm1 (b), or takes [path]. */
+static void emitNumberOperands(Assembler *as, SlowPath *path) {
+    asmLoad(as, RAX, STACK_TOP, -2 * (int32_t) sizeof(Value));
+    asmLoad(as, RDX, STACK_TOP, -(int32_t) sizeof(Value));
+    emitNumberGuard(as, path, RAX);
+    emitNumberGuard(as, path, RDX);
+    asmMoveToXmm(as, 0, RAX);
+    asmMoveToXmm(as, 1, RDX);
+}
+
+/** Replaces the top two values with FALSE_VAL + the flag left in eax. */
+static void emitBoolResult(Assembler *as) {
+    asmMoveImmediate(as, RCX, FALSE_VAL);
+    asmAlu(as, ALU_ADD, RAX, RCX);
+    asmStore(as, STACK_TOP, -2 * (int32_t) sizeof(Value), RAX);
+    emitDrop(as, 1);
+}
+
+/** Leaves valuesEqual() of the top two values in al. It cannot allocate, so needs no write-back. */
+static void emitValuesEqual(Assembler *as) {
+    asmLoad(as, RDI, STACK_TOP, -2 * (int32_t) sizeof(Value));
+    asmLoad(as, RSI, STACK_TOP, -(int32_t) sizeof(Value));
+    asmCall(as, (void *) valuesEqual);
+}
+
+static SlowPath *numberError(MethodCompiler *mc, uint8_t *ip, const char *message) {
+    SlowPath *path = addSlowPath(mc, ip, (void *) jitError);
+    if (path != NULL) {
+        path->argCount = 1;
+        path->args[0] = (uint64_t) (uintptr_t) message;
+    }
+    return path;
+}
+
+static void stubCall(MethodCompiler *mc, uint8_t *ip, void *stub, int argCount, uint64_t a, uint64_t b, uint64_t c) {
+    uint64_t args[3] = {a, b, c};
+    emitStubCall(mc, ip, stub, argCount, args);
+}
+
+#define OBJ_ARG(value) ((uint64_t) (uintptr_t) AS_OBJ(value))
+#define PTR_ARG(pointer) ((uint64_t) (uintptr_t) (pointer))
+
+/**
+ * Emits the template for the instruction at [offset]. Returns its length in bytes,
+ * or 0 when the opcode has no template.
+ */
+static int emitInstruction(MethodCompiler *mc, ObjFunction *function, int offset) {
+    Assembler *as = &mc->as;
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = &chunk->code[offset];
+    Value *constants = chunk->constants.values;
+    int length = 1;
+
+#define OPERAND_SHORT(at) ((uint16_t) ((code[at] << 8) | code[at + 1]))
+#define NEXT_IP (code + length)
+#define CACHE_ARG(at) PTR_ARG(&chunk->caches[OPERAND_SHORT(at)])
+
+    SlowPath *path = NULL;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            length = 2;
+            asmMoveImmediate(as, RAX, constants[code[1]]);
+            emitPush(as, RAX);
+            break;
+        case OP_NULL:
+            asmMoveImmediate(as, RAX, NULL_VAL);
+            emitPush(as, RAX);
+            break;
+        case OP_TRUE:
+            asmMoveImmediate(as, RAX, TRUE_VAL);
+            emitPush(as, RAX);
+            break;
+        case OP_FALSE:
+            asmMoveImmediate(as, RAX, FALSE_VAL);
+            emitPush(as, RAX);
+            break;
+        case OP_POP:
+            emitDrop(as, 1);
+            break;
+        case OP_GET_LOCAL:
+            length = 2;
+            asmLoad(as, RAX, SLOTS, code[1] * sizeof(Value));
+            emitPush(as, RAX);
+            break;
+        case OP_SET_LOCAL:
+            length = 2;
+            asmLoad(as, RAX, STACK_TOP, -(int32_t) sizeof(Value));
+            asmStore(as, SLOTS, code[1] * sizeof(Value), RAX);
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            length = 2;
+            asmLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+            asmLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+#ifdef GECCO_COMPRESSED_HEAP
+            // Captured upvalues are never null, so the reference only needs the cage added.
+            asmLoad32(as, RAX, RAX, code[1] * sizeof(REF(ObjUpvalue)));
+            asmMoveImmediate(as, RCX, (uint64_t) (uintptr_t) heapCage);
+            asmAlu(as, ALU_ADD, RAX, RCX);
+#else
+            asmLoad(as, RAX, RAX, code[1] * sizeof(REF(ObjUpvalue)));
+#endif
+            asmLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+            if (code[0] == OP_GET_UPVALUE) {
+                asmLoad(as, RAX, RAX, 0);
+                emitPush(as, RAX);
+                break;
+            }
+            // Objects go through the VM, which applies the write barrier to a closed upvalue.
+            path = addSlowPath(mc, NEXT_IP, (void *) jitSetUpvalue);
+            if (path == NULL) return 0;
+            path->argCount = 1;
+            path->args[0] = code[1];
+            asmLoad(as, RCX, STACK_TOP, -(int32_t) sizeof(Value));
+            asmMoveImmediate(as, RDX, SIGN_BIT | QNAN);
+            asmAlu(as, ALU_AND, RDX, RCX);
+            asmMoveImmediate(as, RSI, SIGN_BIT | QNAN);
+            asmAlu(as, ALU_CMP, RDX, RSI);
+            path->jumps[path->jumpCount++] = asmJumpIf(as, CC_E);
+            asmStore(as, RAX, 0, RCX);
+            break;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT: {
+            length = 3;
+            int slot = OPERAND_SHORT(1);
+            int32_t disp = slot * sizeof(GlobalSlot) + offsetof(GlobalSlot, value);
+            path = addSlowPath(mc, NEXT_IP, code[0] == OP_GET_GLOBAL_SLOT ? (void *) jitGetGlobal : (void *) jitSetGlobal);
+            if (path == NULL) return 0;
+            path->argCount = 1;
+            path->args[0] = slot;
+
+            asmLoad(as, RAX, VM_BASE, offsetof(VM, globalSlots));
+            asmLoad(as, RDX, RAX, disp);
+            asmMoveImmediate(as, RCX, UNDEFINED_VAL);
+            asmAlu(as, ALU_CMP, RDX, RCX);
+            path->jumps[path->jumpCount++] = asmJumpIf(as, CC_E);
+            if (code[0] == OP_GET_GLOBAL_SLOT) {
+                emitPush(as, RDX);
+            } else {
+                asmLoad(as, RCX, STACK_TOP, -(int32_t) sizeof(Value));
+                asmStore(as, RAX, disp, RCX);
+            }
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+            length = 2;
+            stubCall(mc, NEXT_IP, (void *) jitDefineGlobal, 1, OBJ_ARG(constants[code[1]]), 0, 0);
+            break;
+        case OP_GET_PROPERTY:
+            length = 4;
+            stubCall(mc, NEXT_IP, (void *) jitGetProperty, 2, OBJ_ARG(constants[code[1]]), CACHE_ARG(2), 0);
+            break;
+        case OP_SET_PROPERTY:
+            length = 4;
+            stubCall(mc, NEXT_IP, (void *) jitSetProperty, 2, OBJ_ARG(constants[code[1]]), CACHE_ARG(2), 0);
+            break;
+        case OP_GET_SUPER:
+            length = 2;
+            stubCall(mc, NEXT_IP, (void *) jitGetSuper, 1, OBJ_ARG(constants[code[1]]), 0, 0);
+            break;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_NOT_EQUAL:
+        case OP_NOT_EQUAL_NUM: {
+            bool negate = code[0] == OP_NOT_EQUAL || code[0] == OP_NOT_EQUAL_NUM;
+            emitValuesEqual(as);
+            asmBytes(as, (uint8_t[]){0x0F, 0xB6, 0xC0}, 3); // movzx eax, al
+            if (negate) asmBytes(as, (uint8_t[]){0x83, 0xF0, 0x01}, 3); // xor eax, 1
+            emitBoolResult(as);
+            break;
+        }
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL: {
+            path = numberError(mc, NEXT_IP, "Operands must be numbers.");
+            emitNumberOperands(as, path);
+            // a > b is "above" for ucomisd a, b; a < b is b above a. >= and <= are
+            // the negations of < and >, so unordered (NaN) operands make them true.
+            bool swap = code[0] == OP_LESS || code[0] == OP_GREATER_EQUAL;
+            bool negate = code[0] == OP_GREATER_EQUAL || code[0] == OP_LESS_EQUAL;
+            asmSse(as, 0x66, 0x2E, swap ? 1 : 0, swap ? 0 : 1);
+            asmSetCondition(as, negate ? CC_BE : CC_A);
+            emitBoolResult(as);
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            uint8_t opcode;
+            switch (code[0]) {
+                case OP_SUBTRACT: opcode = 0x5C; break;
+                case OP_MULTIPLY: opcode = 0x59; break;
+                case OP_DIVIDE: opcode = 0x5E; break;
+                default: opcode = 0x58; break;
+            }
+            if (opcode == 0x58) {
+                path = addSlowPath(mc, NEXT_IP, (void *) jitAdd);
+            } else {
+                path = numberError(mc, NEXT_IP, "Operands must be numbers.");
+            }
+            emitNumberOperands(as, path);
+            asmSse(as, 0xF2, opcode, 0, 1);
+            asmMoveFromXmm(as, RAX, 0);
+            asmStore(as, STACK_TOP, -2 * (int32_t) sizeof(Value), RAX);
+            emitDrop(as, 1);
+            break;
+        }
+        case OP_ADD_LOCALS:
+            length = 3;
+            path = addSlowPath(mc, NEXT_IP, (void *) jitAddLocals);
+            if (path == NULL) return 0;
+            path->argCount = 2;
+            path->args[0] = code[1];
+            path->args[1] = code[2];
+            asmLoad(as, RAX, SLOTS, code[1] * sizeof(Value));
+            asmLoad(as, RDX, SLOTS, code[2] * sizeof(Value));
+            emitNumberGuard(as, path, RAX);
+            emitNumberGuard(as, path, RDX);
+            asmMoveToXmm(as, 0, RAX);
+            asmMoveToXmm(as, 1, RDX);
+            asmSse(as, 0xF2, 0x58, 0, 1);
+            asmMoveFromXmm(as, RAX, 0);
+            emitPush(as, RAX);
+            break;
+        case OP_ADD_LOCAL_CONSTANT: {
+            length = 3;
+            Value constant = constants[code[2]];
+            if (!IS_NUMBER(constant)) {
+                stubCall(mc, NEXT_IP, (void *) jitAddLocalConstant, 2, code[1], constant, 0);
+                break;
+            }
+            path = addSlowPath(mc, NEXT_IP, (void *) jitAddLocalConstant);
+            if (path == NULL) return 0;
+            path->argCount = 2;
+            path->args[0] = code[1];
+            path->args[1] = constant;
+            asmLoad(as, RAX, SLOTS, code[1] * sizeof(Value));
+            emitNumberGuard(as, path, RAX);
+            asmMoveToXmm(as, 0, RAX);
+            asmMoveImmediate(as, RDX, constant);
+            asmMoveToXmm(as, 1, RDX);
+            asmSse(as, 0xF2, 0x58, 0, 1);
+            asmMoveFromXmm(as, RAX, 0);
+            asmStore(as, SLOTS, code[1] * sizeof(Value), RAX);
+            emitPush(as, RAX);
+            break;
+        }
+        case OP_MOD:
+        case OP_POW:
+            stubCall(mc, NEXT_IP, (void *) jitArithmetic, 1, code[0], 0, 0);
+            break;
+        case OP_NOT:
+            // isFalsey(): null or false.
+            asmLoad(as, RDX, STACK_TOP, -(int32_t) sizeof(Value));
+            asmMoveImmediate(as, RCX, NULL_VAL);
+            asmAlu(as, ALU_CMP, RDX, RCX);
+            asmBytes(as, (uint8_t[]){0x0F, 0x94, 0xC0}, 3); // sete al
+            asmMoveImmediate(as, RCX, FALSE_VAL);
+            asmAlu(as, ALU_CMP, RDX, RCX);
+            asmBytes(as, (uint8_t[]){0x0F, 0x94, 0xC2}, 3); // sete dl
+            asmBytes(as, (uint8_t[]){0x08, 0xD0}, 2); // or al, dl
+            asmBytes(as, (uint8_t[]){0x0F, 0xB6, 0xC0}, 3); // movzx eax, al
+            asmAlu(as, ALU_ADD, RAX, RCX);
+            asmStore(as, STACK_TOP, -(int32_t) sizeof(Value), RAX);
+            break;
+        case OP_NEGATE:
+            path = numberError(mc, NEXT_IP, "Operand must be a number.");
+            asmLoad(as, RAX, STACK_TOP, -(int32_t) sizeof(Value));
+            emitNumberGuard(as, path, RAX);
+            asmMoveImmediate(as, RCX, SIGN_BIT);
+            asmAlu(as, ALU_XOR, RAX, RCX);
+            asmStore(as, STACK_TOP, -(int32_t) sizeof(Value), RAX);
+            break;
+        case OP_PRINT:
+            stubCall(mc, NEXT_IP, (void *) jitPrint, 0, 0, 0, 0);
+            break;
+        case OP_JUMP:
+            length = 3;
+            addFixup(mc, asmJump(as), offset + length + OPERAND_SHORT(1));
+            break;
+        case OP_JUMP_IF_FALSE:
+            length = 3;
+            asmLoad(as, RDX, STACK_TOP, -(int32_t) sizeof(Value));
+            asmMoveImmediate(as, RCX, NULL_VAL);
+            asmAlu(as, ALU_CMP, RDX, RCX);
+            addFixup(mc, asmJumpIf(as, CC_E), offset + length + OPERAND_SHORT(1));
+            asmMoveImmediate(as, RCX, FALSE_VAL);
+            asmAlu(as, ALU_CMP, RDX, RCX);
+            addFixup(mc, asmJumpIf(as, CC_E), offset + length + OPERAND_SHORT(1));
+            break;
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_EQUAL_NUM:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL_NUM: {
+            length = 3;
+            bool equal = code[0] == OP_JUMP_IF_EQUAL || code[0] == OP_JUMP_IF_EQUAL_NUM;
+            emitValuesEqual(as);
+            emitDrop(as, 2);
+            asmBytes(as, (uint8_t[]){0x84, 0xC0}, 2); // test al, al
+            addFixup(mc, asmJumpIf(as, equal ? CC_NE : CC_E), offset + length + OPERAND_SHORT(1));
+            break;
+        }
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL: {
+            length = 3;
+            path = numberError(mc, NEXT_IP, "Operands must be numbers.");
+            emitNumberOperands(as, path);
+            emitDrop(as, 2);
+            // Jumps when the comparison run() tests is false; see the comparisons above.
+            bool swap = code[0] == OP_JUMP_IF_NOT_LESS || code[0] == OP_JUMP_IF_NOT_GREATER_EQUAL;
+            bool negate = code[0] == OP_JUMP_IF_NOT_GREATER_EQUAL || code[0] == OP_JUMP_IF_NOT_LESS_EQUAL;
+            asmSse(as, 0x66, 0x2E, swap ? 1 : 0, swap ? 0 : 1);
+            addFixup(mc, asmJumpIf(as, negate ? CC_A : CC_BE), offset + length + OPERAND_SHORT(1));
+            break;
+        }
+        case OP_LOOP:
+            length = 3;
+            // A loop that only allocates through stubs would never reach the VM's check.
+            path = addSlowPath(mc, NEXT_IP, (void *) jitOutOfMemory);
+            if (path == NULL) return 0;
+            asmCompareMemory8(as, VM_BASE, offsetof(VM, memoryExhausted), 0);
+            path->jumps[path->jumpCount++] = asmJumpIf(as, CC_NE);
+            addFixup(mc, asmJump(as), offset + length - OPERAND_SHORT(1));
+            break;
+        case OP_CALL:
+            length = 2;
+            stubCall(mc, NEXT_IP, (void *) jitCall, 1, code[1], 0, 0);
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            length = 5;
+            stubCall(mc, NEXT_IP, code[0] == OP_INVOKE ? (void *) jitInvoke : (void *) jitSuperInvoke, 3,
+                     OBJ_ARG(constants[code[1]]), code[2], CACHE_ARG(3));
+            break;
+        case OP_CLOSURE: {
+            ObjFunction *enclosed = AS_FUNCTION(constants[code[1]]);
+            length = 2 + 2 * enclosed->upvalueCount;
+            stubCall(mc, NEXT_IP, (void *) jitClosure, 2, PTR_ARG(enclosed), PTR_ARG(code + 2), 0);
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            stubCall(mc, NEXT_IP, (void *) jitCloseUpvalue, 0, 0, 0, 0);
+            break;
+        case OP_RETURN:
+            stubCall(mc, NEXT_IP, (void *) jitReturn, 0, 0, 0, 0);
+            asmMoveImmediate(as, RAX, INTERPRET_OK);
+            asmEpilogue(as, FRAME_BYTES);
+            break;
+        case OP_CLASS:
+            length = 2;
+            stubCall(mc, NEXT_IP, (void *) jitClass, 1, OBJ_ARG(constants[code[1]]), 0, 0);
+            break;
+        case OP_INHERIT:
+            stubCall(mc, NEXT_IP, (void *) jitInherit, 0, 0, 0, 0);
+            break;
+        case OP_METHOD:
+            length = 2;
+            stubCall(mc, NEXT_IP, (void *) jitMethod, 1, OBJ_ARG(constants[code[1]]), 0, 0);
+            break;
+        case OP_POINT_RIGHT:
+        case OP_POINT_LEFT:
+        case OP_TYPE:
+        case OP_COLON:
+            break;
+        default:
+            return 0;
+    }
+
+    if (path != NULL) path->resume = as->count;
+    return length;
+
+#undef OPERAND_SHORT
+#undef NEXT_IP
+#undef CACHE_ARG
+}
+
+#undef OBJ_ARG
+#undef PTR_ARG
+
+/** Emits the slow paths after the body, each returning to the end of its instruction. */
+static void emitSlowPaths(MethodCompiler *mc) {
+    Assembler *as = &mc->as;
+    for (int i = 0; i < mc->slowPathCount; i++) {
+        SlowPath *path = &mc->slowPaths[i];
+        for (int j = 0; j < path->jumpCount; j++) {
+            asmPatchJump(as, path->jumps[j], as->count);
+        }
+        emitStubCall(mc, path->ip, path->stub, path->argCount, path->args);
+        asmPatchJump(as, asmJump(as), path->resume);
+    }
+}
+
+static void freeCompiler(MethodCompiler *mc) {
+    asmFree(&mc->as);
+    free(mc->fixups);
+    free(mc->slowPaths);
+    free(mc->errorJumps);
+}
+
+bool jitCompile(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    if (function->frameSize > 0) {
+        function->hotness = -1;
+        return false;
+    }
+
+    MethodCompiler mc = {0};
+    Assembler *as = &mc.as;
+    uint32_t *entries = calloc(chunk->count + 1, sizeof(uint32_t));
+    if (entries == NULL) {
+        function->hotness = -1;
+        return false;
+    }
+
+    // Prologue: save the callee-saved registers, load the pinned ones and jump to
+    // the requested instruction.
+    asmPrologue(as, FRAME_BYTES);
+    asmAlu(as, ALU_MOV, FRAME, RDI);
+    asmMoveImmediate(as, VM_BASE, (uint64_t) (uintptr_t) &vm);
+    asmLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    asmLoad(as, STACK_TOP, VM_BASE, offsetof(VM, stackTop));
+    asmMoveImmediate(as, QNAN_MASK, QNAN);
+    asmBytes(as, (uint8_t[]){0xFF, 0xE6}, 2); // jmp rsi
+
+    for (int offset = 0; offset < chunk->count;) {
+        entries[offset] = as->count;
+        int length = emitInstruction(&mc, function, offset);
+        if (length == 0 || as->failed) {
+            freeCompiler(&mc);
+            free(entries);
+            function->hotness = -1;
+            return false;
+        }
+        offset += length;
+    }
+
+    emitSlowPaths(&mc);
+
+    // A runtime error has already been reported and the stack reset by the VM.
+    int errorExit = as->count;
+    asmMoveImmediate(as, RAX, INTERPRET_RUNTIME_ERROR);
+    asmEpilogue(as, FRAME_BYTES);
+
+    for (int i = 0; i < mc.errorJumpCount; i++) {
+        asmPatchJump(as, mc.errorJumps[i], errorExit);
+    }
+    for (int i = 0; i < mc.fixupCount; i++) {
+        asmPatchJump(as, mc.fixups[i].from, entries[mc.fixups[i].target]);
+    }
+
+    uint8_t *code = asmInstall(as);
+    JitCode *jit = code == NULL ? NULL : malloc(sizeof(JitCode));
+    if (jit == NULL) {
+        if (code != NULL) asmRelease(code, as->count);
+        freeCompiler(&mc);
+        free(entries);
+        function->hotness = -1;
+        return false;
+    }
+
+    jit->code = code;
+    jit->size = as->count;
+    jit->entries = entries;
+    function->jit = jit;
+    freeCompiler(&mc);
+    return true;
+}
+
+void jitFree(JitCode *jit) {
+    asmRelease(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+InterpretResult jitEnter(CallFrame *frame) {
+    ObjFunction *function = FROM_REF(ObjFunction, frame->closure->function);
+    JitCode *jit = function->jit;
+    JitEntry entry = (JitEntry) jit->code;
+    return entry(frame, jit->code + jit->entries[frame->ip - function->chunk.code]);
+}
+
+#endif
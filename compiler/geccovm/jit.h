@@ -0,0 +1,66 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef jit_h
+#define jit_h
+
+#include "../common.h"
+
+#ifdef BASELINE_JIT
+
+#include "vm.h"
+
+// Calls plus loop back edges a function runs in the interpreter before it is compiled.
+#define JIT_HOT_THRESHOLD 1000
+
+/** Native code for one function, plus the native offset of each bytecode instruction. */
+struct JitCode {
+    uint8_t *code;
+    size_t size;
+    uint32_t *entries; // Indexed by bytecode offset, 0 where no instruction starts.
+};
+
+extern bool jitEnabled;
+extern int jitThreshold;
+
+/**
+ * Translates the stack code of [function] into native code. Fails, and marks the
+ * function so it is not retried, for register code or an opcode without a template.
+ */
+bool jitCompile(ObjFunction *function);
+void jitFree(JitCode *jit);
+
+/** Runs [frame] natively from its current instruction until the frame returns. */
+InterpretResult jitEnter(CallFrame *frame);
+
+// Runtime entry points for native code, implemented by the VM. Each performs a whole
+// instruction on the VM stack, with vm.stackTop and the frame's ip already written
+// back, and returns false once it has reported a runtime error.
+bool jitError(const char *message);
+bool jitOutOfMemory();
+bool jitGetGlobal(int slot);
+bool jitSetGlobal(int slot);
+bool jitSetUpvalue(int slot);
+bool jitDefineGlobal(ObjString *name);
+bool jitGetProperty(ObjString *name, InlineCache *cache);
+bool jitSetProperty(ObjString *name, InlineCache *cache);
+bool jitGetSuper(ObjString *name);
+bool jitAdd();
+bool jitAddLocals(int a, int b);
+bool jitAddLocalConstant(int local, Value constant);
+bool jitArithmetic(int instruction);
+bool jitPrint();
+bool jitCall(int argCount);
+bool jitInvoke(ObjString *name, int argCount, InlineCache *cache);
+bool jitSuperInvoke(ObjString *name, int argCount, InlineCache *cache);
+bool jitClosure(ObjFunction *function, uint8_t *operands);
+bool jitCloseUpvalue();
+bool jitReturn();
+bool jitClass(ObjString *name);
+bool jitInherit();
+bool jitMethod(ObjString *name);
+
+#endif
+
+#endif //jit_h
@@ -0,0 +1,1668 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#include "trace.h"
+
+#ifdef BASELINE_JIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "../debug/debug.h"
+#include "../memory/memory.h"
+#include "../object.h"
+
+bool traceEnabled = true;
+bool traceStats = false;
+int traceHotLoop = TRACE_HOT_LOOP;
+int traceHotExit = TRACE_HOT_EXIT;
+
+/*
+ * The tracing tier. Every OP_LOOP back edge the interpreter takes counts its target,
+ * the loop header. Once a header is hot the recorder below takes over from the
+ * interpreter: it executes the loop body one instruction at a time on the real VM
+ * state while writing down what each instruction did to the values it saw, as a
+ * linear IR with the observed types. When execution comes back around to the header
+ * the IR is a complete iteration; it is optimized and compiled to x86-64, and from
+ * then on the back edge runs the native loop instead.
+ *
+ * Everything the recording assumed (operand types, the direction of each branch,
+ * the shape of each instance read) becomes a guard. A failing guard leaves through
+ * an exit that writes the values the interpreter expects back onto the VM stack, so
+ * interpretation resumes at the instruction the trace had reached. Exits taken
+ * often get a side trace recorded from where they leave, which the exit then jumps
+ * to directly and which rejoins the loop at its header.
+ *
+ * Locals that exist when the loop is entered stay in their stack slots: a trace
+ * loads them where first read and writes them back where assigned. Temporaries and
+ * locals declared inside the body exist only as IR values, in xmm registers as raw
+ * Value bits, which for numbers is the unboxed double itself. A snapshot records
+ * where each of them belongs on the stack for every exit.
+ *
+ * Registers in trace code: r13 frame slots, r12 vm.globalSlots, r14 the object tag
+ * mask, r15 the QNAN mask. xmm2-xmm15 hold IR values, with spill slots on the
+ * native stack; rax-rdx and xmm0/xmm1 are scratch.
+ */
+
+#define TRACE_MAX_IR 512
+#define TRACE_MAX_SNAPSHOTS 128
+#define TRACE_MAX_ENTRIES 2048
+#define TRACE_MAX_SLOTS 320
+#define TRACE_MAX_GLOBALS 32
+#define TRACE_MAX_OBJECTS 32
+// Side traces one loop may grow before further hot exits are left alone.
+#define TRACE_MAX_SIDES 32
+// Failed recordings before a loop header or exit is left to the other tiers.
+#define TRACE_MAX_ATTEMPTS 4
+// Back edges to other headers a recording may follow: the second half of a for loop.
+#define TRACE_MAX_BACK_EDGES 2
+
+#define SPILL_SLOTS 64
+// Spill slots plus padding that keeps rsp 16-byte aligned.
+#define FRAME_BYTES (SPILL_SLOTS * 8 + 8)
+#define FIRST_XMM 2
+#define XMM_COUNT 16
+
+#define SLOTS R13
+#define GLOBALS R12
+#define OBJ_MASK R14
+#define QNAN_MASK R15
+
+typedef enum {
+    IR_CONST, // value: the constant
+    IR_SLOT, // slot: frame slot to load
+    IR_GLOBAL, // slot: global slot to load
+    IR_FIELD, // a: instance, slot: field slot to load
+    IR_ADD, // a + b, numbers
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_NEG, // -a
+    IR_LT, // a < b
+    IR_LE, // !(a > b), as run() evaluates <=
+    IR_GT, // a > b
+    IR_GE, // !(a < b)
+    IR_EQ, // valuesEqual(a, b) for operands of one type
+    IR_NE,
+    IR_NOT, // !a for a bool
+    IR_GUARD_TRUE, // leave unless a is true
+    IR_GUARD_FALSE, // leave unless a is false
+    IR_GUARD_SHAPE, // leave unless instance a has shape value
+    IR_STORE_SLOT, // frame slot = a
+    IR_STORE_GLOBAL, // global slot = a
+    IR_STORE_FIELD, // field slot of instance a = b
+    IR_LOOP, // back to the loop header
+} IrOp;
+
+// Types the recorder observed, and the guards on loads check.
+#define TYPE_NUMBER 0
+#define TYPE_NULL 1
+#define TYPE_BOOL 2
+#define TYPE_OBJECT(objType) (3 + (objType))
+
+// IrIns flags set by hoisting.
+#define IR_INVARIANT 1 // Loaded once before the loop and kept in a register throughout.
+#define IR_CHECK_HOISTED 2 // Type checked once before the loop; the load stays in the body.
+#define IR_HOISTED 4 // Guard moved before the loop.
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;
+    uint8_t flags;
+    int16_t a;
+    int16_t b;
+    int16_t snapshot; // Exit taken by the instruction's guard, -1 without one.
+    int32_t slot;
+    uint64_t value;
+} IrIns;
+
+/** Interpreter state to rebuild at an exit: where to resume and which IR values go where. */
+typedef struct {
+    uint8_t *ip;
+    int depth;
+    int start; // First of its entries in Recorder.entries.
+    int count;
+} Snapshot;
+
+typedef struct {
+    int slot;
+    int ref;
+} SnapshotEntry;
+
+typedef struct Trace Trace;
+
+typedef struct {
+    uint8_t *ip;
+    int depth;
+    uint64_t count; // Times taken.
+    int hotness; // Taken since the last side trace attempt.
+    int attempts;
+    int stub; // Native offset of the stub's final jump, rewritten to link a side trace.
+    Trace *trace;
+    Trace *side;
+} TraceExit;
+
+struct Trace {
+    int id;
+    TraceSite *site;
+    TraceExit *parent; // Exit a side trace hangs off, null for the root trace.
+    uint8_t *code;
+    size_t size;
+    uint8_t *loop; // Loop entry of a root trace, where side traces rejoin it.
+    TraceExit *exits;
+    int exitCount;
+    Obj **objects; // Shapes the code compares against, kept alive for it.
+    int objectCount;
+    int irCount;
+    uint64_t entries;
+    Trace *next; // Next trace of the same loop.
+};
+
+/** A loop header the interpreter has taken back edges to. */
+struct TraceSite {
+    uint8_t *header;
+    int depth; // Stack slots in use at the header.
+    int hotness;
+    int attempts;
+    bool blacklisted;
+    Trace *root;
+    Trace *traces; // The root and all side traces.
+    int sideCount;
+    bool covered; // Crossed by the trace of another header, which runs its loop instead.
+    TraceSite *next;
+};
+
+typedef enum {
+    ABORT_INSTRUCTION,
+    ABORT_TYPES,
+    ABORT_PROPERTY,
+    ABORT_FIELD_OBJECT,
+    ABORT_GLOBAL,
+    ABORT_INNER_LOOP,
+    ABORT_STACK,
+    ABORT_TOO_LONG,
+    ABORT_COMPILE,
+    ABORT_COUNT
+} AbortReason;
+
+static const char *abortNames[] = {
+    [ABORT_INSTRUCTION] = "unsupported instruction",
+    [ABORT_TYPES] = "operand types other than numbers",
+    [ABORT_PROPERTY] = "property that is not a field of a shaped instance",
+    [ABORT_FIELD_OBJECT] = "object stored into a field",
+    [ABORT_GLOBAL] = "undefined global",
+    [ABORT_INNER_LOOP] = "inner loop",
+    [ABORT_STACK] = "stack too deep or unbalanced",
+    [ABORT_TOO_LONG] = "trace too long",
+    [ABORT_COMPILE] = "native code generation failed",
+};
+
+static struct {
+    int traces;
+    int roots;
+    int sides;
+    int blacklisted;
+    uint64_t exits;
+    uint64_t aborts[ABORT_COUNT];
+    uint64_t abortedOpcodes[UINT8_COUNT];
+} stats;
+
+typedef struct {
+    TraceSite *site;
+    TraceExit *parent;
+    IrIns ir[TRACE_MAX_IR]; // ir[0] is unused so that ref 0 means "no value".
+    int count;
+    Snapshot snapshots[TRACE_MAX_SNAPSHOTS];
+    int snapshotCount;
+    SnapshotEntry entries[TRACE_MAX_ENTRIES];
+    int entryCount;
+    int16_t stack[TRACE_MAX_SLOTS]; // IR value of each stack slot, 0 until loaded.
+    bool pushed[TRACE_MAX_SLOTS]; // Slot written by a push, so only its IR value is current.
+    int depth;
+    struct {
+        int slot;
+        int16_t ref;
+    } globals[TRACE_MAX_GLOBALS];
+    int globalCount;
+    bool shapeChecked[TRACE_MAX_IR];
+    Obj *objects[TRACE_MAX_OBJECTS];
+    int objectCount;
+    uint8_t *ip; // Instruction being recorded.
+    int instructionSnapshot; // Its entry state, made on first use.
+    struct {
+        uint8_t *header;
+        int depth;
+    } crossed[TRACE_MAX_BACK_EDGES]; // Back edges to other headers followed.
+    bool full;
+} Recorder;
+
+static Recorder recorder;
+
+static uint8_t typeOf(Value value) {
+    if (IS_NUMBER(value)) return TYPE_NUMBER;
+    if (IS_NULL(value)) return TYPE_NULL;
+    if (IS_BOOL(value)) return TYPE_BOOL;
+    return TYPE_OBJECT(OBJ_TYPE(value));
+}
+
+static int emitIr(Recorder *r, IrOp op, uint8_t type, int a, int b) {
+    if (r->count == TRACE_MAX_IR) {
+        r->full = true;
+        return 0;
+    }
+    r->ir[r->count] = (IrIns){.op = op, .type = type, .a = a, .b = b, .snapshot = -1};
+    return r->count++;
+}
+
+static int snapshotAt(Recorder *r, uint8_t *ip, int depth) {
+    if (r->snapshotCount == TRACE_MAX_SNAPSHOTS) {
+        r->full = true;
+        return 0;
+    }
+    Snapshot *snapshot = &r->snapshots[r->snapshotCount];
+    snapshot->ip = ip;
+    snapshot->depth = depth;
+    snapshot->start = r->entryCount;
+    snapshot->count = 0;
+    for (int slot = 0; slot < depth; slot++) {
+        if (!r->pushed[slot]) continue;
+        if (r->entryCount == TRACE_MAX_ENTRIES) {
+            r->full = true;
+            return 0;
+        }
+        r->entries[r->entryCount++] = (SnapshotEntry){slot, r->stack[slot]};
+        snapshot->count++;
+    }
+    return r->snapshotCount++;
+}
+
+/** The state before the current instruction, for guards that resume by re-running it. */
+static int instructionSnapshot(Recorder *r) {
+    if (r->instructionSnapshot < 0) r->instructionSnapshot = snapshotAt(r, r->ip, r->depth);
+    return r->instructionSnapshot;
+}
+
+static int constRef(Recorder *r, Value value) {
+    int ref = emitIr(r, IR_CONST, typeOf(value), 0, 0);
+    r->ir[ref].value = value;
+    return ref;
+}
+
+/** The IR value of stack [slot], loading and type-guarding it if the trace has not yet. */
+static int slotRef(Recorder *r, int slot, Value observed) {
+    if (r->stack[slot] != 0) return r->stack[slot];
+    int ref = emitIr(r, IR_SLOT, typeOf(observed), 0, 0);
+    r->ir[ref].slot = slot;
+    r->ir[ref].snapshot = instructionSnapshot(r);
+    r->stack[slot] = ref;
+    return ref;
+}
+
+static int topRef(Recorder *r, Value *sp, int distance) {
+    return slotRef(r, r->depth - 1 - distance, sp[-1 - distance]);
+}
+
+static void pushRef(Recorder *r, int ref) {
+    r->stack[r->depth] = ref;
+    r->pushed[r->depth] = true;
+    r->depth++;
+}
+
+static void storeSlot(Recorder *r, int slot, int ref) {
+    // Slots pushed by the trace are rebuilt from snapshots; the others are written through.
+    if (!r->pushed[slot]) {
+        int store = emitIr(r, IR_STORE_SLOT, 0, ref, 0);
+        r->ir[store].slot = slot;
+    }
+    r->stack[slot] = ref;
+}
+
+static int globalRef(Recorder *r, int slot, Value observed) {
+    for (int i = 0; i < r->globalCount; i++) {
+        if (r->globals[i].slot == slot) return r->globals[i].ref;
+    }
+    if (r->globalCount == TRACE_MAX_GLOBALS) {
+        r->full = true;
+        return 0;
+    }
+    int ref = emitIr(r, IR_GLOBAL, typeOf(observed), 0, 0);
+    r->ir[ref].slot = slot;
+    r->ir[ref].snapshot = instructionSnapshot(r);
+    r->globals[r->globalCount].slot = slot;
+    r->globals[r->globalCount++].ref = ref;
+    return ref;
+}
+
+static void storeGlobal(Recorder *r, int slot, int ref) {
+    int store = emitIr(r, IR_STORE_GLOBAL, 0, ref, 0);
+    r->ir[store].slot = slot;
+    for (int i = 0; i < r->globalCount; i++) {
+        if (r->globals[i].slot == slot) {
+            r->globals[i].ref = ref;
+            return;
+        }
+    }
+    if (r->globalCount == TRACE_MAX_GLOBALS) {
+        r->full = true;
+        return;
+    }
+    r->globals[r->globalCount].slot = slot;
+    r->globals[r->globalCount++].ref = ref;
+}
+
+static void guardShape(Recorder *r, int instance, ObjShape *shape) {
+    if (r->shapeChecked[instance]) return;
+
+    bool known = false;
+    for (int i = 0; i < r->objectCount; i++) known |= r->objects[i] == (Obj *) shape;
+    if (!known) {
+        if (r->objectCount == TRACE_MAX_OBJECTS) {
+            r->full = true;
+            return;
+        }
+        r->objects[r->objectCount++] = (Obj *) shape;
+    }
+
+    int guard = emitIr(r, IR_GUARD_SHAPE, 0, instance, 0);
+    r->ir[guard].value = (uint64_t) TO_REF(shape);
+    r->ir[guard].snapshot = instructionSnapshot(r);
+    r->shapeChecked[instance] = true;
+}
+
+static bool isConstant(Recorder *r, int ref) {
+    return r->ir[ref].op == IR_CONST;
+}
+
+static double constantNumber(Recorder *r, int ref) {
+    return AS_NUMBER(r->ir[ref].value);
+}
+
+static double evaluate(IrOp op, double a, double b) {
+    switch (op) {
+        case IR_ADD: return a + b;
+        case IR_SUB: return a - b;
+        case IR_MUL: return a * b;
+        case IR_DIV: return a / b;
+        default: return modulo(a, b);
+    }
+}
+
+/** Number arithmetic on two IR numbers, folded when both are constants. */
+static int arithmetic(Recorder *r, IrOp op, int a, int b) {
+    if (isConstant(r, a) && isConstant(r, b) && (op != IR_MOD || (int) constantNumber(r, b) != 0)) {
+        return constRef(r, NUMBER_VAL(evaluate(op, constantNumber(r, a), constantNumber(r, b))));
+    }
+    int ref = emitIr(r, op, TYPE_NUMBER, a, b);
+    // The remainder leaves before an integer division by zero; the interpreter then
+    // does whatever it does with it.
+    if (op == IR_MOD) r->ir[ref].snapshot = instructionSnapshot(r);
+    return ref;
+}
+
+static bool compareNumbers(IrOp op, double a, double b) {
+    switch (op) {
+        case IR_LT: return a < b;
+        case IR_LE: return !(a > b);
+        case IR_GT: return a > b;
+        default: return !(a < b);
+    }
+}
+
+static int comparison(Recorder *r, IrOp op, int a, int b) {
+    if (isConstant(r, a) && isConstant(r, b)) {
+        return constRef(r, BOOL_VAL(compareNumbers(op, constantNumber(r, a), constantNumber(r, b))));
+    }
+    return emitIr(r, op, TYPE_BOOL, a, b);
+}
+
+/** Whether [ref] is a constant string that is interned, so equal only to itself. */
+static bool isInternedConstant(Recorder *r, int ref) {
+    return isConstant(r, ref) && AS_STRING(r->ir[ref].value)->length <= STRING_INTERN_MAX;
+}
+
+/**
+ * valuesEqual(a, b), negated for !=, or -1 when the trace cannot compare the operands. Values of
+ * different types are never equal. Strings compare by their bits only when one is a short
+ * constant: two long strings built at run time may be equal but different objects.
+ */
+static int equality(Recorder *r, int a, int b, bool negate) {
+    uint8_t type = r->ir[a].type;
+    if (type != r->ir[b].type) return constRef(r, BOOL_VAL(negate));
+    if (type == TYPE_NULL) return constRef(r, BOOL_VAL(!negate));
+    if (isConstant(r, a) && isConstant(r, b)) {
+        return constRef(r, BOOL_VAL(valuesEqual(r->ir[a].value, r->ir[b].value) != negate));
+    }
+    if (type == TYPE_OBJECT(OBJ_STRING) && !isInternedConstant(r, a) && !isInternedConstant(r, b)) return -1;
+    return emitIr(r, negate ? IR_NE : IR_EQ, TYPE_BOOL, a, b);
+}
+
+/**
+ * Guards that [condition] has the truthiness the recording saw, leaving for [ip] with
+ * [depth] stack slots otherwise. Only bools need a check: null is always falsey and
+ * numbers and objects always truthy.
+ */
+static void guardTruth(Recorder *r, int condition, bool truthy, uint8_t *ip, int depth) {
+    while (r->ir[condition].op == IR_NOT) {
+        condition = r->ir[condition].a;
+        truthy = !truthy;
+    }
+    if (r->ir[condition].type != TYPE_BOOL || isConstant(r, condition)) return;
+    int guard = emitIr(r, truthy ? IR_GUARD_TRUE : IR_GUARD_FALSE, 0, condition, 0);
+    r->ir[guard].snapshot = snapshotAt(r, ip, depth);
+}
+
+static int fieldSlot(Value receiver, ObjString *name) {
+    if (!IS_INSTANCE(receiver)) return -1;
+    ObjShape *shape = FROM_REF(ObjShape, AS_INSTANCE(receiver)->shape);
+    return shape == NULL ? -1 : shapeLookup(shape, name);
+}
+
+static bool isFalsey(Value value) {
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static void initRecorder(Recorder *r, TraceSite *site, TraceExit *parent, CallFrame *frame) {
+    r->site = site;
+    r->parent = parent;
+    r->count = 1;
+    r->ir[0] = (IrIns){.op = IR_CONST, .type = TYPE_NULL, .snapshot = -1, .value = NULL_VAL};
+    r->snapshotCount = 0;
+    r->entryCount = 0;
+    r->depth = (int) (vm.stackTop - frame->slots);
+    memset(r->stack, 0, sizeof(r->stack));
+    memset(r->pushed, 0, sizeof(r->pushed));
+    memset(r->shapeChecked, 0, sizeof(r->shapeChecked));
+    r->globalCount = 0;
+    r->objectCount = 0;
+    r->full = false;
+    // Snapshot 0 is the loop header, where guards hoisted out of the loop leave for.
+    snapshotAt(r, frame->ip, r->depth);
+}
+
+static Trace *compileTrace(Recorder *r);
+static TraceSite *findSite(ObjFunction *function, uint8_t *header, int depth);
+
+/**
+ * Records from the frame's current instruction until execution returns to the
+ * site's header, then compiles the recording. The instructions recorded have really
+ * run, so the frame and stack are left wherever recording stopped, complete or not.
+ */
+static Trace *record(TraceSite *site, TraceExit *parent, CallFrame *frame) {
+    Recorder *r = &recorder;
+    if (vm.stackTop - frame->slots > TRACE_MAX_SLOTS - 4) {
+        stats.aborts[ABORT_STACK]++;
+        return NULL;
+    }
+    initRecorder(r, site, parent, frame);
+
+    uint8_t *ip = frame->ip;
+    Value *sp = vm.stackTop;
+    Value *slots = frame->slots;
+    Value *constants = FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values;
+    int backEdges = 0;
+    bool started = false;
+    AbortReason reason;
+
+#define SHORT_OPERAND(at) ((uint16_t) ((ip[at] << 8) | ip[at + 1]))
+#define ABORT(why) \
+    do { \
+      reason = (why); \
+      goto aborted; \
+    } while (false)
+
+    for (;;) {
+        if (ip == site->header && started) {
+            if (r->depth != site->depth) ABORT(ABORT_STACK);
+            int loop = emitIr(r, IR_LOOP, 0, 0, 0);
+            r->ir[loop].snapshot = snapshotAt(r, ip, r->depth);
+            if (r->full) ABORT(ABORT_TOO_LONG);
+            break;
+        }
+        if (r->full || r->count > TRACE_MAX_IR - 8) ABORT(ABORT_TOO_LONG);
+        if (r->depth > TRACE_MAX_SLOTS - 4) ABORT(ABORT_STACK);
+        r->ip = ip;
+        r->instructionSnapshot = -1;
+
+        switch (*ip) {
+            case OP_CONSTANT: {
+                Value value = constants[ip[1]];
+                pushRef(r, constRef(r, value));
+                *sp++ = value;
+                ip += 2;
+                break;
+            }
+            case OP_NULL:
+            case OP_TRUE:
+            case OP_FALSE: {
+                Value value = *ip == OP_NULL ? NULL_VAL : BOOL_VAL(*ip == OP_TRUE);
+                pushRef(r, constRef(r, value));
+                *sp++ = value;
+                ip++;
+                break;
+            }
+            case OP_POP:
+                r->depth--;
+                sp--;
+                ip++;
+                break;
+            case OP_GET_LOCAL: {
+                int slot = ip[1];
+                pushRef(r, slotRef(r, slot, slots[slot]));
+                *sp++ = slots[slot];
+                ip += 2;
+                break;
+            }
+            case OP_SET_LOCAL: {
+                int slot = ip[1];
+                storeSlot(r, slot, topRef(r, sp, 0));
+                slots[slot] = sp[-1];
+                ip += 2;
+                break;
+            }
+            case OP_GET_GLOBAL_SLOT: {
+                int slot = SHORT_OPERAND(1);
+                Value value = vm.globalSlots[slot].value;
+                if (IS_UNDEFINED(value)) ABORT(ABORT_GLOBAL);
+                pushRef(r, globalRef(r, slot, value));
+                *sp++ = value;
+                ip += 3;
+                break;
+            }
+            case OP_SET_GLOBAL_SLOT: {
+                int slot = SHORT_OPERAND(1);
+                if (IS_UNDEFINED(vm.globalSlots[slot].value)) ABORT(ABORT_GLOBAL);
+                storeGlobal(r, slot, topRef(r, sp, 0));
+                vm.globalSlots[slot].value = sp[-1];
+                ip += 3;
+                break;
+            }
+            case OP_GET_PROPERTY: {
+                int field = fieldSlot(sp[-1], AS_STRING(constants[ip[1]]));
+                if (field < 0) ABORT(ABORT_PROPERTY);
+                ObjInstance *instance = AS_INSTANCE(sp[-1]);
+                int object = topRef(r, sp, 0);
+                guardShape(r, object, FROM_REF(ObjShape, instance->shape));
+                Value value = instance->fields[field];
+                int ref = emitIr(r, IR_FIELD, typeOf(value), object, 0);
+                r->ir[ref].slot = field;
+                r->ir[ref].snapshot = instructionSnapshot(r);
+                r->depth--;
+                pushRef(r, ref);
+                sp[-1] = value;
+                ip += 4;
+                break;
+            }
+            case OP_SET_PROPERTY: {
+                // Only stores to existing fields: adding one changes the shape.
+                int field = fieldSlot(sp[-2], AS_STRING(constants[ip[1]]));
+                if (field < 0) ABORT(ABORT_PROPERTY);
+                // Object references would need the write barrier; the recorded type
+                // is guarded, so other values never do.
+                if (IS_OBJ(sp[-1])) ABORT(ABORT_FIELD_OBJECT);
+                ObjInstance *instance = AS_INSTANCE(sp[-2]);
+                int object = topRef(r, sp, 1);
+                int value = topRef(r, sp, 0);
+                guardShape(r, object, FROM_REF(ObjShape, instance->shape));
+                int store = emitIr(r, IR_STORE_FIELD, 0, object, value);
+                r->ir[store].slot = field;
+                r->depth -= 2;
+                pushRef(r, value);
+                instance->fields[field] = sp[-1];
+                sp[-2] = sp[-1];
+                sp--;
+                ip += 4;
+                break;
+            }
+            case OP_EQUAL:
+            case OP_EQUAL_NUM:
+            case OP_NOT_EQUAL:
+            case OP_NOT_EQUAL_NUM: {
+                bool negate = *ip == OP_NOT_EQUAL || *ip == OP_NOT_EQUAL_NUM;
+                int b = topRef(r, sp, 0);
+                int a = topRef(r, sp, 1);
+                int ref = equality(r, a, b, negate);
+                if (ref < 0) ABORT(ABORT_TYPES);
+                r->depth -= 2;
+                pushRef(r, ref);
+                sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]) != negate);
+                sp--;
+                ip++;
+                break;
+            }
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL: {
+                if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) ABORT(ABORT_TYPES);
+                IrOp op = *ip == OP_GREATER ? IR_GT : *ip == OP_GREATER_EQUAL ? IR_GE : *ip == OP_LESS ? IR_LT : IR_LE;
+                int b = topRef(r, sp, 0);
+                int a = topRef(r, sp, 1);
+                int ref = comparison(r, op, a, b);
+                r->depth -= 2;
+                pushRef(r, ref);
+                sp[-2] = BOOL_VAL(compareNumbers(op, AS_NUMBER(sp[-2]), AS_NUMBER(sp[-1])));
+                sp--;
+                ip++;
+                break;
+            }
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_MOD: {
+                // String concatenation allocates, so only number arithmetic is traced.
+                if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) ABORT(ABORT_TYPES);
+                IrOp op;
+                switch (*ip) {
+                    case OP_SUBTRACT: op = IR_SUB; break;
+                    case OP_MULTIPLY: op = IR_MUL; break;
+                    case OP_DIVIDE: op = IR_DIV; break;
+                    case OP_MOD: op = IR_MOD; break;
+                    default: op = IR_ADD; break;
+                }
+                int b = topRef(r, sp, 0);
+                int a = topRef(r, sp, 1);
+                int ref = arithmetic(r, op, a, b);
+                r->depth -= 2;
+                pushRef(r, ref);
+                sp[-2] = NUMBER_VAL(evaluate(op, AS_NUMBER(sp[-2]), AS_NUMBER(sp[-1])));
+                sp--;
+                ip++;
+                break;
+            }
+            case OP_ADD_LOCALS: {
+                Value a = slots[ip[1]];
+                Value b = slots[ip[2]];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) ABORT(ABORT_TYPES);
+                int left = slotRef(r, ip[1], a);
+                int right = slotRef(r, ip[2], b);
+                pushRef(r, arithmetic(r, IR_ADD, left, right));
+                *sp++ = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                ip += 3;
+                break;
+            }
+            case OP_ADD_LOCAL_CONSTANT: {
+                Value *local = &slots[ip[1]];
+                Value constant = constants[ip[2]];
+                if (!IS_NUMBER(*local) || !IS_NUMBER(constant)) ABORT(ABORT_TYPES);
+                int sum = arithmetic(r, IR_ADD, slotRef(r, ip[1], *local), constRef(r, constant));
+                storeSlot(r, ip[1], sum);
+                pushRef(r, sum);
+                *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(constant));
+                *sp++ = *local;
+                ip += 3;
+                break;
+            }
+            case OP_NOT: {
+                int operand = topRef(r, sp, 0);
+                uint8_t type = r->ir[operand].type;
+                int ref;
+                if (type == TYPE_BOOL && !isConstant(r, operand)) {
+                    ref = emitIr(r, IR_NOT, TYPE_BOOL, operand, 0);
+                } else {
+                    ref = constRef(r, BOOL_VAL(isFalsey(sp[-1])));
+                }
+                r->depth--;
+                pushRef(r, ref);
+                sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+                ip++;
+                break;
+            }
+            case OP_NEGATE: {
+                if (!IS_NUMBER(sp[-1])) ABORT(ABORT_TYPES);
+                int operand = topRef(r, sp, 0);
+                int ref = isConstant(r, operand)
+                              ? constRef(r, NUMBER_VAL(-constantNumber(r, operand)))
+                              : emitIr(r, IR_NEG, TYPE_NUMBER, operand, 0);
+                r->depth--;
+                pushRef(r, ref);
+                sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+                ip++;
+                break;
+            }
+            case OP_JUMP:
+                ip += 3 + SHORT_OPERAND(1);
+                break;
+            case OP_JUMP_IF_FALSE: {
+                uint8_t *next = ip + 3;
+                uint8_t *target = next + SHORT_OPERAND(1);
+                bool falsey = isFalsey(sp[-1]);
+                guardTruth(r, topRef(r, sp, 0), !falsey, falsey ? next : target, r->depth);
+                ip = falsey ? target : next;
+                break;
+            }
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_EQUAL_NUM:
+            case OP_JUMP_IF_NOT_EQUAL:
+            case OP_JUMP_IF_NOT_EQUAL_NUM: {
+                uint8_t *next = ip + 3;
+                uint8_t *target = next + SHORT_OPERAND(1);
+                bool jumpIfEqual = *ip == OP_JUMP_IF_EQUAL || *ip == OP_JUMP_IF_EQUAL_NUM;
+                int b = topRef(r, sp, 0);
+                int a = topRef(r, sp, 1);
+                int equal = equality(r, a, b, false);
+                if (equal < 0) ABORT(ABORT_TYPES);
+                bool isEqual = valuesEqual(sp[-2], sp[-1]);
+                bool jump = isEqual == jumpIfEqual;
+                r->depth -= 2;
+                sp -= 2;
+                guardTruth(r, equal, isEqual, jump ? next : target, r->depth);
+                ip = jump ? target : next;
+                break;
+            }
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_LESS_EQUAL: {
+                if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) ABORT(ABORT_TYPES);
+                uint8_t *next = ip + 3;
+                uint8_t *target = next + SHORT_OPERAND(1);
+                IrOp op;
+                switch (*ip) {
+                    case OP_JUMP_IF_NOT_GREATER: op = IR_GT; break;
+                    case OP_JUMP_IF_NOT_GREATER_EQUAL: op = IR_GE; break;
+                    case OP_JUMP_IF_NOT_LESS: op = IR_LT; break;
+                    default: op = IR_LE; break;
+                }
+                int b = topRef(r, sp, 0);
+                int a = topRef(r, sp, 1);
+                int test = comparison(r, op, a, b);
+                bool passed = compareNumbers(op, AS_NUMBER(sp[-2]), AS_NUMBER(sp[-1]));
+                r->depth -= 2;
+                sp -= 2;
+                guardTruth(r, test, passed, passed ? target : next, r->depth);
+                ip = passed ? next : target;
+                break;
+            }
+            case OP_LOOP: {
+                uint8_t *target = ip + 3 - SHORT_OPERAND(1);
+                if (target != site->header) {
+                    if (backEdges == TRACE_MAX_BACK_EDGES) ABORT(ABORT_INNER_LOOP);
+                    r->crossed[backEdges].header = target;
+                    r->crossed[backEdges++].depth = r->depth;
+                }
+                ip = target;
+                break;
+            }
+            case OP_POINT_RIGHT:
+            case OP_POINT_LEFT:
+            case OP_TYPE:
+            case OP_COLON:
+                ip++;
+                break;
+            default:
+                stats.abortedOpcodes[*ip]++;
+                ABORT(ABORT_INSTRUCTION);
+        }
+        started = true;
+    }
+
+#undef SHORT_OPERAND
+#undef ABORT
+
+    frame->ip = ip;
+    vm.stackTop = sp;
+    Trace *trace = compileTrace(r);
+    if (trace == NULL) {
+        stats.aborts[ABORT_COMPILE]++;
+        return NULL;
+    }
+    // The other back edge of a for loop leads into this trace; it needs none of its own.
+    if (parent == NULL) {
+        for (int i = 0; i < backEdges; i++) {
+            TraceSite *crossed = findSite(FROM_REF(ObjFunction, frame->closure->function), r->crossed[i].header, r->crossed[i].depth);
+            if (crossed != NULL && crossed->root == NULL) crossed->covered = true;
+        }
+    }
+    return trace;
+
+aborted:
+    frame->ip = ip;
+    vm.stackTop = sp;
+    stats.aborts[reason]++;
+    return NULL;
+}
+
+typedef struct {
+    int jump; // Offset of a rel32 to patch with the exit stub.
+    int snapshot;
+} ExitJump;
+
+typedef struct {
+    Assembler as;
+    Recorder *r;
+    Trace *trace;
+    int order[TRACE_MAX_IR]; // Instructions in emission order: the pre-header, then the body.
+    int orderCount;
+    int bodyStart; // Index into order of the first body instruction.
+    int uses[TRACE_MAX_IR];
+    int lastUse[TRACE_MAX_IR]; // Position in order of the last instruction reading a value.
+    bool dead[TRACE_MAX_IR];
+    bool fused[TRACE_MAX_IR]; // Compare emitted as part of the guard that reads it.
+    int8_t reg[TRACE_MAX_IR];
+    int16_t spill[TRACE_MAX_IR];
+    int spillCount;
+    ExitJump *exitJumps;
+    int exitJumpCount;
+    int exitJumpCapacity;
+} TraceCompiler;
+
+static TraceCompiler traceCompiler;
+
+static bool isPure(uint8_t op) {
+    switch (op) {
+        case IR_CONST:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_NEG:
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+        case IR_NE:
+        case IR_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isComparison(uint8_t op) {
+    return op >= IR_LT && op <= IR_NE;
+}
+
+static int operandCount(uint8_t op) {
+    switch (op) {
+        case IR_CONST:
+        case IR_SLOT:
+        case IR_GLOBAL:
+        case IR_LOOP:
+            return 0;
+        case IR_FIELD:
+        case IR_NEG:
+        case IR_NOT:
+        case IR_GUARD_TRUE:
+        case IR_GUARD_FALSE:
+        case IR_GUARD_SHAPE:
+        case IR_STORE_SLOT:
+        case IR_STORE_GLOBAL:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+/**
+ * Loop-invariant code motion for a root trace. A slot or global the loop never
+ * assigns is loaded and type checked once before the loop; one it only assigns
+ * values of the type it was loaded with keeps its load but is type checked once.
+ * Shape guards on invariant instances move out with them.
+ */
+static void hoist(Recorder *r) {
+    for (int i = 1; i < r->count; i++) {
+        IrIns *load = &r->ir[i];
+        if (load->op == IR_GUARD_SHAPE && (r->ir[load->a].flags & IR_INVARIANT)) {
+            load->flags |= IR_HOISTED;
+            continue;
+        }
+        if (load->op != IR_SLOT && load->op != IR_GLOBAL) continue;
+
+        uint8_t storeOp = load->op == IR_SLOT ? IR_STORE_SLOT : IR_STORE_GLOBAL;
+        bool stored = false;
+        bool stable = true;
+        for (int j = i + 1; j < r->count; j++) {
+            IrIns *store = &r->ir[j];
+            if (store->op != storeOp || store->slot != load->slot) continue;
+            stored = true;
+            stable &= r->ir[store->a].type == load->type;
+        }
+        if (load->op == IR_SLOT) {
+            // A slot the trace popped and pushed again is written back by the loop's snapshot instead.
+            Snapshot *loop = &r->snapshots[r->ir[r->count - 1].snapshot];
+            for (int e = 0; e < loop->count; e++) {
+                SnapshotEntry *entry = &r->entries[loop->start + e];
+                if (entry->slot != load->slot || entry->ref == i) continue;
+                stored = true;
+                stable &= r->ir[entry->ref].type == load->type;
+            }
+        }
+        if (!stored) {
+            load->flags |= IR_INVARIANT;
+        } else if (stable) {
+            load->flags |= IR_CHECK_HOISTED;
+        }
+    }
+}
+
+static bool inPreheader(IrIns *ins) {
+    return ins->flags & (IR_INVARIANT | IR_CHECK_HOISTED | IR_HOISTED);
+}
+
+static void markLastUse(TraceCompiler *tc, int ref, int position) {
+    if (ref != 0 && tc->lastUse[ref] < position) tc->lastUse[ref] = position;
+}
+
+/** Dead code, fused compares and the live range of every value. */
+static void analyze(TraceCompiler *tc) {
+    Recorder *r = tc->r;
+    memset(tc->uses, 0, sizeof(int) * r->count);
+    memset(tc->dead, 0, sizeof(bool) * r->count);
+    memset(tc->fused, 0, sizeof(bool) * r->count);
+
+    for (int i = r->count - 1; i >= 1; i--) {
+        IrIns *ins = &r->ir[i];
+        if (isPure(ins->op) && tc->uses[i] == 0 && !(ins->flags & IR_INVARIANT)) {
+            tc->dead[i] = true;
+            continue;
+        }
+        int operands = operandCount(ins->op);
+        if (operands > 0) tc->uses[ins->a]++;
+        if (operands > 1) tc->uses[ins->b]++;
+        if (ins->snapshot >= 0 && !(ins->flags & (IR_INVARIANT | IR_HOISTED))) {
+            Snapshot *snapshot = &r->snapshots[ins->snapshot];
+            for (int e = 0; e < snapshot->count; e++) tc->uses[r->entries[snapshot->start + e].ref]++;
+        }
+    }
+
+    for (int i = 1; i < r->count; i++) {
+        IrIns *ins = &r->ir[i];
+        if ((ins->op == IR_GUARD_TRUE || ins->op == IR_GUARD_FALSE) && isComparison(r->ir[ins->a].op) &&
+            tc->uses[ins->a] == 1) {
+            tc->fused[ins->a] = true;
+        }
+    }
+
+    tc->orderCount = 0;
+    for (int i = 1; i < r->count; i++) {
+        if (!tc->dead[i] && inPreheader(&r->ir[i])) tc->order[tc->orderCount++] = i;
+    }
+    tc->bodyStart = tc->orderCount;
+    for (int i = 1; i < r->count; i++) {
+        IrIns *ins = &r->ir[i];
+        if (tc->dead[i] || tc->fused[i] || (ins->flags & (IR_INVARIANT | IR_HOISTED))) continue;
+        tc->order[tc->orderCount++] = i;
+    }
+
+    for (int i = 0; i < r->count; i++) tc->lastUse[i] = -1;
+    for (int position = 0; position < tc->orderCount; position++) {
+        int i = tc->order[position];
+        IrIns *ins = &r->ir[i];
+        if (ins->flags & IR_INVARIANT) {
+            if (tc->uses[i] > 0) tc->lastUse[i] = tc->orderCount;
+            continue;
+        }
+        if (position < tc->bodyStart) continue; // Checks only; snapshot 0 holds nothing.
+
+        int operands = operandCount(ins->op);
+        if (operands > 0) {
+            markLastUse(tc, ins->a, position);
+            if (tc->fused[ins->a]) {
+                markLastUse(tc, r->ir[ins->a].a, position);
+                markLastUse(tc, r->ir[ins->a].b, position);
+            }
+        }
+        if (operands > 1) markLastUse(tc, ins->b, position);
+        if (ins->snapshot >= 0) {
+            Snapshot *snapshot = &r->snapshots[ins->snapshot];
+            for (int e = 0; e < snapshot->count; e++) {
+                markLastUse(tc, r->entries[snapshot->start + e].ref, position);
+            }
+        }
+    }
+}
+
+static bool producesValue(IrIns *ins) {
+    return ins->op != IR_CONST && ins->op < IR_GUARD_TRUE;
+}
+
+/** Linear scan over the emission order; values that find no free xmm register are spilled. */
+static bool allocate(TraceCompiler *tc) {
+    Recorder *r = tc->r;
+    int owner[XMM_COUNT] = {0};
+    tc->spillCount = 0;
+    for (int i = 0; i < r->count; i++) {
+        tc->reg[i] = -1;
+        tc->spill[i] = -1;
+    }
+
+    for (int position = 0; position < tc->orderCount; position++) {
+        int i = tc->order[position];
+        IrIns *ins = &r->ir[i];
+        if (!producesValue(ins) || (ins->flags & IR_CHECK_HOISTED && position < tc->bodyStart)) continue;
+        if (tc->lastUse[i] < 0) continue;
+
+        for (int x = FIRST_XMM; x < XMM_COUNT; x++) {
+            if (owner[x] != 0 && tc->lastUse[owner[x]] <= position) owner[x] = 0;
+        }
+        int chosen = -1;
+        for (int x = FIRST_XMM; x < XMM_COUNT && chosen < 0; x++) {
+            if (owner[x] == 0) chosen = x;
+        }
+        if (chosen >= 0) {
+            owner[chosen] = i;
+            tc->reg[i] = (int8_t) chosen;
+        } else {
+            if (tc->spillCount == SPILL_SLOTS) return false;
+            tc->spill[i] = (int16_t) tc->spillCount++;
+        }
+    }
+    return true;
+}
+
+static void addExit(TraceCompiler *tc, int jump, int snapshot) {
+    if (!asmReserve(&tc->as, (void **) &tc->exitJumps, &tc->exitJumpCapacity, tc->exitJumpCount,
+                    sizeof(ExitJump))) {
+        return;
+    }
+    tc->exitJumps[tc->exitJumpCount++] = (ExitJump){jump, snapshot};
+}
+
+/** Leaves the Value bits of [ref] in general register [dst]. */
+static void loadGpr(TraceCompiler *tc, Register dst, int ref) {
+    IrIns *ins = &tc->r->ir[ref];
+    if (ins->op == IR_CONST) {
+        asmMoveImmediate(&tc->as, dst, ins->value);
+    } else if (tc->reg[ref] >= 0) {
+        asmMoveFromXmm(&tc->as, dst, tc->reg[ref]);
+    } else {
+        asmLoad(&tc->as, dst, RSP, tc->spill[ref] * 8);
+    }
+}
+
+/** Leaves the Value bits of [ref] in xmm [dst]. Constants go through rax. */
+static void loadXmm(TraceCompiler *tc, int dst, int ref) {
+    IrIns *ins = &tc->r->ir[ref];
+    if (ins->op == IR_CONST) {
+        asmMoveImmediate(&tc->as, RAX, ins->value);
+        asmMoveToXmm(&tc->as, dst, RAX);
+    } else if (tc->reg[ref] >= 0) {
+        if (tc->reg[ref] != dst) asmSse(&tc->as, 0x66, 0x28, dst, tc->reg[ref]); // movapd
+    } else {
+        asmLoadDouble(&tc->as, dst, RSP, tc->spill[ref] * 8);
+    }
+}
+
+static void defineFromXmm(TraceCompiler *tc, int ref, int src) {
+    if (tc->reg[ref] >= 0) {
+        if (tc->reg[ref] != src) asmSse(&tc->as, 0x66, 0x28, tc->reg[ref], src);
+    } else if (tc->spill[ref] >= 0) {
+        asmStoreDouble(&tc->as, RSP, tc->spill[ref] * 8, src);
+    }
+}
+
+static void defineFromGpr(TraceCompiler *tc, int ref, Register src) {
+    if (tc->reg[ref] >= 0) {
+        asmMoveToXmm(&tc->as, tc->reg[ref], src);
+    } else if (tc->spill[ref] >= 0) {
+        asmStore(&tc->as, RSP, tc->spill[ref] * 8, src);
+    }
+}
+
+static void storeRef(TraceCompiler *tc, Register base, int32_t disp, int ref) {
+    if (tc->r->ir[ref].op != IR_CONST && tc->reg[ref] >= 0) {
+        asmStoreDouble(&tc->as, base, disp, tc->reg[ref]);
+        return;
+    }
+    loadGpr(tc, RAX, ref);
+    asmStore(&tc->as, base, disp, RAX);
+}
+
+/** Leaves unless the Value in [value] has [type]. Clobbers rcx and rdx. */
+static void emitTypeGuard(TraceCompiler *tc, Register value, uint8_t type, int snapshot) {
+    Assembler *as = &tc->as;
+    switch (type) {
+        case TYPE_NUMBER:
+            asmAlu(as, ALU_MOV, RCX, value);
+            asmAlu(as, ALU_AND, RCX, QNAN_MASK);
+            asmAlu(as, ALU_CMP, RCX, QNAN_MASK);
+            addExit(tc, asmJumpIf(as, CC_E), snapshot);
+            break;
+        case TYPE_NULL:
+        case TYPE_BOOL:
+            asmAlu(as, ALU_MOV, RCX, value);
+            if (type == TYPE_BOOL) asmBytes(as, (uint8_t[]){0x48, 0x83, 0xC9, 0x01}, 4); // or rcx, 1
+            asmMoveImmediate(as, RDX, type == TYPE_BOOL ? TRUE_VAL : NULL_VAL);
+            asmAlu(as, ALU_CMP, RCX, RDX);
+            addExit(tc, asmJumpIf(as, CC_NE), snapshot);
+            break;
+        default:
+            asmAlu(as, ALU_MOV, RCX, value);
+            asmAlu(as, ALU_AND, RCX, OBJ_MASK);
+            asmAlu(as, ALU_CMP, RCX, OBJ_MASK);
+            addExit(tc, asmJumpIf(as, CC_NE), snapshot);
+            asmAlu(as, ALU_MOV, RCX, value);
+            asmAlu(as, ALU_XOR, RCX, OBJ_MASK);
+            asmCompareMemory8(as, RCX, offsetof(Obj, type), (int8_t) (type - TYPE_OBJECT(0)));
+            addExit(tc, asmJumpIf(as, CC_NE), snapshot);
+            break;
+    }
+}
+
+/** Leaves the instance pointer of [ref] in [dst]. */
+static void loadInstance(TraceCompiler *tc, Register dst, int ref) {
+    loadGpr(tc, dst, ref);
+    asmAlu(&tc->as, ALU_XOR, dst, OBJ_MASK);
+}
+
+/**
+ * Sets the flags for a number comparison so that [*condition] holds when it is true:
+ * a > b is "above" after ucomisd a, b and a < b is b above a, while <= and >= are
+ * their negations, true for unordered (NaN) operands as in the interpreter.
+ */
+static void emitNumberCompare(TraceCompiler *tc, IrIns *compare, int *condition) {
+    bool swap = compare->op == IR_LT || compare->op == IR_GE;
+    loadXmm(tc, 0, swap ? compare->b : compare->a);
+    loadXmm(tc, 1, swap ? compare->a : compare->b);
+    asmSse(&tc->as, 0x66, 0x2E, 0, 1); // ucomisd xmm0, xmm1
+    *condition = compare->op == IR_LE || compare->op == IR_GE ? CC_BE : CC_A;
+}
+
+/** Sets ZF when the operands of an IR_EQ/IR_NE are equal, and for numbers PF when unordered. */
+static bool emitEqualityCompare(TraceCompiler *tc, IrIns *compare) {
+    if (tc->r->ir[compare->a].type == TYPE_NUMBER) {
+        loadXmm(tc, 0, compare->a);
+        loadXmm(tc, 1, compare->b);
+        asmSse(&tc->as, 0x66, 0x2E, 0, 1);
+        return true;
+    }
+    loadGpr(tc, RAX, compare->a);
+    loadGpr(tc, RDX, compare->b);
+    asmAlu(&tc->as, ALU_CMP, RAX, RDX);
+    return false;
+}
+
+/** A guard that leaves unless comparison [compare] is [expected]. */
+static void emitFusedGuard(TraceCompiler *tc, IrIns *compare, bool expected, int snapshot) {
+    Assembler *as = &tc->as;
+    if (compare->op == IR_EQ || compare->op == IR_NE) {
+        bool wantEqual = expected == (compare->op == IR_EQ);
+        bool numbers = emitEqualityCompare(tc, compare);
+        if (wantEqual) {
+            addExit(tc, asmJumpIf(as, CC_NE), snapshot);
+            if (numbers) addExit(tc, asmJumpIf(as, CC_P), snapshot);
+        } else {
+            // Leave only when equal: ZF set and, for numbers, ordered.
+            int unordered = numbers ? asmJumpIf(as, CC_P) : -1;
+            addExit(tc, asmJumpIf(as, CC_E), snapshot);
+            if (unordered >= 0) asmPatchJump(as, unordered, as->count);
+        }
+        return;
+    }
+
+    int condition;
+    emitNumberCompare(tc, compare, &condition);
+    addExit(tc, asmJumpIf(as, expected ? condition ^ 1 : condition), snapshot);
+}
+
+/** Materializes a comparison as FALSE_VAL or TRUE_VAL in rax. */
+static void emitBoolValue(TraceCompiler *tc, IrIns *compare) {
+    Assembler *as = &tc->as;
+    if (compare->op == IR_EQ || compare->op == IR_NE) {
+        if (emitEqualityCompare(tc, compare)) {
+            asmBytes(as, (uint8_t[]){0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8}, 8); // sete al; setnp cl; and al, cl
+            asmBytes(as, (uint8_t[]){0x0F, 0xB6, 0xC0}, 3); // movzx eax, al
+        } else {
+            asmSetCondition(as, CC_E);
+        }
+        if (compare->op == IR_NE) asmBytes(as, (uint8_t[]){0x83, 0xF0, 0x01}, 3); // xor eax, 1
+    } else {
+        int condition;
+        emitNumberCompare(tc, compare, &condition);
+        asmSetCondition(as, condition);
+    }
+    asmMoveImmediate(as, RCX, FALSE_VAL);
+    asmAlu(as, ALU_ADD, RAX, RCX);
+}
+
+static void emitMaterialize(TraceCompiler *tc, int snapshotIndex) {
+    Snapshot *snapshot = &tc->r->snapshots[snapshotIndex];
+    for (int e = 0; e < snapshot->count; e++) {
+        SnapshotEntry *entry = &tc->r->entries[snapshot->start + e];
+        storeRef(tc, SLOTS, entry->slot * (int32_t) sizeof(Value), entry->ref);
+    }
+}
+
+static void emitIns(TraceCompiler *tc, int i, bool preheader, int loopLabel) {
+    Assembler *as = &tc->as;
+    Recorder *r = tc->r;
+    IrIns *ins = &r->ir[i];
+    int exit = preheader ? 0 : ins->snapshot;
+
+    switch (ins->op) {
+        case IR_SLOT:
+        case IR_GLOBAL: {
+            Register base = ins->op == IR_SLOT ? SLOTS : GLOBALS;
+            int32_t disp = ins->op == IR_SLOT
+                               ? ins->slot * (int32_t) sizeof(Value)
+                               : ins->slot * (int32_t) sizeof(GlobalSlot) + (int32_t) offsetof(GlobalSlot, value);
+            bool check = preheader || !(ins->flags & IR_CHECK_HOISTED);
+            bool define = !(preheader && (ins->flags & IR_CHECK_HOISTED));
+            asmLoad(as, RAX, base, disp);
+            if (check) emitTypeGuard(tc, RAX, ins->type, exit);
+            if (define) defineFromGpr(tc, i, RAX);
+            break;
+        }
+        case IR_FIELD:
+            loadInstance(tc, RDX, ins->a);
+            asmLoad(as, RDX, RDX, offsetof(ObjInstance, fields));
+            asmLoad(as, RAX, RDX, ins->slot * (int32_t) sizeof(Value));
+            emitTypeGuard(tc, RAX, ins->type, exit);
+            defineFromGpr(tc, i, RAX);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV: {
+            static const uint8_t opcodes[] = {SSE_ADD, SSE_SUB, SSE_MUL, SSE_DIV};
+            loadXmm(tc, 0, ins->a);
+            loadXmm(tc, 1, ins->b);
+            asmSse(as, 0xF2, opcodes[ins->op - IR_ADD], 0, 1);
+            defineFromXmm(tc, i, 0);
+            break;
+        }
+        case IR_MOD:
+            // modulo(): a - (int) a / (int) b * b, with the same truncating conversions.
+            loadXmm(tc, 0, ins->a);
+            loadXmm(tc, 1, ins->b);
+            asmSse(as, 0xF2, 0x2C, RAX, 0); // cvttsd2si eax, xmm0
+            asmSse(as, 0xF2, 0x2C, RCX, 1); // cvttsd2si ecx, xmm1
+            asmBytes(as, (uint8_t[]){0x85, 0xC9}, 2); // test ecx, ecx
+            addExit(tc, asmJumpIf(as, CC_E), exit);
+            asmBytes(as, (uint8_t[]){0x99, 0xF7, 0xF9}, 3); // cdq; idiv ecx
+            asmSse(as, 0xF2, 0x2A, 0, RAX); // cvtsi2sd xmm0, eax
+            asmSse(as, 0xF2, SSE_MUL, 0, 1);
+            loadXmm(tc, 1, ins->a);
+            asmSse(as, 0xF2, SSE_SUB, 1, 0);
+            defineFromXmm(tc, i, 1);
+            break;
+        case IR_NEG:
+            loadGpr(tc, RAX, ins->a);
+            asmMoveImmediate(as, RCX, SIGN_BIT);
+            asmAlu(as, ALU_XOR, RAX, RCX);
+            defineFromGpr(tc, i, RAX);
+            break;
+        case IR_LT:
+        case IR_LE:
+        case IR_GT:
+        case IR_GE:
+        case IR_EQ:
+        case IR_NE:
+            emitBoolValue(tc, ins);
+            defineFromGpr(tc, i, RAX);
+            break;
+        case IR_NOT:
+            loadGpr(tc, RAX, ins->a);
+            asmBytes(as, (uint8_t[]){0x48, 0x83, 0xF0, 0x01}, 4); // xor rax, 1: false <-> true
+            defineFromGpr(tc, i, RAX);
+            break;
+        case IR_GUARD_TRUE:
+        case IR_GUARD_FALSE: {
+            bool expected = ins->op == IR_GUARD_TRUE;
+            if (tc->fused[ins->a]) {
+                emitFusedGuard(tc, &r->ir[ins->a], expected, exit);
+                break;
+            }
+            loadGpr(tc, RAX, ins->a);
+            asmMoveImmediate(as, RCX, TRUE_VAL);
+            asmAlu(as, ALU_CMP, RAX, RCX);
+            addExit(tc, asmJumpIf(as, expected ? CC_NE : CC_E), exit);
+            break;
+        }
+        case IR_GUARD_SHAPE:
+            loadInstance(tc, RDX, ins->a);
+#ifdef GECCO_COMPRESSED_HEAP
+            asmCompareMemory32(as, RDX, offsetof(ObjInstance, shape), (int32_t) ins->value);
+#else
+            asmLoad(as, RAX, RDX, offsetof(ObjInstance, shape));
+            asmMoveImmediate(as, RCX, ins->value);
+            asmAlu(as, ALU_CMP, RAX, RCX);
+#endif
+            addExit(tc, asmJumpIf(as, CC_NE), exit);
+            break;
+        case IR_STORE_SLOT:
+            storeRef(tc, SLOTS, ins->slot * (int32_t) sizeof(Value), ins->a);
+            break;
+        case IR_STORE_GLOBAL:
+            storeRef(tc, GLOBALS, ins->slot * (int32_t) sizeof(GlobalSlot) + (int32_t) offsetof(GlobalSlot, value),
+                     ins->a);
+            break;
+        case IR_STORE_FIELD:
+            loadInstance(tc, RDX, ins->a);
+            asmLoad(as, RDX, RDX, offsetof(ObjInstance, fields));
+            storeRef(tc, RDX, ins->slot * (int32_t) sizeof(Value), ins->b);
+            break;
+        case IR_LOOP:
+            emitMaterialize(tc, ins->snapshot);
+            if (r->parent == NULL) {
+                asmPatchJump(as, asmJump(as), loopLabel);
+            } else {
+                asmMoveImmediate(as, RAX, (uint64_t) (uintptr_t) r->site->root->loop);
+                asmBytes(as, (uint8_t[]){0xFF, 0xE0}, 2); // jmp rax
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void freeTrace(Trace *trace) {
+    if (trace->code != NULL) asmRelease(trace->code, trace->size);
+    free(trace->exits);
+    free(trace->objects);
+    free(trace);
+}
+
+/** Optimizes and assembles the recording. Returns null when it does not fit. */
+static Trace *compileTrace(Recorder *r) {
+    TraceCompiler *tc = &traceCompiler;
+    tc->as = (Assembler){0};
+    tc->r = r;
+    tc->exitJumpCount = 0;
+
+    if (r->parent == NULL) hoist(r);
+    analyze(tc);
+    if (!allocate(tc)) return NULL;
+
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (trace == NULL) return NULL;
+    trace->exits = calloc(r->snapshotCount, sizeof(TraceExit));
+    trace->objects = malloc(sizeof(Obj *) * (r->objectCount > 0 ? r->objectCount : 1));
+    if (trace->exits == NULL || trace->objects == NULL) {
+        freeTrace(trace);
+        return NULL;
+    }
+    trace->site = r->site;
+    trace->parent = r->parent;
+    trace->exitCount = r->snapshotCount;
+    trace->irCount = r->count - 1;
+    trace->objectCount = r->objectCount;
+    memcpy(trace->objects, r->objects, sizeof(Obj *) * r->objectCount);
+    for (int s = 0; s < r->snapshotCount; s++) {
+        trace->exits[s].ip = r->snapshots[s].ip;
+        trace->exits[s].depth = r->snapshots[s].depth;
+        trace->exits[s].stub = -1;
+        trace->exits[s].trace = trace;
+    }
+
+    Assembler *as = &tc->as;
+    int loopEntry = 0;
+    if (r->parent == NULL) {
+        asmPrologue(as, FRAME_BYTES);
+        asmAlu(as, ALU_MOV, SLOTS, RDI);
+        asmMoveImmediate(as, RAX, (uint64_t) (uintptr_t) &vm);
+        asmLoad(as, GLOBALS, RAX, offsetof(VM, globalSlots));
+        asmMoveImmediate(as, QNAN_MASK, QNAN);
+        asmMoveImmediate(as, OBJ_MASK, QNAN | SIGN_BIT);
+        loopEntry = as->count;
+    }
+
+    int loopLabel = 0;
+    for (int position = 0; position < tc->orderCount; position++) {
+        if (position == tc->bodyStart) loopLabel = as->count;
+        emitIns(tc, tc->order[position], position < tc->bodyStart, loopLabel);
+    }
+
+    // Exit stubs: rebuild the snapshot's stack values, then return the exit to the
+    // VM. The final movabs/jmp pair is rewritten once the exit gets a side trace.
+    int *stubs = malloc(sizeof(int) * r->snapshotCount);
+    int *tails = malloc(sizeof(int) * r->snapshotCount);
+    if (stubs == NULL || tails == NULL) {
+        free(stubs);
+        free(tails);
+        asmFree(as);
+        freeTrace(trace);
+        return NULL;
+    }
+    for (int s = 0; s < r->snapshotCount; s++) stubs[s] = -1;
+    for (int j = 0; j < tc->exitJumpCount; j++) {
+        int s = tc->exitJumps[j].snapshot;
+        if (stubs[s] < 0) {
+            stubs[s] = as->count;
+            emitMaterialize(tc, s);
+            trace->exits[s].stub = as->count;
+            asmBytes(as, (uint8_t[]){0x48, 0xB8}, 2); // movabs rax, exit
+            asmInt64(as, (uint64_t) (uintptr_t) &trace->exits[s]);
+            tails[s] = asmJump(as);
+        }
+        asmPatchJump(as, tc->exitJumps[j].jump, stubs[s]);
+    }
+    int epilogue = as->count;
+    asmEpilogue(as, FRAME_BYTES);
+    for (int s = 0; s < r->snapshotCount; s++) {
+        if (stubs[s] >= 0) asmPatchJump(as, tails[s], epilogue);
+    }
+    free(stubs);
+    free(tails);
+
+    trace->code = asmInstall(as);
+    trace->size = as->count;
+    asmFree(as);
+    if (trace->code == NULL) {
+        freeTrace(trace);
+        return NULL;
+    }
+    trace->loop = trace->code + loopEntry;
+    trace->id = ++stats.traces;
+    return trace;
+}
+
+typedef TraceExit *(*TraceEntry)(Value *slots);
+
+static TraceSite *findSite(ObjFunction *function, uint8_t *header, int depth) {
+    for (TraceSite *site = function->loops; site != NULL; site = site->next) {
+        if (site->header == header) return site;
+    }
+    TraceSite *site = calloc(1, sizeof(TraceSite));
+    if (site == NULL) return NULL;
+    site->header = header;
+    site->depth = depth;
+    site->next = function->loops;
+    function->loops = site;
+    return site;
+}
+
+static void addTrace(TraceSite *site, Trace *trace) {
+    trace->next = site->traces;
+    site->traces = trace;
+}
+
+/** Points [exit]'s stub at [side] instead of back to the VM. */
+static bool linkExit(TraceExit *exit, Trace *side) {
+    uint8_t jump[12] = {0x48, 0xB8}; // movabs rax, side; jmp rax
+    uint64_t target = (uint64_t) (uintptr_t) side->code;
+    memcpy(&jump[2], &target, sizeof(target));
+    jump[10] = 0xFF;
+    jump[11] = 0xE0;
+    return asmRewrite(exit->trace->code, exit->trace->size, exit->stub, jump, sizeof(jump));
+}
+
+static void runTrace(TraceSite *site, CallFrame *frame) {
+    Trace *root = site->root;
+    root->entries++;
+    TraceExit *exit = ((TraceEntry) root->code)(frame->slots);
+    frame->ip = exit->ip;
+    vm.stackTop = frame->slots + exit->depth;
+    exit->count++;
+    stats.exits++;
+
+    if (exit->side != NULL || exit->attempts >= TRACE_MAX_ATTEMPTS || site->sideCount >= TRACE_MAX_SIDES ||
+        ++exit->hotness < traceHotExit) {
+        return;
+    }
+    exit->hotness = 0;
+    Trace *side = record(site, exit, frame);
+    if (side == NULL) {
+        exit->attempts++;
+        return;
+    }
+    if (!linkExit(exit, side)) {
+        freeTrace(side);
+        exit->attempts = TRACE_MAX_ATTEMPTS;
+        return;
+    }
+    exit->side = side;
+    rememberObject((Obj *) FROM_REF(ObjFunction, frame->closure->function));
+    site->sideCount++;
+    stats.sides++;
+    addTrace(site, side);
+}
+
+static bool hasTraces(ObjFunction *function) {
+    for (TraceSite *site = function->loops; site != NULL; site = site->next) {
+        if (site->root != NULL) return true;
+    }
+    return false;
+}
+
+LoopAction traceLoop(CallFrame *frame) {
+    ObjFunction *function = FROM_REF(ObjFunction, frame->closure->function);
+    int depth = (int) (vm.stackTop - frame->slots);
+    TraceSite *site = findSite(function, frame->ip, depth);
+    if (site == NULL || site->depth != depth) return LOOP_INTERPRET;
+
+    if (site->root != NULL) {
+        runTrace(site, frame);
+        return LOOP_RESUME;
+    }
+    if (site->covered) return LOOP_INTERPRET;
+    if (site->blacklisted) {
+        // Loops around traced loops stay in the interpreter so that those keep running.
+        return hasTraces(function) ? LOOP_INTERPRET : LOOP_NATIVE;
+    }
+    if (++site->hotness < traceHotLoop) return LOOP_INTERPRET;
+
+    site->hotness = 0;
+    Trace *trace = record(site, NULL, frame);
+    if (trace != NULL) {
+        // The function keeps the trace's shapes alive; they may still be young.
+        rememberObject((Obj *) function);
+        site->root = trace;
+        stats.roots++;
+        addTrace(site, trace);
+    } else if (++site->attempts >= TRACE_MAX_ATTEMPTS) {
+        site->blacklisted = true;
+        stats.blacklisted++;
+    }
+    return LOOP_RESUME;
+}
+
+void traceMark(ObjFunction *function) {
+    for (TraceSite *site = function->loops; site != NULL; site = site->next) {
+        for (Trace *trace = site->traces; trace != NULL; trace = trace->next) {
+            for (int i = 0; i < trace->objectCount; i++) markObject(trace->objects[i]);
+        }
+    }
+}
+
+void traceFree(ObjFunction *function) {
+    TraceSite *site = function->loops;
+    while (site != NULL) {
+        TraceSite *next = site->next;
+        Trace *trace = site->traces;
+        while (trace != NULL) {
+            Trace *nextTrace = trace->next;
+            freeTrace(trace);
+            trace = nextTrace;
+        }
+        free(site);
+        site = next;
+    }
+    function->loops = NULL;
+}
+
+typedef struct {
+    Trace *trace;
+    ObjFunction *function;
+} TraceEntryInfo;
+
+static int compareTraces(const void *a, const void *b) {
+    return ((const TraceEntryInfo *) a)->trace->id - ((const TraceEntryInfo *) b)->trace->id;
+}
+
+typedef struct {
+    TraceEntryInfo *traces; // NULL to only count them.
+    int count;
+} TraceList;
+
+/** Appends the traces of [object], if it is a function, to the TraceList in [context]. */
+static void listTraces(Obj *object, void *context) {
+    if (object->type != OBJ_FUNCTION) return;
+    TraceList *list = context;
+    ObjFunction *function = (ObjFunction *) object;
+    for (TraceSite *site = function->loops; site != NULL; site = site->next) {
+        for (Trace *trace = site->traces; trace != NULL; trace = trace->next) {
+            if (list->traces != NULL) list->traces[list->count] = (TraceEntryInfo){trace, function};
+            list->count++;
+        }
+    }
+}
+
+static int lineOf(ObjFunction *function, uint8_t *ip) {
+    return function->chunk.lines[ip - function->chunk.code];
+}
+
+void printTraceStats() {
+    uint64_t aborts = 0;
+    for (int i = 0; i < ABORT_COUNT; i++) aborts += stats.aborts[i];
+    fprintf(stderr, "== traces ==\n");
+    fprintf(stderr, "%d root and %d side traces compiled, %llu exits taken, %llu recordings aborted, "
+            "%d loops blacklisted\n", stats.roots, stats.sides, (unsigned long long) stats.exits,
+            (unsigned long long) aborts, stats.blacklisted);
+
+    TraceList list = {NULL, 0};
+    heapVisit(listTraces, &list);
+    TraceEntryInfo *traces = malloc(sizeof(TraceEntryInfo) * (list.count > 0 ? list.count : 1));
+    if (traces == NULL) return;
+    list = (TraceList){traces, 0};
+    heapVisit(listTraces, &list);
+    int count = list.count;
+    qsort(traces, count, sizeof(TraceEntryInfo), compareTraces);
+
+    for (int i = 0; i < count; i++) {
+        Trace *trace = traces[i].trace;
+        ObjFunction *function = traces[i].function;
+        const char *name = function->name != NULL ? function->name->chars : "script";
+        if (trace->parent == NULL) {
+            fprintf(stderr, "trace %d: loop at line %d of %s, %d IR, %zu bytes, entered %llu times\n",
+                    trace->id, lineOf(function, trace->site->header), name, trace->irCount, trace->size,
+                    (unsigned long long) trace->entries);
+        } else {
+            fprintf(stderr, "trace %d: side trace of trace %d from line %d of %s, %d IR, %zu bytes\n",
+                    trace->id, trace->parent->trace->id, lineOf(function, trace->parent->ip), name,
+                    trace->irCount, trace->size);
+        }
+        for (int e = 0; e < trace->exitCount; e++) {
+            TraceExit *exit = &trace->exits[e];
+            if (exit->count == 0 && exit->side == NULL) continue;
+            fprintf(stderr, "  exit to line %d: %llu", lineOf(function, exit->ip), (unsigned long long) exit->count);
+            if (exit->side != NULL) fprintf(stderr, ", then trace %d", exit->side->id);
+            fprintf(stderr, "\n");
+        }
+    }
+    free(traces);
+
+    if (aborts == 0) return;
+    fprintf(stderr, "== trace aborts ==\n");
+    for (int i = 0; i < ABORT_COUNT; i++) {
+        if (i == ABORT_INSTRUCTION) {
+            for (int op = 0; op < UINT8_COUNT; op++) {
+                if (stats.abortedOpcodes[op] == 0) continue;
+                fprintf(stderr, "%12llu %s %s\n", (unsigned long long) stats.abortedOpcodes[op], abortNames[i],
+                        opcodeName(op));
+            }
+        } else if (stats.aborts[i] > 0) {
+            fprintf(stderr, "%12llu %s\n", (unsigned long long) stats.aborts[i], abortNames[i]);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,46 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include "../common.h"
+
+#ifdef BASELINE_JIT
+
+#include "vm.h"
+
+// Back edges to a loop header the interpreter takes before recording a trace from it.
+#define TRACE_HOT_LOOP 56
+// Times a trace exit is taken before a side trace is recorded from where it leaves.
+#define TRACE_HOT_EXIT 10
+
+/** What the interpreter does after offering a loop back edge to the trace JIT. */
+typedef enum {
+    LOOP_INTERPRET, // Carry on in the interpreter.
+    LOOP_RESUME, // Trace code ran or was recorded: reload ip and the stack top from the VM.
+    LOOP_NATIVE, // The loop cannot be traced; the method JIT may take the frame over.
+} LoopAction;
+
+extern bool traceEnabled;
+extern bool traceStats;
+extern int traceHotLoop;
+extern int traceHotExit;
+
+/**
+ * Offers the back edge OP_LOOP just took to the trace JIT, with the frame's ip at
+ * the loop header and vm.stackTop written back. Counts the header, records and
+ * compiles a trace once it is hot, and runs the compiled trace when there is one.
+ */
+LoopAction traceLoop(CallFrame *frame);
+
+void traceMark(ObjFunction *function);
+void traceFree(ObjFunction *function);
+
+/** Prints the compiled traces, their exits and why recordings were abandoned to stderr. */
+void printTraceStats();
+
+#endif
+
+#endif //trace_h
@@ -14,8 +14,12 @@
 #include "../common.h"
 #include "../compiler/compiler.h"
 #include "../debug/debug.h"
+#include "../debug/profile.h"
 #include "../object.h"
 #include "../memory/memory.h"
+#include "../memory/snapshot.h"
+#include "jit.h"
+#include "trace.h"
 #include "vm.h"
 
 VM vm; // [one]
@@ -24,6 +28,22 @@ static Value clockNative(int argCount, Value *args) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
+/** heapSnapshot(path) writes the reachable heap to path, see memory/snapshot.h. Returns whether it did. */
+static Value heapSnapshotNative(int argCount, Value *args) {
+    if (argCount != 1 || !IS_STRING(args[0])) return BOOL_VAL(false);
+    return BOOL_VAL(writeHeapSnapshot(AS_CSTRING(args[0])));
+}
+
+/** memoryUsage() is the number of bytes the heap holds now. */
+static Value memoryUsageNative(int argCount, Value *args) {
+    return NUMBER_VAL((double) vm.bytesAllocated);
+}
+
+/** peakMemoryUsage() is the most bytes the heap has held. */
+static Value peakMemoryUsageNative(int argCount, Value *args) {
+    return NUMBER_VAL((double) vm.peakBytesAllocated);
+}
+
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
@@ -40,7 +60,7 @@ static void runtimeError(const char *format, ...) {
     // Print stack trace
     for (int i = vm.frameCount - 1; i >= 0; i--) {
         CallFrame *frame = &vm.frames[i];
-        ObjFunction *function = frame->closure->function;
+        ObjFunction *function = FROM_REF(ObjFunction, frame->closure->function);
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ", // [minus]
                 function->chunk.lines[instruction]);
@@ -64,10 +84,19 @@ static void runtimeError(const char *format, ...) {
     resetStack();
 }
 
+/**
+ * Raises the error for a heap left over gcHeapLimit by an allocation, see memory.c. Only
+ * called where unwinding the script is safe: at calls and loop back edges.
+ */
+static void outOfMemory() {
+    vm.memoryExhausted = false;
+    runtimeError("Out of memory: the heap limit of %zu KB is reached.", gcHeapLimit / 1024);
+}
+
 static void defineNative(const char *name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int) strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    defineGlobal(AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
 }
@@ -81,9 +110,24 @@ static void initModuleRegistry() {
 
 void initVM() {
     resetStack();
-    vm.objects = nullptr;
+    vm.youngCount = 0;
+    vm.youngCapacity = 0;
+    vm.youngObjects = nullptr;
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.peakBytesAllocated = 0;
+    vm.youngBytes = 0;
+    configureGC();
+    vm.collectingYoung = false;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = nullptr;
+    vm.permanentCount = 0;
+    vm.permanentCapacity = 0;
+    vm.permanent = nullptr;
+    vm.gcPhase = GC_IDLE;
+    vm.sliceBytes = 0;
+    vm.compactDue = false;
+    vm.memoryExhausted = false;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
@@ -91,7 +135,10 @@ void initVM() {
     
     // Initialize standard tables
     initTable(&vm.globals);
-    initTable(&vm.strings);
+    vm.globalSlots = nullptr;
+    vm.globalCount = 0;
+    vm.globalCapacity = 0;
+    initStringSet(&vm.strings);
     
     // Initialize module system
     initModuleRegistry();
@@ -103,6 +150,9 @@ void initVM() {
     vm.initString = copyString("init", 4);
 
     defineNative("clock", clockNative);
+    defineNative("heapSnapshot", heapSnapshotNative);
+    defineNative("memoryUsage", memoryUsageNative);
+    defineNative("peakMemoryUsage", peakMemoryUsageNative);
 }
 
 static void freeModuleRegistry() {
@@ -119,14 +169,23 @@ static void freeModuleRegistry() {
 }
 
 void freeVM() {
+#ifdef BASELINE_JIT
+    if (traceStats) printTraceStats();
+#endif
+    if (gcStats) printGCStats();
     freeTable(&vm.globals);
-    freeTable(&vm.strings);
+    FREE_ARRAY(GlobalSlot, vm.globalSlots, vm.globalCapacity);
+    freeStringSet(&vm.strings);
     
     // Free module registry
     freeModuleRegistry();
     
     vm.initString = nullptr;
     freeObjects();
+
+#ifdef GECCO_PROFILE_OPCODES
+    printInstructionProfile();
+#endif
 }
 
 void push(Value value) {
@@ -139,13 +198,51 @@ Value pop() {
     return *vm.stackTop;
 }
 
+/**
+ * Returns the slot of the global [name], giving the name a new undefined slot the
+ * first time it is seen. Compiled code addresses globals only by these indices.
+ */
+int globalSlot(ObjString *name) {
+    Value slot;
+    if (tableGet(&vm.globals, name, &slot)) return (int) AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    if (vm.globalCapacity < vm.globalCount + 1) {
+        int oldCapacity = vm.globalCapacity;
+        vm.globalCapacity = GROW_CAPACITY(oldCapacity);
+        vm.globalSlots = GROW_ARRAY(GlobalSlot, vm.globalSlots, oldCapacity, vm.globalCapacity);
+    }
+    vm.globalSlots[vm.globalCount] = (GlobalSlot){name, UNDEFINED_VAL};
+    tableSet(&vm.globals, name, NUMBER_VAL(vm.globalCount));
+    pop();
+    return vm.globalCount++;
+}
+
+void defineGlobal(ObjString *name, Value value) {
+    push(value);
+    int slot = globalSlot(name);
+    vm.globalSlots[slot].value = value;
+    pop();
+}
+
+bool getGlobal(ObjString *name, Value *value) {
+    Value slot;
+    if (!tableGet(&vm.globals, name, &slot)) return false;
+
+    Value global = vm.globalSlots[(int) AS_NUMBER(slot)].value;
+    if (IS_UNDEFINED(global)) return false;
+    *value = global;
+    return true;
+}
+
 static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
 static bool call(ObjClosure *closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+    ObjFunction *function = FROM_REF(ObjFunction, closure->function);
+    if (argCount != function->arity) {
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
         return false;
     }
 
@@ -154,10 +251,27 @@ static bool call(ObjClosure *closure, int argCount) {
         return false;
     }
 
+    if (vm.memoryExhausted) {
+        outOfMemory();
+        return false;
+    }
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+
+#ifdef GECCO_REGISTER_VM
+    // Register code owns a fixed window of the stack. Clear the registers past
+    // the arguments so the collector never traces stale values left in them.
+    int frameSize = function->frameSize;
+    if (frameSize > 0) {
+        for (Value *slot = vm.stackTop; slot < frame->slots + frameSize; slot++) {
+            *slot = NULL_VAL;
+        }
+        vm.stackTop = frame->slots + frameSize;
+    }
+#endif
     return true;
 }
 
@@ -167,7 +281,7 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
                 vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                return call(FROM_REF(ObjClosure, bound->method), argCount);
             }
 
             case OBJ_CLASS: {
@@ -202,16 +316,54 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+/** Returns the entry [cache] holds for [key], or null on a miss. */
+static inline InlineCacheEntry *probeCache(InlineCache *cache, Obj *key) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].key == key) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+/**
+ * Remembers a lookup result for [key]. A full cache recycles its entries in turn
+ * until the site has missed often enough to be treated as megamorphic.
+ */
+static void updateCache(InlineCache *cache, Obj *key, Obj *target, int slot) {
+    if (cache->megamorphic) return;
+
+    // Caches belong to the running function, which may be old.
+    Obj *owner = (Obj *) FROM_REF(ObjFunction, vm.frames[vm.frameCount - 1].closure->function);
+    writeBarrier(owner, OBJ_VAL(key));
+    if (target != NULL) writeBarrier(owner, OBJ_VAL(target));
+
+    InlineCacheEntry entry = {key, target, slot};
+    if (cache->count < IC_MAX_ENTRIES) {
+        cache->entries[cache->count++] = entry;
+        return;
+    }
+
+    if (++cache->misses == IC_MEGAMORPHIC_MISSES) {
+        cache->megamorphic = true;
+        cache->count = 0;
+        return;
+    }
+    cache->entries[cache->misses % IC_MAX_ENTRIES] = entry;
+}
+
+static bool superInvoke(ObjClass *superclass, ObjString *name, int argCount, InlineCache *cache) {
+    InlineCacheEntry *entry = probeCache(cache, (Obj *) superclass);
+    if (entry != NULL) return call((ObjClosure *) entry->target, argCount);
+
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!tableGet(&superclass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
+    updateCache(cache, (Obj *) superclass, AS_OBJ(method), -1);
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -220,14 +372,34 @@ static bool invoke(ObjString *name, int argCount) {
     }
 
     ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjShape *shape = FROM_REF(ObjShape, instance->shape);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    InlineCacheEntry *entry = probeCache(cache, (Obj *) shape);
+    if (entry != NULL) {
+        if (entry->target != NULL) return call((ObjClosure *) entry->target, argCount);
+        value = instance->fields[entry->slot];
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    int slot = shape == NULL ? -1 : shapeLookup(shape, name);
+    if (slot != -1 || (shape == NULL && getInstanceField(instance, name, &value))) {
+        if (slot != -1) {
+            updateCache(cache, (Obj *) shape, NULL, slot);
+            value = instance->fields[slot];
+        }
+        vm.stackTop[-argCount - 1] = value;
+        return callValue(value, argCount);
+    }
+
+    Value method;
+    if (!tableGet(&FROM_REF(ObjClass, instance->klass)->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    if (shape != NULL) updateCache(cache, (Obj *) shape, AS_OBJ(method), -1);
+    return call(AS_CLOSURE(method), argCount);
 }
 
 static bool bindMethod(ObjClass *klass, ObjString *name) {
@@ -243,12 +415,87 @@ static bool bindMethod(ObjClass *klass, ObjString *name) {
     return true;
 }
 
+/**
+ * Replaces the instance on top of the stack with its property [name]: a field
+ * value, or a method bound to the instance.
+ */
+static bool getProperty(ObjString *name, InlineCache *cache) {
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    ObjShape *shape = FROM_REF(ObjShape, instance->shape);
+
+    Value method;
+    InlineCacheEntry *entry = probeCache(cache, (Obj *) shape);
+    if (entry != NULL && entry->target == NULL) {
+        vm.stackTop[-1] = instance->fields[entry->slot];
+        return true;
+    }
+
+    if (entry != NULL) {
+        method = OBJ_VAL(entry->target);
+    } else if (shape == NULL) {
+        if (getInstanceField(instance, name, &vm.stackTop[-1])) return true;
+        return bindMethod(FROM_REF(ObjClass, instance->klass), name);
+    } else {
+        int slot = shapeLookup(shape, name);
+        if (slot != -1) {
+            updateCache(cache, (Obj *) shape, NULL, slot);
+            vm.stackTop[-1] = instance->fields[slot];
+            return true;
+        }
+
+        if (!tableGet(&FROM_REF(ObjClass, instance->klass)->methods, name, &method)) {
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        updateCache(cache, (Obj *) shape, AS_OBJ(method), -1);
+    }
+
+    ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    pop();
+    push(OBJ_VAL(bound));
+    return true;
+}
+
+/** Stores [value] in field [name] of [instance], caching the slot or the shape transition. */
+static void setProperty(ObjInstance *instance, ObjString *name, Value value, InlineCache *cache) {
+    ObjShape *shape = FROM_REF(ObjShape, instance->shape);
+    int slot = shape == NULL ? -1 : shapeLookup(shape, name);
+    if (slot != -1) {
+        updateCache(cache, (Obj *) shape, NULL, slot);
+        instance->fields[slot] = value;
+        writeBarrier((Obj *) instance, value);
+        return;
+    }
+
+    setInstanceField(instance, name, value);
+    if (shape != NULL && instance->shape != NULL_REF) {
+        updateCache(cache, (Obj *) shape, FROM_REF(Obj, instance->shape), shape->fieldCount);
+    }
+}
+
+/**
+ * Cache hit for a store: writes the slot and, for a cached transition, moves the
+ * instance to the new shape. Fails when the transition needs more field storage.
+ */
+static inline bool setCachedProperty(ObjInstance *instance, InlineCache *cache, Value value) {
+    InlineCacheEntry *entry = probeCache(cache, FROM_REF(Obj, instance->shape));
+    if (entry == NULL || entry->slot >= instance->capacity) return false;
+
+    instance->fields[entry->slot] = value;
+    writeBarrier((Obj *) instance, value);
+    if (entry->target != NULL) {
+        instance->shape = TO_REF(entry->target);
+        writeBarrier((Obj *) instance, OBJ_VAL(entry->target));
+    }
+    return true;
+}
+
 static ObjUpvalue *captureUpvalue(Value *local) {
     ObjUpvalue *prevUpvalue = nullptr;
     ObjUpvalue *upvalue = vm.openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+        upvalue = FROM_REF(ObjUpvalue, upvalue->next);
     }
 
     if (upvalue != NULL && upvalue->location == local) {
@@ -256,12 +503,12 @@ static ObjUpvalue *captureUpvalue(Value *local) {
     }
 
     ObjUpvalue *createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = upvalue;
+    createdUpvalue->next = TO_REF(upvalue);
 
     if (prevUpvalue == NULL) {
         vm.openUpvalues = createdUpvalue;
     } else {
-        prevUpvalue->next = createdUpvalue;
+        prevUpvalue->next = TO_REF(createdUpvalue);
     }
 
     return createdUpvalue;
@@ -272,7 +519,8 @@ static void closeUpvalues(Value *last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        writeBarrier((Obj *) upvalue, upvalue->closed);
+        vm.openUpvalues = FROM_REF(ObjUpvalue, upvalue->next);
     }
 }
 
@@ -280,9 +528,24 @@ static void defineMethod(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrier((Obj *) klass, method);
     pop();
 }
 
+/** Runs a global definition, also exporting it while a module is being imported. */
+static void defineScriptGlobal(ObjString *name, Value value) {
+    defineGlobal(name, value);
+
+    // If we're in importing mode and there's an active export flag,
+    // automatically add this to the current module's exports
+    if (vm.isImporting && vm.isExporting && vm.currentModule != NULL) {
+        Module* module = findModule(vm.currentModule);
+        if (module != NULL) {
+            tableSet(&module->exports, name, value);
+        }
+    }
+}
+
 static bool isFalsey(Value value) {
     return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
@@ -291,385 +554,1646 @@ static void concatenate() {
     ObjString *b = AS_STRING(peek(0));
     ObjString *a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString *result = takeString(chars, length);
+    ObjString *result = makeString(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    result = takeString(result);
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+#ifdef GECCO_REGISTER_VM
+static InterpretResult runRegister();
+#endif
+
+#ifdef BASELINE_JIT
+/** Counts a call or loop back edge of [function]; true once it has native code to run. */
+static inline bool jitReady(ObjFunction *function) {
+    if (function->jit != NULL) return true;
+    if (!jitEnabled || function->hotness < 0 || ++function->hotness < jitThreshold) return false;
+    return jitCompile(function);
+}
+#endif
+
+/**
+ * The interpreter loop. The instruction pointer, stack top, frame slots and
+ * constant table of the running frame live in locals so the C compiler can keep
+ * them in registers. They are written back to the frame and to vm.stackTop only
+ * at sync points: before calls and returns, before anything that can allocate
+ * (and so collect garbage) and before reporting a runtime error.
+ */
 static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#ifdef GECCO_REGISTER_VM
+    if (FROM_REF(ObjFunction, vm.frames[vm.frameCount - 1].closure->function)->frameSize > 0) {
+        return runRegister();
+    }
+#endif
+    // Calls from register or native code run stack code here until that call returns.
+    // Only the outermost run(), at depth 0, may have the heap compacted under it.
+    int exitDepth = vm.frameCount - 1;
+#ifdef BASELINE_JIT
+    if (jitReady(FROM_REF(ObjFunction, vm.frames[vm.frameCount - 1].closure->function))) {
+        return jitEnter(&vm.frames[vm.frameCount - 1]);
+    }
+#endif
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *sp = vm.stackTop;
+    Value *slots;
+    Value *constants;
+    uint8_t instruction;
+
+#define STORE_FRAME() \
+    do { \
+      frame->ip = ip; \
+      vm.stackTop = sp; \
+    } while (false)
+#define LOAD_FRAME() \
+    do { \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      ip = frame->ip; \
+      slots = frame->slots; \
+      constants = FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values; \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(__VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#ifdef BASELINE_JIT
+// Runs a callee that has (or now earns) native code to completion in the JIT.
+#define ENTER_NATIVE() \
+    do { \
+      CallFrame *callee = &vm.frames[vm.frameCount - 1]; \
+      if (callee != frame && jitReady(FROM_REF(ObjFunction, callee->closure->function))) { \
+        InterpretResult result = jitEnter(callee); \
+        if (result != INTERPRET_OK) return result; \
+      } \
+    } while (false)
+#else
+#define ENTER_NATIVE() do { } while (false)
+#endif
+#ifdef GECCO_REGISTER_VM
+// Resumes after a call, first running the callee to completion if it is register code.
+#define ENTER_FRAME() \
+    do { \
+      ENTER_NATIVE(); \
+      if (FROM_REF(ObjFunction, vm.frames[vm.frameCount - 1].closure->function)->frameSize > 0) { \
+        InterpretResult result = runRegister(); \
+        if (result != INTERPRET_OK) return result; \
+      } \
+      sp = vm.stackTop; \
+      LOAD_FRAME(); \
+    } while (false)
+#else
+#define ENTER_FRAME() \
+    do { \
+      ENTER_NATIVE(); \
+      sp = vm.stackTop; \
+      LOAD_FRAME(); \
+    } while (false)
+#endif
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&FROM_REF(ObjFunction, frame->closure->function)->chunk.caches[READ_SHORT()])
 #define BINARY_OP(valueType, op) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(PEEK(0)); \
+      PEEK(0) = valueType(a op b); \
+    } while (false)
+// >= and <= are evaluated as !(a < b) and !(a > b), as the OP_NOT pairs they replace were.
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+#define ADD_VALUES() \
+    do { \
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) { \
+        STORE_FRAME(); \
+        concatenate(); \
+        sp = vm.stackTop; \
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) { \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(PEEK(0)); \
+        PEEK(0) = NUMBER_VAL(a + b); \
+      } else { \
+        RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+      } \
+    } while (false)
+// Rewrites the instruction being executed; only valid before its operands are read.
+#define QUICKEN(instruction) (ip[-1] = (instruction))
+// One branch for the guard of a quickened number instruction.
+#define BOTH_NUMBERS(a, b) (IS_NUMBER(a) & IS_NUMBER(b))
+// Fused compare-and-branch: pops both operands and jumps when test is false.
+#define COMPARE_JUMP(test) \
+    do { \
+      uint16_t offset = READ_SHORT(); \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      if (!(test)) ip += offset; \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = vm.stack; slot < sp; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction(&FROM_REF(ObjFunction, frame->closure->function)->chunk, \
+          (int)(ip - FROM_REF(ObjFunction, frame->closure->function)->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-
-            case OP_NULL: push(NULL_VAL);
-                break;
-            case OP_TRUE: push(BOOL_VAL(true));
-                break;
-            case OP_FALSE: push(BOOL_VAL(false));
-                break;
-            case OP_POP: pop();
-                break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                
-                // First check in globals
-                if (tableGet(&vm.globals, name, &value)) {
-                    push(value);
-                    break;
-                }
-                
-                // If not found in globals, check in all module exports using our helper function
-                if (findExportedSymbol(name, &value)) {
-                    push(value);
-                    break;
-                }
-                
-                // Not found anywhere
-                runtimeError("Undefined variable '%s'.", name->chars);
+#ifdef GECCO_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // One indirect jump per handler instead of a single shared one in the switch,
+    // so the branch predictor can learn which opcode tends to follow which.
+    static void *dispatchTable[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_NULL] = &&op_OP_NULL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL_SLOT] = &&op_OP_GET_GLOBAL_SLOT,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL_SLOT] = &&op_OP_SET_GLOBAL_SLOT,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+        [OP_ADD_LOCAL_CONSTANT] = &&op_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_MOD] = &&op_OP_MOD,
+        [OP_POW] = &&op_OP_POW,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_EQUAL] = &&op_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_NOT_EQUAL] = &&op_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&op_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&op_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_INVOKE] = &&op_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_CLASS] = &&op_OP_CLASS,
+        [OP_INHERIT] = &&op_OP_INHERIT,
+        [OP_METHOD] = &&op_OP_METHOD,
+        [OP_POINT_RIGHT] = &&op_OP_POINT_RIGHT,
+        [OP_POINT_LEFT] = &&op_OP_POINT_LEFT,
+        [OP_TYPE] = &&op_OP_TYPE,
+        [OP_COLON] = &&op_OP_COLON,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_EQUAL_NUM] = &&op_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM] = &&op_OP_NOT_EQUAL_NUM,
+        [OP_JUMP_IF_EQUAL_NUM] = &&op_OP_JUMP_IF_EQUAL_NUM,
+        [OP_JUMP_IF_NOT_EQUAL_NUM] = &&op_OP_JUMP_IF_NOT_EQUAL_NUM,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(code) op_##code
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      switch (instruction = READ_BYTE())
+#define CASE(code) case code
+#define DISPATCH() goto loop
+#endif
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+        }
+
+        CASE(OP_NULL): PUSH(NULL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP): sp--;
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_GLOBAL_SLOT): {
+            GlobalSlot *global = &vm.globalSlots[READ_SHORT()];
+            if (!IS_UNDEFINED(global->value)) {
+                PUSH(global->value);
+                DISPATCH();
+            }
+
+            // Names no script defined may still be exported by a loaded module.
+            Value value;
+            if (findExportedSymbol(global->name, &value)) {
+                PUSH(value);
+                DISPATCH();
+            }
+
+            // Not found anywhere
+            RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+        }
+
+        CASE(OP_DEFINE_GLOBAL): {
+            ObjString *name = READ_STRING();
+            Value value = PEEK(0);
+            STORE_FRAME();
+            defineScriptGlobal(name, value);
+            sp--;
+            DISPATCH();
+        }
+
+        CASE(OP_SET_GLOBAL_SLOT): {
+            GlobalSlot *global = &vm.globalSlots[READ_SHORT()];
+            if (IS_UNDEFINED(global->value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+            }
+            global->value = PEEK(0);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*FROM_REF(ObjUpvalue, frame->closure->upvalues[slot])->location);
+            DISPATCH();
+        }
+
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue *upvalue = FROM_REF(ObjUpvalue, frame->closure->upvalues[READ_BYTE()]);
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj *) upvalue, PEEK(0));
+            DISPATCH();
+        }
+
+        CASE(OP_GET_PROPERTY): {
+            //> get-not-instance
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+
+            ObjInstance *instance = AS_INSTANCE(PEEK(0));
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+
+            InlineCacheEntry *entry = probeCache(cache, FROM_REF(Obj, instance->shape));
+            if (entry != NULL && entry->target == NULL) {
+                PEEK(0) = instance->fields[entry->slot];
+                DISPATCH();
+            }
+
+            STORE_FRAME();
+            if (!getProperty(name, cache)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
+        }
 
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value = peek(0);
-                tableSet(&vm.globals, name, value);
-                
-                // If we're in importing mode and there's an active export flag,
-                // automatically add this to the current module's exports
-                if (vm.isImporting && vm.isExporting && vm.currentModule != NULL) {
-                    Module* module = findModule(vm.currentModule);
-                    if (module != NULL) {
-                        tableSet(&module->exports, name, value);
-                    }
-                }
-                
-                pop();
-                break;
+        CASE(OP_SET_PROPERTY): {
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
 
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name); // [delete]
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            if (!setCachedProperty(instance, cache, PEEK(0))) {
+                STORE_FRAME();
+                setProperty(instance, name, PEEK(0), cache);
             }
+            Value value = POP();
+            PEEK(0) = value;
+            DISPATCH();
+        }
+
+        CASE(OP_GET_SUPER): {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(POP());
 
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            STORE_FRAME();
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
+        }
 
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+        CASE(OP_EQUAL): {
+            Value b = POP();
+            Value a = PEEK(0);
+            if (BOTH_NUMBERS(a, b)) QUICKEN(OP_EQUAL_NUM);
+            PEEK(0) = BOOL_VAL(valuesEqual(a, b));
+            DISPATCH();
+        }
+
+        CASE(OP_EQUAL_NUM): {
+            Value b = POP();
+            Value a = PEEK(0);
+            if (!BOTH_NUMBERS(a, b)) {
+                QUICKEN(OP_EQUAL);
+                PEEK(0) = BOOL_VAL(valuesEqual(a, b));
+                DISPATCH();
             }
+            PEEK(0) = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+            DISPATCH();
+        }
 
-            case OP_GET_PROPERTY: {
-                //> get-not-instance
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(OP_NOT_EQUAL): {
+            Value b = POP();
+            Value a = PEEK(0);
+            if (BOTH_NUMBERS(a, b)) QUICKEN(OP_NOT_EQUAL_NUM);
+            PEEK(0) = BOOL_VAL(!valuesEqual(a, b));
+            DISPATCH();
+        }
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
+        CASE(OP_NOT_EQUAL_NUM): {
+            Value b = POP();
+            Value a = PEEK(0);
+            if (!BOTH_NUMBERS(a, b)) {
+                QUICKEN(OP_NOT_EQUAL);
+                PEEK(0) = BOOL_VAL(!valuesEqual(a, b));
+                DISPATCH();
+            }
+            PEEK(0) = BOOL_VAL(AS_NUMBER(a) != AS_NUMBER(b));
+            DISPATCH();
+        }
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL): BINARY_OP(NOT_BOOL_VAL, >);
+            DISPATCH();
+
+        CASE(OP_ADD):
+            if (BOTH_NUMBERS(PEEK(0), PEEK(1))) {
+                QUICKEN(OP_ADD_NUM);
+            } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                QUICKEN(OP_ADD_STR);
+            }
+            ADD_VALUES();
+            DISPATCH();
+
+        CASE(OP_ADD_NUM): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            if (!BOTH_NUMBERS(a, b)) {
+                QUICKEN(OP_ADD);
+                ADD_VALUES();
+                DISPATCH();
+            }
+            sp--;
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            DISPATCH();
+        }
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+        CASE(OP_ADD_STR):
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                QUICKEN(OP_ADD);
+                ADD_VALUES();
+                DISPATCH();
             }
+            STORE_FRAME();
+            concatenate();
+            sp = vm.stackTop;
+            DISPATCH();
+
+        CASE(OP_ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            PUSH(a);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                PEEK(0) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else {
+                PUSH(b);
+                ADD_VALUES();
+            }
+            DISPATCH();
+        }
 
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            Value *local = &slots[READ_BYTE()];
+            Value constant = READ_CONSTANT();
+            if (IS_NUMBER(*local) && IS_NUMBER(constant)) {
+                *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(constant));
+                PUSH(*local);
+            } else {
+                PUSH(*local);
+                PUSH(constant);
+                ADD_VALUES();
+                *local = PEEK(0);
+            }
+            DISPATCH();
+        }
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        CASE(OP_MOD):
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(PEEK(0));
+                PEEK(0) = NUMBER_VAL(modulo(a, b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers.");
+            }
+            DISPATCH();
+        CASE(OP_POW):
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                int b = AS_NUMBER(POP());
+                float a = AS_NUMBER(PEEK(0));
+                PEEK(0) = NUMBER_VAL(power(a, b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers.");
             }
+            DISPATCH();
 
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
 
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+
+        CASE(OP_PRINT): {
+            // When importing a module, we should suppress print statements
+            // This allows modules to contain debug/example prints without affecting importing code
+            if (vm.isImporting) {
+                sp--; // Just pop the value without printing
+            } else {
+                printValue(POP());
+                printf("\n");
             }
+            DISPATCH();
+        }
 
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_EQUAL): {
+            if (BOTH_NUMBERS(PEEK(0), PEEK(1))) QUICKEN(OP_JUMP_IF_EQUAL_NUM);
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_EQUAL_NUM): {
+            if (!BOTH_NUMBERS(PEEK(0), PEEK(1))) {
+                QUICKEN(OP_JUMP_IF_EQUAL);
+                uint16_t offset = READ_SHORT();
+                Value b = POP();
+                Value a = POP();
+                if (valuesEqual(a, b)) ip += offset;
+                DISPATCH();
             }
+            uint16_t offset = READ_SHORT();
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            if (a == b) ip += offset;
+            DISPATCH();
+        }
 
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <);
-                break;
+        CASE(OP_JUMP_IF_NOT_EQUAL): {
+            if (BOTH_NUMBERS(PEEK(0), PEEK(1))) QUICKEN(OP_JUMP_IF_NOT_EQUAL_NUM);
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (!valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
 
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_MOD:
-                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(modulo(a, b)));
-                } else {
-                    runtimeError("Operands must be two numbers.");
-                    return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_JUMP_IF_NOT_EQUAL_NUM): {
+            if (!BOTH_NUMBERS(PEEK(0), PEEK(1))) {
+                QUICKEN(OP_JUMP_IF_NOT_EQUAL);
+                uint16_t offset = READ_SHORT();
+                Value b = POP();
+                Value a = POP();
+                if (!valuesEqual(a, b)) ip += offset;
+                DISPATCH();
+            }
+            uint16_t offset = READ_SHORT();
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            if (a != b) ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(a > b);
+            DISPATCH();
+        CASE(OP_JUMP_IF_NOT_GREATER_EQUAL): COMPARE_JUMP(!(a < b));
+            DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(a < b);
+            DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS_EQUAL): COMPARE_JUMP(!(a > b));
+            DISPATCH();
+
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            if (vm.memoryExhausted) {
+                STORE_FRAME();
+                outOfMemory();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ip -= offset;
+            if (vm.compactDue && exitDepth == 0) {
+                STORE_FRAME();
+                compactHeap();
+            }
+#ifdef BASELINE_JIT
+            if (traceEnabled) {
+                STORE_FRAME();
+                LoopAction action = traceLoop(frame);
+                if (action == LOOP_RESUME) {
+                    sp = vm.stackTop;
+                    ip = frame->ip;
+                    DISPATCH();
                 }
-                break;
-            case OP_POW:
-                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    int b = AS_NUMBER(pop());
-                    float a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(power(a, b)));
-                } else {
-                    runtimeError("Operands must be two numbers.");
-                    return INTERPRET_RUNTIME_ERROR;
+                if (action == LOOP_INTERPRET) DISPATCH();
+            }
+            // On-stack replacement: a loop that turns hot finishes the frame natively.
+            if (jitReady(FROM_REF(ObjFunction, frame->closure->function))) {
+                STORE_FRAME();
+                InterpretResult result = jitEnter(frame);
+                if (result != INTERPRET_OK || vm.frameCount == 0 || vm.frameCount == exitDepth) {
+                    return result;
                 }
-                break;
+                sp = vm.stackTop;
+                LOAD_FRAME();
+            }
+#endif
+            DISPATCH();
+        }
 
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
 
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-
-            case OP_PRINT: {
-                // When importing a module, we should suppress print statements
-                // This allows modules to contain debug/example prints without affecting importing code
-                if (vm.isImporting) {
-                    pop(); // Just pop the value without printing
+        CASE(OP_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+
+        CASE(OP_SUPER_INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            ObjClass *superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!superInvoke(superclass, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+
+        CASE(OP_CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure *closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            vm.stackTop = sp;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = TO_REF(captureUpvalue(slots + index));
                 } else {
-                    printValue(pop());
-                    printf("\n");
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
+                writeBarrier((Obj *) closure, OBJ_VAL(FROM_REF(Obj, closure->upvalues[i])));
             }
+            DISPATCH();
+        }
 
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(sp - 1);
+            sp--;
+            DISPATCH();
+
+        CASE(OP_RETURN): {
+            Value result = POP();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0) {
+                vm.stackTop = sp - 1;
+                return INTERPRET_OK;
             }
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
+            sp = slots;
+            PUSH(result);
+#if defined(GECCO_REGISTER_VM) || defined(BASELINE_JIT)
+            if (vm.frameCount == exitDepth) {
+                vm.stackTop = sp;
+                return INTERPRET_OK;
+            }
+#endif
+            LOAD_FRAME();
+            DISPATCH();
+        }
 
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+        CASE(OP_TYPE): {
+            DISPATCH();
+        }
+
+        CASE(OP_COLON): {
+            DISPATCH();
+        }
+
+        CASE(OP_CLASS): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
 
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            ObjClass *subclass = AS_CLASS(PEEK(0));
+            STORE_FRAME();
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            rememberObject((Obj *) subclass);
+            sp--; // Subclass.
+            DISPATCH();
+        }
+
+        CASE(OP_METHOD): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(name);
+            sp--;
+            DISPATCH();
+        }
+
+        CASE(OP_POINT_RIGHT):
+        CASE(OP_POINT_LEFT):
+            DISPATCH();
+    }
+
+    // Only reachable from the switch when it meets a byte outside OpCode.
+    DISPATCH();
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef ENTER_FRAME
+#undef ENTER_NATIVE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef ADD_VALUES
+#undef QUICKEN
+#undef BOTH_NUMBERS
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+#ifdef GECCO_REGISTER_VM
+/**
+ * The interpreter loop for register code. Operands name frame registers, so
+ * there is no stack pointer to track: vm.stackTop stays at the top of the
+ * running frame's registers and helpers that work on the stack push above it.
+ * Runs until the frame it was entered for returns; calls into stack code run a
+ * nested run() the same way.
+ */
+static InterpretResult runRegister() {
+    int exitDepth = vm.frameCount - 1;
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    uint8_t instruction;
+
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+    do { \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      ip = frame->ip; \
+      slots = frame->slots; \
+      constants = FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values; \
+      vm.stackTop = slots + FROM_REF(ObjFunction, frame->closure->function)->frameSize; \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(__VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+// Resumes after a call, first running the callee to completion if it is stack code.
+#define ENTER_FRAME() \
+    do { \
+      if (FROM_REF(ObjFunction, vm.frames[vm.frameCount - 1].closure->function)->frameSize == 0) { \
+        InterpretResult result = run(); \
+        if (result != INTERPRET_OK) return result; \
+      } \
+      LOAD_FRAME(); \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_REGISTER() (slots[READ_BYTE()])
+#define READ_CACHE() (&FROM_REF(ObjFunction, frame->closure->function)->chunk.caches[READ_SHORT()])
+#define BINARY_OP(valueType, op, readRight) \
+    do { \
+      uint8_t target = READ_BYTE(); \
+      Value left = READ_REGISTER(); \
+      Value right = readRight(); \
+      if (!IS_NUMBER(left) || !IS_NUMBER(right)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      double a = AS_NUMBER(left); \
+      double b = AS_NUMBER(right); \
+      slots[target] = valueType(a op b); \
+    } while (false)
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+#define ADD_VALUES(readRight) \
+    do { \
+      uint8_t target = READ_BYTE(); \
+      Value left = READ_REGISTER(); \
+      Value right = readRight(); \
+      if (IS_NUMBER(left) && IS_NUMBER(right)) { \
+        slots[target] = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)); \
+      } else if (IS_STRING(left) && IS_STRING(right)) { \
+        STORE_FRAME(); \
+        push(left); \
+        push(right); \
+        concatenate(); \
+        slots[target] = pop(); \
+      } else { \
+        RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+      } \
+    } while (false)
+#define MOD_VALUES(readRight) \
+    do { \
+      uint8_t target = READ_BYTE(); \
+      Value left = READ_REGISTER(); \
+      Value right = readRight(); \
+      if (!IS_NUMBER(left) || !IS_NUMBER(right)) { \
+        RUNTIME_ERROR("Operands must be two numbers."); \
+      } \
+      slots[target] = NUMBER_VAL(modulo(AS_NUMBER(left), AS_NUMBER(right))); \
+    } while (false)
+// Compare-and-branch: jumps when test is false.
+#define COMPARE_JUMP(test, readRight) \
+    do { \
+      Value left = READ_REGISTER(); \
+      Value right = readRight(); \
+      uint16_t offset = READ_SHORT(); \
+      if (!IS_NUMBER(left) || !IS_NUMBER(right)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      double a = AS_NUMBER(left); \
+      double b = AS_NUMBER(right); \
+      if (!(test)) ip += offset; \
+    } while (false)
+#define EQUAL_JUMP(equal, readRight) \
+    do { \
+      Value left = READ_REGISTER(); \
+      Value right = readRight(); \
+      uint16_t offset = READ_SHORT(); \
+      if (valuesEqual(left, right) == (equal)) ip += offset; \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = slots; slot < vm.stackTop; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction(&FROM_REF(ObjFunction, frame->closure->function)->chunk, \
+          (int)(ip - FROM_REF(ObjFunction, frame->closure->function)->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef GECCO_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void *dispatchTable[] = {
+        [ROP_MOVE] = &&op_ROP_MOVE,
+        [ROP_LOADK] = &&op_ROP_LOADK,
+        [ROP_NULL] = &&op_ROP_NULL,
+        [ROP_TRUE] = &&op_ROP_TRUE,
+        [ROP_FALSE] = &&op_ROP_FALSE,
+        [ROP_GET_GLOBAL_SLOT] = &&op_ROP_GET_GLOBAL_SLOT,
+        [ROP_DEFINE_GLOBAL] = &&op_ROP_DEFINE_GLOBAL,
+        [ROP_SET_GLOBAL_SLOT] = &&op_ROP_SET_GLOBAL_SLOT,
+        [ROP_GET_UPVALUE] = &&op_ROP_GET_UPVALUE,
+        [ROP_SET_UPVALUE] = &&op_ROP_SET_UPVALUE,
+        [ROP_GET_PROPERTY] = &&op_ROP_GET_PROPERTY,
+        [ROP_SET_PROPERTY] = &&op_ROP_SET_PROPERTY,
+        [ROP_GET_SUPER] = &&op_ROP_GET_SUPER,
+        [ROP_EQUAL] = &&op_ROP_EQUAL,
+        [ROP_NOT_EQUAL] = &&op_ROP_NOT_EQUAL,
+        [ROP_GREATER] = &&op_ROP_GREATER,
+        [ROP_GREATER_EQUAL] = &&op_ROP_GREATER_EQUAL,
+        [ROP_LESS] = &&op_ROP_LESS,
+        [ROP_LESS_EQUAL] = &&op_ROP_LESS_EQUAL,
+        [ROP_ADD] = &&op_ROP_ADD,
+        [ROP_SUBTRACT] = &&op_ROP_SUBTRACT,
+        [ROP_MULTIPLY] = &&op_ROP_MULTIPLY,
+        [ROP_DIVIDE] = &&op_ROP_DIVIDE,
+        [ROP_MOD] = &&op_ROP_MOD,
+        [ROP_POW] = &&op_ROP_POW,
+        [ROP_ADDK] = &&op_ROP_ADDK,
+        [ROP_SUBTRACTK] = &&op_ROP_SUBTRACTK,
+        [ROP_MULTIPLYK] = &&op_ROP_MULTIPLYK,
+        [ROP_DIVIDEK] = &&op_ROP_DIVIDEK,
+        [ROP_MODK] = &&op_ROP_MODK,
+        [ROP_NOT] = &&op_ROP_NOT,
+        [ROP_NEGATE] = &&op_ROP_NEGATE,
+        [ROP_PRINT] = &&op_ROP_PRINT,
+        [ROP_JUMP] = &&op_ROP_JUMP,
+        [ROP_JUMP_IF_FALSE] = &&op_ROP_JUMP_IF_FALSE,
+        [ROP_JUMP_IF_EQUAL] = &&op_ROP_JUMP_IF_EQUAL,
+        [ROP_JUMP_IF_NOT_EQUAL] = &&op_ROP_JUMP_IF_NOT_EQUAL,
+        [ROP_JUMP_IF_NOT_GREATER] = &&op_ROP_JUMP_IF_NOT_GREATER,
+        [ROP_JUMP_IF_NOT_GREATER_EQUAL] = &&op_ROP_JUMP_IF_NOT_GREATER_EQUAL,
+        [ROP_JUMP_IF_NOT_LESS] = &&op_ROP_JUMP_IF_NOT_LESS,
+        [ROP_JUMP_IF_NOT_LESS_EQUAL] = &&op_ROP_JUMP_IF_NOT_LESS_EQUAL,
+        [ROP_JUMP_IF_EQUALK] = &&op_ROP_JUMP_IF_EQUALK,
+        [ROP_JUMP_IF_NOT_EQUALK] = &&op_ROP_JUMP_IF_NOT_EQUALK,
+        [ROP_JUMP_IF_NOT_GREATERK] = &&op_ROP_JUMP_IF_NOT_GREATERK,
+        [ROP_JUMP_IF_NOT_GREATER_EQUALK] = &&op_ROP_JUMP_IF_NOT_GREATER_EQUALK,
+        [ROP_JUMP_IF_NOT_LESSK] = &&op_ROP_JUMP_IF_NOT_LESSK,
+        [ROP_JUMP_IF_NOT_LESS_EQUALK] = &&op_ROP_JUMP_IF_NOT_LESS_EQUALK,
+        [ROP_LOOP] = &&op_ROP_LOOP,
+        [ROP_CALL] = &&op_ROP_CALL,
+        [ROP_INVOKE] = &&op_ROP_INVOKE,
+        [ROP_SUPER_INVOKE] = &&op_ROP_SUPER_INVOKE,
+        [ROP_CLOSURE] = &&op_ROP_CLOSURE,
+        [ROP_CLOSE_UPVALUE] = &&op_ROP_CLOSE_UPVALUE,
+        [ROP_RETURN] = &&op_ROP_RETURN,
+        [ROP_CLASS] = &&op_ROP_CLASS,
+        [ROP_INHERIT] = &&op_ROP_INHERIT,
+        [ROP_METHOD] = &&op_ROP_METHOD,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(code) op_##code
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      switch (instruction = READ_BYTE())
+#define CASE(code) case code
+#define DISPATCH() goto loop
+#endif
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(ROP_MOVE): {
+            uint8_t target = READ_BYTE();
+            slots[target] = READ_REGISTER();
+            DISPATCH();
+        }
+
+        CASE(ROP_LOADK): {
+            uint8_t target = READ_BYTE();
+            slots[target] = READ_CONSTANT();
+            DISPATCH();
+        }
+
+        CASE(ROP_NULL): READ_REGISTER() = NULL_VAL;
+            DISPATCH();
+        CASE(ROP_TRUE): READ_REGISTER() = BOOL_VAL(true);
+            DISPATCH();
+        CASE(ROP_FALSE): READ_REGISTER() = BOOL_VAL(false);
+            DISPATCH();
+
+        CASE(ROP_GET_GLOBAL_SLOT): {
+            uint8_t target = READ_BYTE();
+            GlobalSlot *global = &vm.globalSlots[READ_SHORT()];
+            Value value = global->value;
+            if (IS_UNDEFINED(value) && !findExportedSymbol(global->name, &value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
             }
+            slots[target] = value;
+            DISPATCH();
+        }
 
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(ROP_DEFINE_GLOBAL): {
+            Value value = READ_REGISTER();
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            defineScriptGlobal(name, value);
+            DISPATCH();
+        }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+        CASE(ROP_SET_GLOBAL_SLOT): {
+            Value value = READ_REGISTER();
+            GlobalSlot *global = &vm.globalSlots[READ_SHORT()];
+            if (IS_UNDEFINED(global->value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
             }
+            global->value = value;
+            DISPATCH();
+        }
 
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+        CASE(ROP_GET_UPVALUE): {
+            uint8_t target = READ_BYTE();
+            slots[target] = *FROM_REF(ObjUpvalue, frame->closure->upvalues[READ_BYTE()])->location;
+            DISPATCH();
+        }
+
+        CASE(ROP_SET_UPVALUE): {
+            Value value = READ_REGISTER();
+            ObjUpvalue *upvalue = FROM_REF(ObjUpvalue, frame->closure->upvalues[READ_BYTE()]);
+            *upvalue->location = value;
+            writeBarrier((Obj *) upvalue, value);
+            DISPATCH();
+        }
+
+        CASE(ROP_GET_PROPERTY): {
+            uint8_t target = READ_BYTE();
+            Value receiver = READ_REGISTER();
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            if (!IS_INSTANCE(receiver)) {
+                RUNTIME_ERROR("Only instances have properties.");
             }
 
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            ObjInstance *instance = AS_INSTANCE(receiver);
+            InlineCacheEntry *entry = probeCache(cache, FROM_REF(Obj, instance->shape));
+            if (entry != NULL && entry->target == NULL) {
+                slots[target] = instance->fields[entry->slot];
+                DISPATCH();
             }
 
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            STORE_FRAME();
+            push(receiver);
+            if (!getProperty(name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[target] = pop();
+            DISPATCH();
+        }
 
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
+        CASE(ROP_SET_PROPERTY): {
+            Value receiver = READ_REGISTER();
+            ObjString *name = READ_STRING();
+            Value value = READ_REGISTER();
+            InlineCache *cache = READ_CACHE();
+            if (!IS_INSTANCE(receiver)) {
+                RUNTIME_ERROR("Only instances have fields.");
+            }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            ObjInstance *instance = AS_INSTANCE(receiver);
+            if (!setCachedProperty(instance, cache, value)) {
+                STORE_FRAME();
+                setProperty(instance, name, value, cache);
             }
+            DISPATCH();
+        }
 
-            case OP_TYPE: {
-                break;
+        CASE(ROP_GET_SUPER): {
+            uint8_t target = READ_BYTE();
+            Value receiver = READ_REGISTER();
+            ObjClass *superclass = AS_CLASS(READ_REGISTER());
+            ObjString *name = READ_STRING();
+
+            STORE_FRAME();
+            push(receiver);
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            slots[target] = pop();
+            DISPATCH();
+        }
 
-            case OP_COLON: {
-                break;
+        CASE(ROP_EQUAL): {
+            uint8_t target = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            slots[target] = BOOL_VAL(valuesEqual(a, b));
+            DISPATCH();
+        }
+
+        CASE(ROP_NOT_EQUAL): {
+            uint8_t target = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            slots[target] = BOOL_VAL(!valuesEqual(a, b));
+            DISPATCH();
+        }
+
+        CASE(ROP_GREATER): BINARY_OP(BOOL_VAL, >, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_LESS): BINARY_OP(BOOL_VAL, <, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_LESS_EQUAL): BINARY_OP(NOT_BOOL_VAL, >, READ_REGISTER);
+            DISPATCH();
+
+        CASE(ROP_ADD): ADD_VALUES(READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_DIVIDE): BINARY_OP(NUMBER_VAL, /, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_MOD): MOD_VALUES(READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_POW): {
+            uint8_t target = READ_BYTE();
+            Value left = READ_REGISTER();
+            Value right = READ_REGISTER();
+            if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+                RUNTIME_ERROR("Operands must be two numbers.");
             }
+            int b = AS_NUMBER(right);
+            float a = AS_NUMBER(left);
+            slots[target] = NUMBER_VAL(power(a, b));
+            DISPATCH();
+        }
 
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
+        CASE(ROP_ADDK): ADD_VALUES(READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_SUBTRACTK): BINARY_OP(NUMBER_VAL, -, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_MULTIPLYK): BINARY_OP(NUMBER_VAL, *, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_DIVIDEK): BINARY_OP(NUMBER_VAL, /, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_MODK): MOD_VALUES(READ_CONSTANT);
+            DISPATCH();
+
+        CASE(ROP_NOT): {
+            uint8_t target = READ_BYTE();
+            slots[target] = BOOL_VAL(isFalsey(READ_REGISTER()));
+            DISPATCH();
+        }
 
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+        CASE(ROP_NEGATE): {
+            uint8_t target = READ_BYTE();
+            Value value = READ_REGISTER();
+            if (!IS_NUMBER(value)) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            slots[target] = NUMBER_VAL(-AS_NUMBER(value));
+            DISPATCH();
+        }
+
+        CASE(ROP_PRINT): {
+            Value value = READ_REGISTER();
+            // Imported modules run their top level without printing.
+            if (!vm.isImporting) {
+                printValue(value);
+                printf("\n");
+            }
+            DISPATCH();
+        }
+
+        CASE(ROP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+
+        CASE(ROP_JUMP_IF_FALSE): {
+            Value condition = READ_REGISTER();
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(condition)) ip += offset;
+            DISPATCH();
+        }
+
+        CASE(ROP_JUMP_IF_EQUAL): EQUAL_JUMP(true, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_EQUAL): EQUAL_JUMP(false, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(a > b, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_GREATER_EQUAL): COMPARE_JUMP(!(a < b), READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_LESS): COMPARE_JUMP(a < b, READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_LESS_EQUAL): COMPARE_JUMP(!(a > b), READ_REGISTER);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_EQUALK): EQUAL_JUMP(true, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_EQUALK): EQUAL_JUMP(false, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_GREATERK): COMPARE_JUMP(a > b, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_GREATER_EQUALK): COMPARE_JUMP(!(a < b), READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_LESSK): COMPARE_JUMP(a < b, READ_CONSTANT);
+            DISPATCH();
+        CASE(ROP_JUMP_IF_NOT_LESS_EQUALK): COMPARE_JUMP(!(a > b), READ_CONSTANT);
+            DISPATCH();
+
+        CASE(ROP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            if (vm.memoryExhausted) {
+                STORE_FRAME();
+                outOfMemory();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ip -= offset;
+            if (vm.compactDue && exitDepth == 0) {
+                STORE_FRAME();
+                compactHeap();
+            }
+            DISPATCH();
+        }
+
+        CASE(ROP_CALL): {
+            Value *base = &READ_REGISTER();
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            vm.stackTop = base + argCount + 1;
+            if (!callValue(*base, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+
+        CASE(ROP_INVOKE): {
+            Value *base = &READ_REGISTER();
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            STORE_FRAME();
+            vm.stackTop = base + argCount + 1;
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+
+        CASE(ROP_SUPER_INVOKE): {
+            Value *base = &READ_REGISTER();
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            ObjClass *superclass = AS_CLASS(base[argCount + 1]);
+            STORE_FRAME();
+            vm.stackTop = base + argCount + 1;
+            if (!superInvoke(superclass, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+
+        CASE(ROP_CLOSURE): {
+            uint8_t target = READ_BYTE();
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure *closure = newClosure(function);
+            slots[target] = OBJ_VAL(closure);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = TO_REF(captureUpvalue(slots + index));
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+                writeBarrier((Obj *) closure, OBJ_VAL(FROM_REF(Obj, closure->upvalues[i])));
+            }
+            DISPATCH();
+        }
+
+        CASE(ROP_CLOSE_UPVALUE):
+            closeUpvalues(&READ_REGISTER());
+            DISPATCH();
+
+        CASE(ROP_RETURN): {
+            Value result = READ_REGISTER();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0) {
+                vm.stackTop = slots;
+                return INTERPRET_OK;
+            }
+
+            // The callee's slot zero is where the caller expects the result.
+            *slots = result;
+            vm.stackTop = slots + 1;
+            if (vm.frameCount == exitDepth) {
+                return INTERPRET_OK;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE(ROP_CLASS): {
+            uint8_t target = READ_BYTE();
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            slots[target] = OBJ_VAL(newClass(name));
+            DISPATCH();
+        }
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+        CASE(ROP_INHERIT): {
+            Value superclass = READ_REGISTER();
+            ObjClass *subclass = AS_CLASS(READ_REGISTER());
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
 
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            STORE_FRAME();
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            rememberObject((Obj *) subclass);
+            DISPATCH();
+        }
+
+        CASE(ROP_METHOD): {
+            ObjClass *klass = AS_CLASS(READ_REGISTER());
+            ObjString *name = READ_STRING();
+            Value method = READ_REGISTER();
+            STORE_FRAME();
+            tableSet(&klass->methods, name, method);
+            writeBarrier((Obj *) klass, method);
+            DISPATCH();
         }
     }
 
+    // Only reachable from the switch when it meets a byte outside RegisterOpCode.
+    DISPATCH();
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef ENTER_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef READ_REGISTER
 #undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef ADD_VALUES
+#undef MOD_VALUES
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+#endif
+
+#ifdef BASELINE_JIT
+/*
+ * Entry points for native code. The calling frame is the one on top of vm.frames,
+ * and vm.stackTop is its stack top. Each helper mirrors its instruction in run().
+ */
+
+bool jitError(const char *message) {
+    runtimeError("%s", message);
+    return false;
+}
+
+bool jitOutOfMemory() {
+    outOfMemory();
+    return false;
+}
+
+bool jitGetGlobal(int slot) {
+    GlobalSlot *global = &vm.globalSlots[slot];
+    Value value = global->value;
+    if (IS_UNDEFINED(value) && !findExportedSymbol(global->name, &value)) {
+        runtimeError("Undefined variable '%s'.", global->name->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+bool jitSetGlobal(int slot) {
+    GlobalSlot *global = &vm.globalSlots[slot];
+    if (IS_UNDEFINED(global->value)) {
+        runtimeError("Undefined variable '%s'.", global->name->chars);
+        return false;
+    }
+    global->value = peek(0);
+    return true;
+}
+
+bool jitSetUpvalue(int slot) {
+    ObjUpvalue *upvalue = FROM_REF(ObjUpvalue, vm.frames[vm.frameCount - 1].closure->upvalues[slot]);
+    *upvalue->location = peek(0);
+    writeBarrier((Obj *) upvalue, peek(0));
+    return true;
+}
+
+bool jitDefineGlobal(ObjString *name) {
+    defineScriptGlobal(name, peek(0));
+    pop();
+    return true;
+}
+
+bool jitGetProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    return getProperty(name, cache);
+}
+
+bool jitSetProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    if (!setCachedProperty(instance, cache, peek(0))) {
+        setProperty(instance, name, peek(0), cache);
+    }
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+bool jitGetSuper(ObjString *name) {
+    ObjClass *superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name);
+}
+
+bool jitAdd() {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    } else {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+bool jitAddLocals(int a, int b) {
+    Value *slots = vm.frames[vm.frameCount - 1].slots;
+    push(slots[a]);
+    push(slots[b]);
+    return jitAdd();
+}
+
+bool jitAddLocalConstant(int local, Value constant) {
+    Value *slot = &vm.frames[vm.frameCount - 1].slots[local];
+    push(*slot);
+    push(constant);
+    if (!jitAdd()) return false;
+    *slot = peek(0);
+    return true;
 }
 
+bool jitArithmetic(int instruction) {
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        runtimeError("Operands must be two numbers.");
+        return false;
+    }
+
+    if (instruction == OP_MOD) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(modulo(a, b)));
+    } else {
+        int b = AS_NUMBER(pop());
+        float a = AS_NUMBER(pop());
+        push(NUMBER_VAL(power(a, b)));
+    }
+    return true;
+}
+
+bool jitPrint() {
+    Value value = pop();
+    // Modules print nothing while they are being imported, as in run().
+    if (!vm.isImporting) {
+        printValue(value);
+        printf("\n");
+    }
+    return true;
+}
+
+/** Runs the frame a call just pushed, if any, until it returns to [caller]. */
+static bool finishCall(CallFrame *caller) {
+    if (&vm.frames[vm.frameCount - 1] == caller) return true;
+    return run() == INTERPRET_OK;
+}
+
+bool jitCall(int argCount) {
+    CallFrame *caller = &vm.frames[vm.frameCount - 1];
+    return callValue(peek(argCount), argCount) && finishCall(caller);
+}
+
+bool jitInvoke(ObjString *name, int argCount, InlineCache *cache) {
+    CallFrame *caller = &vm.frames[vm.frameCount - 1];
+    return invoke(name, argCount, cache) && finishCall(caller);
+}
+
+bool jitSuperInvoke(ObjString *name, int argCount, InlineCache *cache) {
+    CallFrame *caller = &vm.frames[vm.frameCount - 1];
+    ObjClass *superclass = AS_CLASS(pop());
+    return superInvoke(superclass, name, argCount, cache) && finishCall(caller);
+}
+
+bool jitClosure(ObjFunction *function, uint8_t *operands) {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *operands++;
+        uint8_t index = *operands++;
+        if (isLocal) {
+            closure->upvalues[i] = TO_REF(captureUpvalue(frame->slots + index));
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        writeBarrier((Obj *) closure, OBJ_VAL(FROM_REF(Obj, closure->upvalues[i])));
+    }
+    return true;
+}
+
+bool jitCloseUpvalue() {
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+    return true;
+}
+
+bool jitReturn() {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+    if (vm.frameCount == 0) {
+        pop(); // The script closure.
+        return true;
+    }
+
+    vm.stackTop = frame->slots;
+    push(result);
+    return true;
+}
+
+bool jitClass(ObjString *name) {
+    push(OBJ_VAL(newClass(name)));
+    return true;
+}
+
+bool jitInherit() {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass *subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    rememberObject((Obj *) subclass);
+    pop(); // Subclass.
+    return true;
+}
+
+bool jitMethod(ObjString *name) {
+    defineMethod(name);
+    return true;
+}
+#endif
+
 void hack(bool b) {
     run();
     if (b) hack(false);
@@ -677,6 +2201,9 @@ void hack(bool b) {
 
 // Module system functions
 Module* createModule(ObjString* name) {
+    // The registry marks the name only once the module is counted.
+    push(OBJ_VAL(name));
+
     // Check if we need to grow the modules array
     if (vm.moduleRegistry.count + 1 > vm.moduleRegistry.capacity) {
         int oldCapacity = vm.moduleRegistry.capacity;
@@ -696,6 +2223,7 @@ Module* createModule(ObjString* name) {
     
     // Increment the count
     vm.moduleRegistry.count++;
+    pop();
     
     return module;
 }
@@ -842,6 +2370,7 @@ static InterpretResult interpretModule(const char* source, ObjString* moduleName
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
+    makePermanent(function);
     
     // Always execute the module code to process declarations
     push(OBJ_VAL(function));
@@ -900,6 +2429,7 @@ InterpretResult interpretInclude(const char* path) {
         free(source);
         return INTERPRET_COMPILE_ERROR;
     }
+    makePermanent(function);
     
     // Execute the module code
     push(OBJ_VAL(function));
@@ -919,12 +2449,12 @@ InterpretResult interpretInclude(const char* path) {
     InterpretResult result = run();
     
     // Export all valid globals 
-    for (int i = 0; i < vm.globals.capacity; i++) {
-        Entry* entry = &vm.globals.entries[i];
-        if (entry->key != NULL && entry->key->chars != NULL) {
+    for (int i = 0; i < vm.globalCount; i++) {
+        GlobalSlot* global = &vm.globalSlots[i];
+        if (!IS_UNDEFINED(global->value)) {
             // Skip builtin functions like 'clock'
-            if (strcmp(entry->key->chars, "clock") != 0) {
-                tableSet(&module->exports, entry->key, entry->value);
+            if (strcmp(global->name->chars, "clock") != 0) {
+                tableSet(&module->exports, global->name, global->value);
             }
         }
     }
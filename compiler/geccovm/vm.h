@@ -39,18 +39,47 @@ typedef struct {
   Table moduleNames;  // Maps module names to indices
 } ModuleRegistry;
 
+typedef struct {
+  ObjString* name;
+  Value value;  // UNDEFINED_VAL until a definition runs.
+} GlobalSlot;
+
+typedef enum {
+  GC_IDLE,
+  GC_MARK,  // An incremental major collection is marking between slices.
+  GC_SWEEP,  // A major collection has pages left to sweep.
+} GCPhase;
+
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
   Value stack[STACK_MAX];
   Value* stackTop;
-  Table globals;
-  Table strings;
+  Table globals;  // Global name -> index into globalSlots, for the compiler and the REPL.
+  GlobalSlot* globalSlots;
+  int globalCount;
+  int globalCapacity;
+  StringSet strings;
   ObjString* initString;
   ObjUpvalue* openUpvalues;
   size_t bytesAllocated;
+  size_t peakBytesAllocated;  // The most bytesAllocated has been.
   size_t nextGC;
-  Obj* objects;
+  int youngCount;
+  int youngCapacity;
+  Obj** youngObjects;  // Objects allocated since the last collection.
+  size_t youngBytes;  // Bytes allocated since the last collection.
+  bool collectingYoung;  // A minor collection is running and treats old objects as live.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;  // Old objects given references to young ones since the last collection.
+  int permanentCount;
+  int permanentCapacity;
+  ObjFunction** permanent;  // Permanent functions, whose caches and traces are still traced.
+  GCPhase gcPhase;
+  size_t sliceBytes;  // Bytes allocated since the last incremental slice.
+  bool compactDue;  // The last major collection found the heap fragmented, see compactHeap().
+  bool memoryExhausted;  // A full collection left the heap over gcHeapLimit, see outOfMemory().
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
@@ -77,6 +106,9 @@ extern InterpretResult interpret(const char* source);
 extern InterpretResult interpretInclude(const char* path);
 extern void push(Value value);
 extern Value pop();
+extern int globalSlot(ObjString* name);
+extern void defineGlobal(ObjString* name, Value value);
+extern bool getGlobal(ObjString* name, Value* value);
 
 // Module system exports
 extern Module* findModule(ObjString* name);
@@ -2,16 +2,27 @@
 // Created by wylan on 12/19/24.
 //
 
+#define _DEFAULT_SOURCE // fork() and fileno() for --jit-diff under strict ISO C modes.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "memory/memory.h"
+#include "memory/snapshot.h"
+#include "geccovm/jit.h"
+#include "geccovm/trace.h"
 #include "geccovm/vm.h"
 #include "command/command_defs.h"
 #include "command/command_handler.h"
 #include "err/status.h"
 #include "repl/repl.h"
 
+#ifdef BASELINE_JIT
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 /**
  * Gets the extension of a passed in file.
  * @param filename the fully qualified file name.
@@ -90,6 +101,96 @@ static void runFile(const char *path) {
     }
 }
 
+#ifdef BASELINE_JIT
+/** The execution tiers --jit-diff compares. */
+typedef enum {
+    TIER_INTERPRETER,
+    TIER_METHOD, // Every function compiled by the method JIT on first use.
+    TIER_TRACE, // Every loop traced on its first back edge and every exit on its first use.
+} Tier;
+
+static const char *tierNames[] = {
+    [TIER_INTERPRETER] = "interpreter",
+    [TIER_METHOD] = "method jit",
+    [TIER_TRACE] = "trace jit",
+};
+
+/**
+ * Runs a file in a child process with stdout and stderr captured.
+ * @param path The file path of the runnable.
+ * @param tier The tier the child runs the file in, made as eager as it goes.
+ * @param output Receives the captured bytes, to be freed by the caller.
+ * @param length Receives the number of captured bytes.
+ * @return the child's wait status, or -1 if it could not be run.
+ */
+static int runCaptured(const char *path, Tier tier, char **output, size_t *length) {
+    FILE *capture = tmpfile();
+    if (capture == NULL) return -1;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(capture), STDOUT_FILENO);
+        dup2(fileno(capture), STDERR_FILENO);
+        jitEnabled = tier == TIER_METHOD;
+        jitThreshold = 1;
+        traceEnabled = tier == TIER_TRACE;
+        traceHotLoop = 1;
+        traceHotExit = 1;
+        traceStats = false;
+        runFile(path);
+        freeVM();
+        exit(exit_status(EXIT_SUCCESS));
+    }
+
+    int status = -1;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) status = -1;
+
+    fseek(capture, 0L, SEEK_END);
+    *length = ftell(capture);
+    rewind(capture);
+    *output = malloc(*length + 1);
+    if (*output == NULL || fread(*output, 1, *length, capture) < *length) status = -1;
+    fclose(capture);
+    return status;
+}
+
+/**
+ * Differential test of the tiers: runs a file in the interpreter alone, with every
+ * function compiled by the method JIT and with every loop traced, then compares
+ * everything each run printed and how it exited against the interpreter.
+ * @param path The file path of the runnable.
+ * @return EXIT_SUCCESS if the runs matched.
+ */
+static int runDifferential(const char *path) {
+    char *outputs[3] = {NULL};
+    size_t lengths[3] = {0};
+    int statuses[3];
+    for (int tier = TIER_INTERPRETER; tier <= TIER_TRACE; tier++) {
+        statuses[tier] = runCaptured(path, tier, &outputs[tier], &lengths[tier]);
+    }
+
+    bool match = statuses[TIER_INTERPRETER] != -1;
+    for (int tier = TIER_METHOD; tier <= TIER_TRACE; tier++) {
+        match = match && statuses[tier] == statuses[TIER_INTERPRETER] && lengths[tier] == lengths[TIER_INTERPRETER] &&
+                memcmp(outputs[tier], outputs[TIER_INTERPRETER], lengths[TIER_INTERPRETER]) == 0;
+    }
+    if (match) {
+        printf("JIT differential: all tiers printed the same %zu bytes.\n", lengths[TIER_INTERPRETER]);
+    } else {
+        printf("JIT differential: the tiers differ.\n");
+        for (int tier = TIER_INTERPRETER; tier <= TIER_TRACE; tier++) {
+            printf("--- %s (wait status %d) ---\n%.*s", tierNames[tier], statuses[tier], (int) lengths[tier],
+                   outputs[tier] != NULL ? outputs[tier] : "");
+        }
+    }
+
+    for (int tier = TIER_INTERPRETER; tier <= TIER_TRACE; tier++) free(outputs[tier]);
+    return match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
 /**
  * The main entry point for Gecco. This starts the program.
  * @param argc Arguments length.
@@ -97,19 +198,71 @@ static void runFile(const char *path) {
  * @return EXIT_SUCCESS if the program was a success.
  */
 int main(const int argc, const char *argv[]) {
+    readGCEnvironment();
     initVM();
 
-    if (argc >= 2 && argc < 4) {
+    if (argc >= 2) {
         if (qualified_command(argv[1])) {
 
             freeVM();
             return EXIT_SUCCESS;
         }
 
-        if (strcmp(argv[1], "--run") == 0) {
+        if (strcmp(argv[1], "--heap-stats") == 0 && argc >= 3) {
+            bool printed = printHeapSnapshot(argv[2]);
+            freeVM();
+            return exit_status(printed ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[1], "--heap-diff") == 0 && argc >= 4) {
+            bool printed = diffHeapSnapshots(argv[2], argv[3]);
+            freeVM();
+            return exit_status(printed ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[1], "--run") == 0 && argc >= 3) {
             const char *file_type = get_file_extension(argv[2]);
             if (file_extension_is_valid(file_type)) {
+                bool differential = false;
+                const char *snapshotPath = NULL;
+                for (int i = 3; i < argc; i++) {
+                    const char *option = argv[i];
+                    if (strcmp(option, "--jit-diff") == 0) differential = true;
+                    if (strcmp(option, "--gc-stats") == 0) gcStats = true;
+                    if (strcmp(option, "--gc-max-pause-us") == 0 && i + 1 < argc) gcMaxPauseUs = atoi(argv[++i]);
+                    if (strcmp(option, "--gc-threads") == 0 && i + 1 < argc) gcThreads = atoi(argv[++i]);
+                    if (strcmp(option, "--gc-compact") == 0) gcCompact = true;
+                    if (strcmp(option, "--gc-initial-heap") == 0 && i + 1 < argc) gcInitialHeap = parseGCSize(argv[++i]);
+                    if (strcmp(option, "--gc-min-heap") == 0 && i + 1 < argc) gcMinHeap = parseGCSize(argv[++i]);
+                    if (strcmp(option, "--gc-max-heap") == 0 && i + 1 < argc) gcMaxHeap = parseGCSize(argv[++i]);
+                    if (strcmp(option, "--gc-heap-limit") == 0 && i + 1 < argc) gcHeapLimit = parseGCSize(argv[++i]);
+                    if (strcmp(option, "--gc-grow-factor") == 0 && i + 1 < argc) gcGrowFactor = atof(argv[++i]);
+                    if (strcmp(option, "--gc-adaptive") == 0) gcAdaptive = true;
+                    if (strcmp(option, "--heap-snapshot") == 0 && i + 1 < argc) snapshotPath = argv[++i];
+#ifdef BASELINE_JIT
+                    if (strcmp(option, "--no-jit") == 0) {
+                        jitEnabled = false;
+                        traceEnabled = false;
+                    }
+                    if (strcmp(option, "--jit-stats") == 0) traceStats = true;
+#endif
+                }
+                configureGC();
+                if (differential) {
+#ifdef BASELINE_JIT
+                    int status = runDifferential(argv[2]);
+                    freeVM();
+                    return exit_status(status);
+#else
+                    printf("This build of Gecco has no JIT.\n");
+                    freeVM();
+                    return exit_status(EXIT_FAILURE);
+#endif
+                }
                 runFile(argv[2]);
+                if (snapshotPath != NULL && !writeHeapSnapshot(snapshotPath)) {
+                    fprintf(stderr, "Could not write heap snapshot \"%s\".\n", snapshotPath);
+                }
 
                 freeVM();
                 return exit_status(EXIT_SUCCESS);
@@ -0,0 +1,728 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS under strict ISO C modes.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+
+#ifdef __unix__
+#include <sys/mman.h>
+#elif defined(OS_Windows)
+#include <malloc.h>
+#endif
+
+// Background sweeping claims pages with the atomic builtins of GCC and Clang.
+#if defined(__GNUC__) && !defined(__STDC_NO_THREADS__)
+#define BACKGROUND_SWEEP
+#include <threads.h>
+#endif
+
+// Slots start after the page header, on a granule.
+#define PAGE_HEADER ((sizeof(Page) + HEAP_GRANULE - 1) & ~(size_t) (HEAP_GRANULE - 1))
+#define LARGE (-1)
+// Emptied small pages kept for reuse instead of being returned to the system.
+#define SPARE_PAGES 8
+
+struct FreeSlot {
+    FreeSlot *next;
+};
+
+// Objects start at 16 bytes: an 8-byte header and at least one word.
+static const uint32_t slotSizes[] = {
+    16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+#define SIZE_CLASSES ((int) (sizeof(slotSizes) / sizeof(slotSizes[0])))
+
+typedef struct {
+    Page *pages;
+    Page *available; // Swept pages with free slots, allocated from first.
+    Page *sweepCursor; // The next page of pages that may still be unswept.
+} SizeClass;
+
+static SizeClass classes[SIZE_CLASSES];
+static Page *largePages;
+static Page *largeCursor;
+static int sweepClass; // Where heapSweepPage() looks first.
+static Page *sparePages;
+static int spareCount;
+static Page *evacuated; // Pages heapEvacuate() emptied, chained through nextAvailable.
+
+// Page.sweepClaim: whoever moves it off PAGE_UNCLAIMED sweeps the page.
+enum {
+    PAGE_UNCLAIMED,
+    PAGE_CLAIMED, // By the mutator, or by the background sweeper while it works on the page.
+    PAGE_SWEPT_BEHIND, // The background sweeper freed its dead objects; the mutator finishes it.
+};
+
+#ifdef BACKGROUND_SWEEP
+/*
+ * The background sweeper is a helper thread that sweeps small-object pages while the
+ * mutator runs. It takes only pages whose dead objects own nothing besides their slot,
+ * and it only writes to the page itself: its bitmaps, live count and free list. The
+ * mutator finishes such a page when its own sweep reaches it, putting it where it
+ * belongs and counting what was freed. The page lists are the mutator's alone, so the
+ * sweeper works through an array of the pages made when the sweep started, and pages
+ * emptied while it runs stay mapped until it has stopped.
+ */
+static struct {
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t wake;
+    cnd_t done;
+    bool started; // The thread is running; it stops in heapFreeAll().
+    bool exiting;
+    bool pending; // A sweep was handed to the thread, which has not begun it.
+    bool running;
+    bool active; // From heapStartSweep() to stopSweeper(): the thread may look at the pages.
+    bool cancelled; // Read atomically: the sweeper is to stop before its next page.
+    Page **pages;
+    int count;
+    int capacity;
+} sweeper;
+
+static Page *emptiedPages; // Released while the sweeper was active, chained through next.
+#endif
+
+static int lowestBit(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+static int classOf(size_t size) {
+    int index = 0;
+    while (slotSizes[index] < size) index++;
+    return index;
+}
+
+size_t heapSlotSize(size_t size) {
+    if (size > HEAP_MAX_SMALL) return size;
+    return slotSizes[classOf(size)];
+}
+
+static void linkPage(Page **list, Page *page) {
+    page->previous = nullptr;
+    page->next = *list;
+    if (*list != NULL) (*list)->previous = page;
+    *list = page;
+}
+
+static void unlinkPage(Page **list, Page *page) {
+    if (page->previous != NULL) {
+        page->previous->next = page->next;
+    } else {
+        *list = page->next;
+    }
+    if (page->next != NULL) page->next->previous = page->previous;
+}
+
+#ifdef GECCO_COMPRESSED_HEAP
+/*
+ * Every page comes from one 4 GB reservation, the cage, so that an object's offset in it
+ * fits the 32-bit references of memory/ref.h. The cage is reserved without committing
+ * memory; pages are taken from its unused top or from holes left by freed pages, whose
+ * memory goes back to the system. The first page starts at offset 0, so no object does
+ * and 0 can stand for null.
+ */
+#define CAGE_SIZE ((size_t) 1 << 32)
+
+typedef struct {
+    char *start;
+    size_t size;
+} Hole;
+
+char *heapCage;
+static char *cageTop;
+static Hole *holes; // Freed ranges of the cage, sorted by address, adjacent ones merged.
+static int holeCount;
+static int holeCapacity;
+
+static bool reserveCage() {
+    char *mapping = mmap(NULL, CAGE_SIZE + HEAP_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) return false;
+    heapCage = (char *) (((uintptr_t) mapping + HEAP_PAGE_SIZE - 1) & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+    if (heapCage > mapping) munmap(mapping, heapCage - mapping);
+    if (mapping + HEAP_PAGE_SIZE > heapCage) munmap(heapCage + CAGE_SIZE, mapping + HEAP_PAGE_SIZE - heapCage);
+    cageTop = heapCage;
+    return true;
+}
+
+static void *mapPages(size_t size) {
+    if (heapCage == NULL && !reserveCage()) return NULL;
+
+    for (int i = 0; i < holeCount; i++) {
+        if (holes[i].size < size) continue;
+        char *start = holes[i].start;
+        holes[i].start += size;
+        holes[i].size -= size;
+        if (holes[i].size == 0) {
+            memmove(&holes[i], &holes[i + 1], sizeof(Hole) * (holeCount - i - 1));
+            holeCount--;
+        }
+        return start;
+    }
+
+    if ((size_t) (heapCage + CAGE_SIZE - cageTop) < size) return NULL;
+    char *start = cageTop;
+    cageTop += size;
+    return start;
+}
+
+static void unmapPages(char *start, size_t size) {
+    madvise(start, size, MADV_DONTNEED);
+
+    int index = 0;
+    while (index < holeCount && holes[index].start < start) index++;
+    bool joinsPrevious = index > 0 && holes[index - 1].start + holes[index - 1].size == start;
+    bool joinsNext = index < holeCount && start + size == holes[index].start;
+    if (joinsPrevious && joinsNext) {
+        holes[index - 1].size += size + holes[index].size;
+        memmove(&holes[index], &holes[index + 1], sizeof(Hole) * (holeCount - index - 1));
+        holeCount--;
+    } else if (joinsPrevious) {
+        holes[index - 1].size += size;
+    } else if (joinsNext) {
+        holes[index].start = start;
+        holes[index].size += size;
+    } else {
+        if (holeCount == holeCapacity) {
+            holeCapacity = holeCapacity < 8 ? 8 : holeCapacity * 2;
+            holes = realloc(holes, sizeof(Hole) * holeCapacity);
+            if (holes == NULL) exitOutOfMemory();
+        }
+        memmove(&holes[index + 1], &holes[index], sizeof(Hole) * (holeCount - index));
+        holes[index] = (Hole) {start, size};
+        holeCount++;
+    }
+}
+#else
+/** Maps [size] bytes aligned to HEAP_PAGE_SIZE, so that freeing them gives them back to the system. */
+static void *mapPages(size_t size) {
+#ifdef __unix__
+    char *mapping = mmap(NULL, size + HEAP_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    char *start = (char *) (((uintptr_t) mapping + HEAP_PAGE_SIZE - 1) & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+    if (start > mapping) munmap(mapping, start - mapping);
+    if (mapping + HEAP_PAGE_SIZE > start) munmap(start + size, mapping + HEAP_PAGE_SIZE - start);
+    return start;
+#elif defined(OS_Windows)
+    return _aligned_malloc(size, HEAP_PAGE_SIZE);
+#else
+    return aligned_alloc(HEAP_PAGE_SIZE, size);
+#endif
+}
+#endif
+
+static void freePage(Page *page) {
+#ifdef GECCO_COMPRESSED_HEAP
+    unmapPages((char *) page, page->end - (char *) page);
+#elif defined(__unix__)
+    munmap(page, page->end - (char *) page);
+#elif defined(OS_Windows)
+    _aligned_free(page);
+#else
+    free(page);
+#endif
+}
+
+static Page *newPage(size_t size) {
+    Page *page;
+    if (size == HEAP_PAGE_SIZE && sparePages != NULL) {
+        page = sparePages;
+        sparePages = page->next;
+        spareCount--;
+    } else {
+        page = mapPages(size);
+        if (page == NULL) return NULL;
+    }
+    memset(page, 0, PAGE_HEADER);
+    page->swept = true;
+    page->bump = (char *) page + PAGE_HEADER;
+    page->end = (char *) page + size;
+    return page;
+}
+
+static void makeAvailable(SizeClass *sizeClass, Page *page) {
+    page->available = true;
+    page->nextAvailable = sizeClass->available;
+    sizeClass->available = page;
+}
+
+static Obj *takeSlot(Page *page) {
+    char *slot;
+    if (page->freeSlots != NULL) {
+        slot = (char *) page->freeSlots;
+        page->freeSlots = page->freeSlots->next;
+    } else if (page->bump + page->slotSize <= page->end) {
+        slot = page->bump;
+        page->bump += page->slotSize;
+    } else {
+        return NULL;
+    }
+
+    uint64_t bit;
+    int word = bitmapWord((Obj *) slot, &bit);
+    page->allocated[word] |= bit;
+    page->liveCount++;
+    return (Obj *) slot;
+}
+
+static Obj *allocateLarge(size_t size) {
+    size_t pageSize = (PAGE_HEADER + size + HEAP_PAGE_SIZE - 1) & ~(size_t) (HEAP_PAGE_SIZE - 1);
+    Page *page = newPage(pageSize);
+    if (page == NULL) return NULL;
+    page->sizeClass = LARGE;
+    page->slotSize = (uint32_t) size;
+    linkPage(&largePages, page);
+    return takeSlot(page);
+}
+
+static void freeSpares() {
+    while (sparePages != NULL) {
+        Page *next = sparePages->next;
+        freePage(sparePages);
+        sparePages = next;
+    }
+    spareCount = 0;
+}
+
+/** Keeps an unlinked, empty page for reuse or gives it back to the system. */
+static void discardPage(Page *page) {
+    if (page->sizeClass != LARGE && spareCount < SPARE_PAGES) {
+        page->next = sparePages;
+        sparePages = page;
+        spareCount++;
+        return;
+    }
+    freePage(page);
+}
+
+static void releasePage(Page *page) {
+    unlinkPage(page->sizeClass == LARGE ? &largePages : &classes[page->sizeClass].pages, page);
+#ifdef BACKGROUND_SWEEP
+    if (page->sizeClass != LARGE && sweeper.active) {
+        page->next = emptiedPages;
+        emptiedPages = page;
+        return;
+    }
+#endif
+    discardPage(page);
+}
+
+/** Puts a page whose dead objects are freed where it belongs: released, available or full. */
+static void finishPage(Page *page) {
+    page->swept = true;
+
+    if (page->liveCount == 0) {
+        releasePage(page);
+    } else if (page->sizeClass != LARGE && (page->freeSlots != NULL || page->bump < page->end)) {
+        makeAvailable(&classes[page->sizeClass], page);
+    }
+}
+
+/** Takes the sweep of [page] for the mutator, unless the background sweeper has it. Returns whether it did. */
+static bool claimPage(Page *page) {
+    if (page->sizeClass == LARGE) return true;
+#ifdef BACKGROUND_SWEEP
+    for (;;) {
+        uint8_t claim = PAGE_UNCLAIMED;
+        if (__atomic_compare_exchange_n(&page->sweepClaim, &claim, PAGE_CLAIMED, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        if (claim == PAGE_SWEPT_BEHIND) return false;
+        // The sweeper is on this page right now, which takes it no more than a few microseconds.
+        thrd_yield();
+    }
+#else
+    return true;
+#endif
+}
+
+/** Frees the page's unmarked objects and clears the marks of the others. */
+static void sweepPage(Page *page) {
+    if (!claimPage(page)) {
+        countFreed(page->freedBytes);
+        finishPage(page);
+        return;
+    }
+
+    for (int word = 0; word < HEAP_GRANULES / 64; word++) {
+        uint64_t dead = page->allocated[word] & ~page->marks[word];
+        while (dead != 0) {
+            int granule = word * 64 + lowestBit(dead);
+            dead &= dead - 1;
+            Obj *object = (Obj *) ((char *) page + (size_t) granule * HEAP_GRANULE);
+            // Permanent objects are never marked.
+            if (!object->isPermanent) freeObject(object);
+        }
+        page->marks[word] = 0;
+    }
+    finishPage(page);
+}
+
+#ifdef BACKGROUND_SWEEP
+/** Whether every unmarked object of [page] can be freed by giving back its slot alone. */
+static bool onlySlotsDie(Page *page) {
+    for (int word = 0; word < HEAP_GRANULES / 64; word++) {
+        uint64_t dead = page->allocated[word] & ~page->marks[word];
+        while (dead != 0) {
+            int granule = word * 64 + lowestBit(dead);
+            dead &= dead - 1;
+            Obj *object = (Obj *) ((char *) page + (size_t) granule * HEAP_GRANULE);
+            if (!object->isPermanent && !freesOnlySlot(object)) return false;
+        }
+    }
+    return true;
+}
+
+/** sweepPage() on the sweeper thread, leaving what touches the size class to the mutator. */
+static void sweepBehind(Page *page) {
+    uint8_t claim = PAGE_UNCLAIMED;
+    if (!__atomic_compare_exchange_n(&page->sweepClaim, &claim, PAGE_CLAIMED, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (!onlySlotsDie(page)) {
+        __atomic_store_n(&page->sweepClaim, PAGE_UNCLAIMED, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint32_t freed = 0;
+    for (int word = 0; word < HEAP_GRANULES / 64; word++) {
+        uint64_t dead = page->allocated[word] & ~page->marks[word];
+        while (dead != 0) {
+            int granule = word * 64 + lowestBit(dead);
+            dead &= dead - 1;
+            Obj *object = (Obj *) ((char *) page + (size_t) granule * HEAP_GRANULE);
+            if (object->isPermanent) continue;
+            page->allocated[word] &= ~((uint64_t) 1 << (granule % 64));
+            page->liveCount--;
+            FreeSlot *slot = (FreeSlot *) object;
+            slot->next = page->freeSlots;
+            page->freeSlots = slot;
+            freed += page->slotSize;
+        }
+        page->marks[word] = 0;
+    }
+    page->freedBytes = freed;
+    __atomic_store_n(&page->sweepClaim, PAGE_SWEPT_BEHIND, __ATOMIC_RELEASE);
+}
+
+static int sweeperMain(void *argument) {
+    (void) argument;
+    mtx_lock(&sweeper.lock);
+    for (;;) {
+        while (!sweeper.pending && !sweeper.exiting) cnd_wait(&sweeper.wake, &sweeper.lock);
+        if (sweeper.exiting) break;
+        sweeper.pending = false;
+        sweeper.running = true;
+        mtx_unlock(&sweeper.lock);
+
+        for (int i = 0; i < sweeper.count && !__atomic_load_n(&sweeper.cancelled, __ATOMIC_RELAXED); i++) {
+            sweepBehind(sweeper.pages[i]);
+        }
+
+        mtx_lock(&sweeper.lock);
+        sweeper.running = false;
+        cnd_signal(&sweeper.done);
+    }
+    mtx_unlock(&sweeper.lock);
+    return 0;
+}
+
+/** Hands the small-object pages to the sweeper thread, starting it the first time. */
+static void startSweeper() {
+    if (!sweeper.started) {
+        if (mtx_init(&sweeper.lock, mtx_plain) != thrd_success || cnd_init(&sweeper.wake) != thrd_success ||
+            cnd_init(&sweeper.done) != thrd_success) {
+            return;
+        }
+        if (thrd_create(&sweeper.thread, sweeperMain, NULL) != thrd_success) return;
+        sweeper.started = true;
+    }
+
+    int count = 0;
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        for (Page *page = classes[i].pages; page != NULL; page = page->next) count++;
+    }
+    if (count > sweeper.capacity) {
+        // Without room for the array, the mutator sweeps on its own.
+        Page **pages = realloc(sweeper.pages, sizeof(Page *) * count);
+        if (pages == NULL) return;
+        sweeper.pages = pages;
+        sweeper.capacity = count;
+    }
+    sweeper.count = 0;
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        for (Page *page = classes[i].pages; page != NULL; page = page->next) sweeper.pages[sweeper.count++] = page;
+    }
+
+    mtx_lock(&sweeper.lock);
+    sweeper.active = true;
+    sweeper.pending = true;
+    cnd_signal(&sweeper.wake);
+    mtx_unlock(&sweeper.lock);
+}
+#endif
+
+/** Waits for the sweeper thread to leave the pages alone, then releases the ones emptied meanwhile. */
+static void stopSweeper() {
+#ifdef BACKGROUND_SWEEP
+    if (!sweeper.active) return;
+    mtx_lock(&sweeper.lock);
+    __atomic_store_n(&sweeper.cancelled, true, __ATOMIC_RELAXED);
+    sweeper.pending = false;
+    while (sweeper.running) cnd_wait(&sweeper.done, &sweeper.lock);
+    __atomic_store_n(&sweeper.cancelled, false, __ATOMIC_RELAXED);
+    sweeper.active = false;
+    mtx_unlock(&sweeper.lock);
+
+    while (emptiedPages != NULL) {
+        Page *page = emptiedPages;
+        emptiedPages = page->next;
+        discardPage(page);
+    }
+#endif
+}
+
+/** Moves the cursor past swept pages and sweeps the first unswept one. */
+static bool sweepNext(Page **cursor) {
+    while (*cursor != NULL && (*cursor)->swept) *cursor = (*cursor)->next;
+    if (*cursor == NULL) return false;
+
+    Page *page = *cursor;
+    *cursor = page->next;
+    sweepPage(page);
+    return true;
+}
+
+Obj *heapAllocate(size_t size) {
+    if (size > HEAP_MAX_SMALL) return allocateLarge(size);
+
+    int index = classOf(size);
+    SizeClass *sizeClass = &classes[index];
+    for (;;) {
+        Page *page = sizeClass->available;
+        if (page != NULL) {
+            Obj *object = takeSlot(page);
+            if (object != NULL) return object;
+            sizeClass->available = page->nextAvailable;
+            page->available = false;
+            continue;
+        }
+
+        // Unswept pages are reused before new ones are made.
+        if (sweepNext(&sizeClass->sweepCursor)) continue;
+
+        page = newPage(HEAP_PAGE_SIZE);
+        if (page == NULL) return NULL;
+        page->sizeClass = index;
+        page->slotSize = slotSizes[index];
+        linkPage(&sizeClass->pages, page);
+        makeAvailable(sizeClass, page);
+    }
+}
+
+void heapFree(Obj *object) {
+    Page *page = pageOf(object);
+    uint64_t bit;
+    int word = bitmapWord(object, &bit);
+    page->allocated[word] &= ~bit;
+    page->liveCount--;
+
+    if (page->sizeClass == LARGE) {
+        // Sweeping releases the pages it empties itself.
+        if (page->swept) releasePage(page);
+        return;
+    }
+
+    FreeSlot *slot = (FreeSlot *) object;
+    slot->next = page->freeSlots;
+    page->freeSlots = slot;
+    if (page->swept && !page->available) makeAvailable(&classes[page->sizeClass], page);
+}
+
+void heapStartSweep(bool background) {
+    stopSweeper();
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        for (Page *page = classes[i].pages; page != NULL; page = page->next) {
+            page->swept = false;
+            page->available = false;
+            page->sweepClaim = PAGE_UNCLAIMED;
+        }
+        classes[i].available = nullptr;
+        classes[i].sweepCursor = classes[i].pages;
+    }
+    for (Page *page = largePages; page != NULL; page = page->next) page->swept = false;
+    largeCursor = largePages;
+#ifdef BACKGROUND_SWEEP
+    if (background) startSweeper();
+#else
+    (void) background;
+#endif
+}
+
+bool heapSweepPage() {
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        if (sweepNext(&classes[sweepClass].sweepCursor)) return true;
+        sweepClass = (sweepClass + 1) % SIZE_CLASSES;
+    }
+    if (sweepNext(&largeCursor)) return true;
+    stopSweeper();
+    return false;
+}
+
+static void visitPage(Page *page, void (*visit)(Obj *object, void *context), void *context) {
+    // What is left in an evacuated page are stale copies.
+    if (page->evacuating) return;
+    for (int word = 0; word < HEAP_GRANULES / 64; word++) {
+        uint64_t bits = page->allocated[word];
+        while (bits != 0) {
+            int granule = word * 64 + lowestBit(bits);
+            bits &= bits - 1;
+            visit((Obj *) ((char *) page + (size_t) granule * HEAP_GRANULE), context);
+        }
+    }
+}
+
+void heapVisit(void (*visit)(Obj *object, void *context), void *context) {
+    stopSweeper();
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        for (Page *page = classes[i].pages; page != NULL; page = page->next) visitPage(page, visit, context);
+    }
+    for (Page *page = largePages; page != NULL; page = page->next) visitPage(page, visit, context);
+}
+
+HeapUsage heapUsage() {
+    stopSweeper();
+    HeapUsage usage = {0, 0};
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        for (Page *page = classes[i].pages; page != NULL; page = page->next) {
+            usage.pageBytes += HEAP_PAGE_SIZE;
+            usage.liveBytes += (size_t) page->liveCount * page->slotSize;
+        }
+    }
+    return usage;
+}
+
+/** Whether [page] is less than half full. */
+static bool isSparse(Page *page) {
+    return (size_t) page->liveCount * 2 < (HEAP_PAGE_SIZE - PAGE_HEADER) / page->slotSize;
+}
+
+int heapEvacuate(void (*moved)(Obj *from, Obj *to)) {
+    stopSweeper();
+    int count = 0;
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        SizeClass *sizeClass = &classes[i];
+        int sparse = 0;
+        for (Page *page = sizeClass->pages; page != NULL; page = page->next) {
+            if (isSparse(page)) sparse++;
+        }
+        // The objects of a single sparse page would only fill another one.
+        if (sparse < 2) continue;
+
+        // The sparse pages leave the available stack, so their objects go to the others or to new pages.
+        sizeClass->available = nullptr;
+        for (Page *page = sizeClass->pages; page != NULL; page = page->next) {
+            page->available = false;
+            if (isSparse(page)) {
+                page->evacuating = true;
+                page->nextAvailable = evacuated;
+                evacuated = page;
+                count++;
+            } else if (page->freeSlots != NULL || page->bump < page->end) {
+                makeAvailable(sizeClass, page);
+            }
+        }
+    }
+
+    for (Page *page = evacuated; page != NULL; page = page->nextAvailable) {
+        for (int word = 0; word < HEAP_GRANULES / 64; word++) {
+            uint64_t bits = page->allocated[word];
+            while (bits != 0) {
+                int granule = word * 64 + lowestBit(bits);
+                bits &= bits - 1;
+                Obj *from = (Obj *) ((char *) page + (size_t) granule * HEAP_GRANULE);
+                Obj *to = heapAllocate(page->slotSize);
+                // Compaction runs inside a collection, so there is nothing left to free and retry with.
+                if (to == NULL) exitOutOfMemory();
+                memcpy(to, from, page->slotSize);
+                moved(from, to);
+            }
+        }
+    }
+    return count;
+}
+
+void heapReleaseEvacuated() {
+    while (evacuated != NULL) {
+        Page *next = evacuated->nextAvailable;
+        unlinkPage(&classes[evacuated->sizeClass].pages, evacuated);
+        freePage(evacuated);
+        evacuated = next;
+    }
+    // Compaction is for giving memory back, so the spare pages go too.
+    freeSpares();
+}
+
+static void freePages(Page *page) {
+    while (page != NULL) {
+        Page *next = page->next;
+        // Keeps heapFree() from releasing large pages under the loop.
+        page->swept = false;
+        for (int word = 0; word < HEAP_GRANULES / 64; word++) {
+            uint64_t bits = page->allocated[word];
+            while (bits != 0) {
+                int granule = word * 64 + lowestBit(bits);
+                bits &= bits - 1;
+                freeObject((Obj *) ((char *) page + (size_t) granule * HEAP_GRANULE));
+            }
+        }
+        freePage(page);
+        page = next;
+    }
+}
+
+void heapFreeAll() {
+    stopSweeper();
+#ifdef BACKGROUND_SWEEP
+    if (sweeper.started) {
+        mtx_lock(&sweeper.lock);
+        sweeper.exiting = true;
+        cnd_signal(&sweeper.wake);
+        mtx_unlock(&sweeper.lock);
+        thrd_join(sweeper.thread, NULL);
+        mtx_destroy(&sweeper.lock);
+        cnd_destroy(&sweeper.wake);
+        cnd_destroy(&sweeper.done);
+        sweeper.started = false;
+    }
+    free(sweeper.pages);
+    sweeper.pages = nullptr;
+    sweeper.capacity = 0;
+#endif
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        freePages(classes[i].pages);
+        classes[i] = (SizeClass){0};
+    }
+    freePages(largePages);
+    largePages = nullptr;
+    largeCursor = nullptr;
+    freeSpares();
+}
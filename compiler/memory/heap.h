@@ -0,0 +1,105 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef heap_h
+#define heap_h
+
+#include "../object.h"
+
+// Pages are aligned to their size, so clearing the low bits of an object's address finds its page.
+#define HEAP_PAGE_SIZE (64 * 1024)
+// What one mark bit covers, and the step between the smallest size classes.
+#define HEAP_GRANULE 8
+#define HEAP_GRANULES (HEAP_PAGE_SIZE / HEAP_GRANULE)
+// Larger objects get pages of their own in the large-object space.
+#define HEAP_MAX_SMALL 1024
+
+typedef struct FreeSlot FreeSlot;
+typedef struct Page Page;
+
+/**
+ * A page of same-sized slots for objects of one size class, or a single large object.
+ * Mark bits and the bits saying which slots hold objects are kept here, by granule of
+ * the page, instead of in the objects.
+ */
+struct Page {
+    Page *next; // In its size class, or in the large-object space.
+    Page *previous;
+    Page *nextAvailable; // On its size class's stack of swept pages with free slots.
+    FreeSlot *freeSlots;
+    char *bump; // Slots from here to end were never used.
+    char *end;
+    uint32_t slotSize;
+    int sizeClass; // -1 in the large-object space.
+    int liveCount;
+    bool swept; // False between the end of marking and the sweep of this page.
+    bool available;
+    bool evacuating; // Emptied by heapEvacuate(); each object left here holds its new address.
+    uint8_t sweepClaim; // Who sweeps the page since heapStartSweep(), taken atomically.
+    uint32_t freedBytes; // Freed by the background sweeper, for the mutator to count.
+    uint64_t marks[HEAP_GRANULES / 64];
+    uint64_t allocated[HEAP_GRANULES / 64];
+};
+
+static inline Page *pageOf(Obj *object) {
+    return (Page *) ((uintptr_t) object & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+}
+
+/** The word of [object]'s page bitmap that holds its bit, which goes into [bit]. */
+static inline int bitmapWord(Obj *object, uint64_t *bit) {
+    size_t granule = ((uintptr_t) object & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE;
+    *bit = (uint64_t) 1 << (granule % 64);
+    return (int) (granule / 64);
+}
+
+static inline bool isMarked(Obj *object) {
+    uint64_t bit;
+    int word = bitmapWord(object, &bit);
+    return (pageOf(object)->marks[word] & bit) != 0;
+}
+
+static inline void setMarked(Obj *object, bool marked) {
+    uint64_t bit;
+    int word = bitmapWord(object, &bit);
+    if (marked) {
+        pageOf(object)->marks[word] |= bit;
+    } else {
+        pageOf(object)->marks[word] &= ~bit;
+    }
+}
+
+typedef struct {
+    size_t pageBytes; // In the pages of the size classes.
+    size_t liveBytes; // In their allocated slots.
+} HeapUsage;
+
+/** The bytes an object of [size] bytes takes up in the heap. */
+size_t heapSlotSize(size_t size);
+/** Takes a slot for an object of [size] bytes, or returns NULL when no page can be mapped for it. */
+Obj *heapAllocate(size_t size);
+/** Returns the slot of a freed object to its page. */
+void heapFree(Obj *object);
+/**
+ * Leaves every page to be swept, lazily by heapAllocate() or by heapSweepPage(). With
+ * [background], a helper thread sweeps the small-object pages it safely can meanwhile.
+ */
+void heapStartSweep(bool background);
+/** Sweeps one page that is still to be swept. Returns false if there were none left. */
+bool heapSweepPage();
+/** Calls [visit] with every allocated object, except those left in evacuated pages. */
+void heapVisit(void (*visit)(Obj *object, void *context), void *context);
+/** How full the small-object pages are. The heap must be swept. */
+HeapUsage heapUsage();
+/**
+ * Copies the objects of the size classes' sparse pages into their other pages, or new
+ * ones, calling [moved] with the old and the new address of each. The heap must be
+ * swept. Returns how many pages were emptied; they stay until heapReleaseEvacuated().
+ */
+int heapEvacuate(void (*moved)(Obj *from, Obj *to));
+/** Gives the pages heapEvacuate() emptied back to the system. */
+void heapReleaseEvacuated();
+/** Frees every object and every page. */
+void heapFreeAll();
+
+#endif //heap_h
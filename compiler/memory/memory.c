@@ -3,18 +3,436 @@
 //
 
 //> Chunks of Bytecode memory-c
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "../compiler/compiler.h"
+#include "../err/status.h"
+#include "heap.h"
 #include "memory.h"
+#include "../geccovm/jit.h"
+#include "../geccovm/trace.h"
 #include "../geccovm/vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
+// Parallel marking claims mark bits with the atomic builtins of GCC and Clang.
+#if defined(__GNUC__) && !defined(__STDC_NO_THREADS__) && !defined(__STDC_NO_ATOMICS__)
+#define PARALLEL_MARK
+#include <stdatomic.h>
+#include <threads.h>
+#endif
+
+// Defaults of the options below, which --gc-* flags and GECCO_GC_* variables override.
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_MIN_HEAP (1024 * 1024)
+// Share of the run adaptive pacing lets the collector take, and how far it moves the growth factor.
+#define GC_TARGET_OVERHEAD 0.05
+#define GC_MIN_GROW_FACTOR 1.25
+#define GC_MAX_GROW_FACTOR 8.0
+// Pause histogram buckets: under 1 us, then one per power of two microseconds.
+#define GC_HISTOGRAM_BUCKETS 24
+// An emergency collection must leave 1/GC_LIMIT_HEADROOM of gcHeapLimit free, or the script fails.
+#define GC_LIMIT_HEADROOM 16
+// Bytes allocated between minor collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+// Bytes the mutator allocates between two slices of an incremental collection.
+#define GC_SLICE_SIZE (64 * 1024)
+// Objects a slice blackens or sweeps between two looks at the clock.
+#define GC_SLICE_CHECK 64
+// How long a slice sweeping after a stop-the-world collection may run.
+#define GC_SWEEP_SLICE_US 100
+// Objects a major collection blackens on the mutator thread before it calls in the helper threads.
+#define GC_PARALLEL_THRESHOLD 4096
+#define GC_MAX_THREADS 64
+// With gcCompact, a major collection that leaves more than this share of the small-object
+// pages unused asks for a compaction...
+#define GC_COMPACT_FRAGMENTATION 0.5
+// ...if they take up at least this many bytes.
+#define GC_COMPACT_MIN_HEAP (1024 * 1024)
+
+/*
+ * Objects live in the pages of heap.c, which keep their mark bits. The heap has two
+ * generations. New objects are young and also listed in vm.youngObjects. A minor
+ * collection marks from the roots and the remembered set only, stopping at old
+ * objects, then frees the unreached young objects and promotes the rest. Its cost
+ * follows the young objects that survive, not the size of the heap. A major
+ * collection, run once the heap has doubled since the last one, marks both
+ * generations and leaves the pages to be swept one at a time, by allocation in their
+ * size class or by a slice every GC_SLICE_SIZE bytes.
+ *
+ * Objects never move: the runtime keeps raw object pointers in C locals and native
+ * code across allocations. For minor collections to be sound, every store of a
+ * reference into an object that may be old goes through writeBarrier().
+ *
+ * With gcMaxPauseUs set, a major collection is incremental. It marks the roots, then
+ * drains the gray stack in slices of at most that many microseconds, one for every
+ * GC_SLICE_SIZE bytes allocated, with minor collections held off. writeBarrier()
+ * shades whatever is stored into a marked object, so no marked object points to an
+ * unmarked one. The stack and the globals have no barrier, so marking ends with a
+ * rescan of the roots. Marking promotes what it reaches.
+ *
+ * With gcThreads above one, a major collection that still has much to mark after
+ * GC_PARALLEL_THRESHOLD objects hands it to that many workers: the mutator thread and
+ * helpers that sleep between collections. Each worker blackens objects from its own
+ * work-stealing deque, claims mark bits atomically and steals from the others when it
+ * runs dry. The mutator is stopped meanwhile, the helpers only ever mark. Once
+ * marking ends, a sweeper thread also sweeps the small-object pages whose dead
+ * objects free nothing but their slot, while the mutator runs (see heap.c).
+ *
+ * With gcCompact set, the objects still do move, but only in compactHeap(), which the
+ * interpreter calls at a loop back edge of the outermost run(): there no C code below
+ * holds object pointers and no native code is running. It evacuates the objects of
+ * sparse pages, leaving the new address of each in its old copy, rewrites every
+ * reference in the roots and the heap and gives the emptied pages back to the system.
+ * Native code embeds object addresses, so it is thrown away, to be compiled again.
+ *
+ * The functions a script declares, their names and their constants are made permanent
+ * once it compiles. Marking stops at permanent objects and sweeping skips them, so the
+ * code of a large program is not traced again by every collection. Their constants
+ * never change; what does, the inline caches and traces of a function, is traced from
+ * vm.permanent as a root by major collections, and reaches minor ones through the
+ * write barrier like the fields of any old object.
+ *
+ * A major collection is due once the heap has grown by the growth factor since the
+ * last one ended, within gcMinHeap and gcMaxHeap. With gcAdaptive, each major cycle
+ * sets the factor from what it cost and the allocation rate since the one before, for
+ * the collector to take about GC_TARGET_OVERHEAD of the time: a cycle costing c for L
+ * live bytes, at a rate of r bytes per unit of mutator time, needs a factor of
+ * 1 + c * r * (1 - target) / (target * L).
+ *
+ * gcHeapLimit is a hard cap, unlike gcMaxHeap. An allocation that takes the heap past it
+ * runs an emergency full collection. When that leaves less than 1/GC_LIMIT_HEADROOM of
+ * the limit free, vm.memoryExhausted is set and the interpreter raises an out-of-memory
+ * runtime error at its next call or loop back edge, where the stack can be unwound
+ * safely. Allocation is not refused meanwhile, so the operation in progress finishes.
+ */
+
+int gcMaxPauseUs = 0;
+int gcThreads = 1;
+bool gcStats = false;
+bool gcCompact = false;
+size_t gcInitialHeap = GC_INITIAL_HEAP;
+size_t gcMinHeap = GC_MIN_HEAP;
+size_t gcMaxHeap = 0;
+size_t gcHeapLimit = 0;
+double gcGrowFactor = GC_HEAP_GROW_FACTOR;
+bool gcAdaptive = false;
+
+typedef enum {
+    PAUSE_MINOR,
+    PAUSE_MAJOR,
+    PAUSE_SLICE,
+    PAUSE_COMPACT,
+} PauseKind;
+
+static const char *typeNames[] = {
+    [OBJ_BOUND_METHOD] = "bound method", [OBJ_CLASS] = "class", [OBJ_CLOSURE] = "closure",
+    [OBJ_FUNCTION] = "function", [OBJ_INSTANCE] = "instance", [OBJ_NATIVE] = "native",
+    [OBJ_SHAPE] = "shape", [OBJ_STRING] = "string", [OBJ_UPVALUE] = "upvalue",
+};
+
+#define OBJ_TYPE_COUNT ((int) (sizeof(typeNames) / sizeof(typeNames[0])))
+
+// Every pause is logged for percentiles with --gc-stats; the rest is always counted.
+static struct {
+    uint64_t *nanos;
+    int count;
+    int capacity;
+    int kinds[PAUSE_COMPACT + 1];
+    uint64_t totalNanos;
+    uint64_t histogram[GC_HISTOGRAM_BUCKETS];
+} pauses;
+
+// What the collections have done, and what pacing measures.
+static struct {
+    size_t freed; // Bytes freed by all collections.
+    size_t minorFreed;
+    size_t majorFreed;
+    size_t maxMajorFreed;
+    int majorCycles; // Major collections swept to the end.
+    size_t freedAtMark; // freed when the major collection in progress finished marking...
+    size_t minorFreedAtMark; // ...and minorFreed.
+    double growFactor; // The one in use, gcGrowFactor unless adaptive pacing changed it.
+    uint64_t runStart;
+    uint64_t cycleStart; // When the last major cycle ended, or the run began.
+    uint64_t gcNanosAtCycleStart; // pauses.totalNanos then.
+    uint64_t cycleNanos; // Pause time of the major cycle in progress.
+    size_t allocated; // Bytes allocated since the run began.
+    size_t allocatedAtCycleStart;
+    int emergencies; // Full collections run because the heap reached gcHeapLimit.
+} pacing = {.growFactor = GC_HEAP_GROW_FACTOR};
+
+// Set while visitReferences() or visitRoots() lists references instead of marking them.
+static struct {
+    void (*edge)(Obj *target, void *context);
+    void *context;
+} visitor;
+
+// Objects made permanent, for --gc-stats.
+static struct {
+    size_t objects;
+    size_t bytes;
+} permanent;
+
+static struct {
+    size_t objects;
+    size_t bytes;
+    int pages;
+} compaction;
+
+static uint64_t nowNanos() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/** Counts a collector pause that began at [start], and logs it for --gc-stats. */
+static void recordPause(PauseKind kind, uint64_t start) {
+    uint64_t nanos = nowNanos() - start;
+    pauses.kinds[kind]++;
+    pauses.totalNanos += nanos;
+    if (kind == PAUSE_MAJOR || kind == PAUSE_SLICE) pacing.cycleNanos += nanos;
+    int bucket = 0;
+    for (uint64_t micros = nanos / 1000; micros > 0 && bucket < GC_HISTOGRAM_BUCKETS - 1; micros >>= 1) bucket++;
+    pauses.histogram[bucket]++;
+    if (!gcStats) return;
+
+    if (pauses.capacity < pauses.count + 1) {
+        pauses.capacity = GROW_CAPACITY(pauses.capacity);
+        pauses.nanos = (uint64_t *) realloc(pauses.nanos, sizeof(uint64_t) * pauses.capacity);
+
+        if (pauses.nanos == NULL) exitOutOfMemory();
+    }
+
+    pauses.nanos[pauses.count++] = nanos;
+}
+
+/** Parses a byte count with an optional K, M or G suffix. Returns 0 if [text] is not one. */
+size_t parseGCSize(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return 0;
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024.0 * 1024 * 1024; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? (size_t) value : 0;
+}
+
+void readGCEnvironment() {
+    const char *value;
+    if ((value = getenv("GECCO_GC_INITIAL_HEAP")) != NULL && parseGCSize(value) > 0) gcInitialHeap = parseGCSize(value);
+    if ((value = getenv("GECCO_GC_MIN_HEAP")) != NULL) gcMinHeap = parseGCSize(value);
+    if ((value = getenv("GECCO_GC_MAX_HEAP")) != NULL) gcMaxHeap = parseGCSize(value);
+    if ((value = getenv("GECCO_GC_HEAP_LIMIT")) != NULL) gcHeapLimit = parseGCSize(value);
+    if ((value = getenv("GECCO_GC_GROW_FACTOR")) != NULL && atof(value) > 1) gcGrowFactor = atof(value);
+    if ((value = getenv("GECCO_GC_ADAPTIVE")) != NULL) gcAdaptive = atoi(value) != 0;
+    if ((value = getenv("GECCO_GC_MAX_PAUSE_US")) != NULL) gcMaxPauseUs = atoi(value);
+    if ((value = getenv("GECCO_GC_THREADS")) != NULL) gcThreads = atoi(value);
+    if ((value = getenv("GECCO_GC_COMPACT")) != NULL) gcCompact = atoi(value) != 0;
+    if ((value = getenv("GECCO_GC_STATS")) != NULL) gcStats = atoi(value) != 0;
+}
+
+/**
+ * The heap size at which the next major collection runs, with [live] bytes left by the
+ * last one: [live] grown by the factor, within gcMinHeap and gcMaxHeap. Above gcMaxHeap
+ * the heap may still grow by a quarter, so that collections keep freeing something.
+ */
+static size_t nextCollection(size_t live) {
+    double bytes = live * pacing.growFactor;
+    if (gcMaxHeap > 0 && bytes > gcMaxHeap) bytes = fmax((double) gcMaxHeap, live * 1.25);
+    if (bytes < gcMinHeap) bytes = gcMinHeap;
+    if (gcHeapLimit > 0 && bytes > gcHeapLimit) bytes = gcHeapLimit;
+    return (size_t) bytes;
+}
+
+void configureGC() {
+    pacing.growFactor = gcGrowFactor > 1 ? gcGrowFactor : GC_HEAP_GROW_FACTOR;
+    pacing.runStart = pacing.cycleStart = nowNanos();
+    pacing.gcNanosAtCycleStart = pauses.totalNanos;
+    pacing.allocatedAtCycleStart = pacing.allocated;
+    vm.nextGC = gcInitialHeap;
+    if (gcMaxHeap > 0 && vm.nextGC > gcMaxHeap) vm.nextGC = gcMaxHeap;
+    if (vm.nextGC < gcMinHeap) vm.nextGC = gcMinHeap;
+    if (gcHeapLimit > 0 && vm.nextGC > gcHeapLimit) vm.nextGC = gcHeapLimit;
+}
+
+static void collectSlice();
+
+#ifdef PARALLEL_MARK
+typedef struct DequeArray DequeArray;
+
+struct DequeArray {
+    int64_t capacity; // A power of two.
+    DequeArray *previous; // Outgrown, but thieves may still read it until the collection ends.
+    _Atomic(Obj *) objects[];
+};
+
+/**
+ * A Chase-Lev work-stealing deque of gray objects. Its worker pushes and takes at the
+ * bottom, the other workers steal from the top.
+ */
+typedef struct {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(DequeArray *) array;
+} Deque;
+
+typedef struct {
+    Deque deque;
+    int index;
+    thrd_t thread;
+} MarkWorker;
+
+static struct {
+    MarkWorker workers[GC_MAX_THREADS]; // The mutator thread is the first.
+    int helperCount; // Helper threads started, they never stop before freeObjects().
+    int count; // Workers marking in the current collection.
+    int finished; // Helpers done with the current collection.
+    int generation; // Counts the collections the helpers were woken for.
+    bool stopping;
+    atomic_int active; // Workers that may still have gray objects.
+    mtx_t lock;
+    cnd_t wake;
+    cnd_t done;
+} pool;
+
+static _Thread_local MarkWorker *currentWorker = nullptr;
+
+static DequeArray *newDequeArray(int64_t capacity) {
+    DequeArray *array = malloc(sizeof(DequeArray) + sizeof(_Atomic(Obj *)) * capacity);
+    if (array == NULL) exitOutOfMemory();
+    array->capacity = capacity;
+    array->previous = nullptr;
+    return array;
+}
+
+static void dequePush(Deque *deque, Obj *object) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top > array->capacity - 1) {
+        DequeArray *grown = newDequeArray(array->capacity * 2);
+        for (int64_t i = top; i < bottom; i++) {
+            Obj *moved = atomic_load_explicit(&array->objects[i & (array->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->objects[i & (grown->capacity - 1)], moved, memory_order_relaxed);
+        }
+        grown->previous = array;
+        atomic_store_explicit(&deque->array, grown, memory_order_release);
+        array = grown;
+    }
+    atomic_store_explicit(&array->objects[bottom & (array->capacity - 1)], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Obj *dequeTake(Deque *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Obj *object = atomic_load_explicit(&array->objects[bottom & (array->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // The last one: thieves may be after it too.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            object = nullptr;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+/** Takes the top object of another worker's deque, or NULL if it is empty or another thief won it. */
+static Obj *dequeSteal(Deque *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    Obj *object = atomic_load_explicit(&array->objects[top & (array->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return object;
+}
+
+static bool dequeEmpty(Deque *deque) {
+    return atomic_load_explicit(&deque->top, memory_order_acquire) >=
+           atomic_load_explicit(&deque->bottom, memory_order_acquire);
+}
+
+/** markObject() on a marking worker: whichever worker sets the mark bit first blackens the object. */
+static void markShared(Obj *object) {
+    uint64_t bit;
+    uint64_t *marks = &pageOf(object)->marks[bitmapWord(object, &bit)];
+    if (__atomic_load_n(marks, __ATOMIC_RELAXED) & bit) return;
+    if (object->isPermanent) return;
+    if (__atomic_fetch_or(marks, bit, __ATOMIC_RELAXED) & bit) return;
+    object->isOld = true;
+    dequePush(&currentWorker->deque, object);
+}
+#endif
+
+/** Counts [size] more bytes allocated and runs whatever collection is due. */
+static void allocated(size_t size) {
+    pacing.allocated += size;
+    vm.bytesAllocated += size;
+    vm.youngBytes += size;
+    vm.sliceBytes += size;
+    if (vm.bytesAllocated > vm.peakBytesAllocated) vm.peakBytesAllocated = vm.bytesAllocated;
+#ifdef DEBUG_STRESS_GC
+    // Alternates so that both kinds of collection run at every allocation site.
+    static bool major = false;
+    major = !major;
+    if (!major) {
+        collectYoung();
+    } else if (gcMaxPauseUs > 0) {
+        collectSlice();
+    } else {
+        collectGarbage();
+    }
+#endif
+
+    if (gcHeapLimit > 0 && vm.bytesAllocated > gcHeapLimit) {
+        if (vm.memoryExhausted) return;
+        pacing.emergencies++;
+        collectGarbage();
+        vm.memoryExhausted = vm.bytesAllocated > gcHeapLimit - gcHeapLimit / GC_LIMIT_HEADROOM;
+        return;
+    }
+
+    if (vm.gcPhase != GC_IDLE && vm.bytesAllocated > vm.nextGC * pacing.growFactor) {
+        // The mutator is outrunning the slices: finish the collection in one pause.
+        collectGarbage();
+    } else if (vm.gcPhase != GC_IDLE && vm.sliceBytes > GC_SLICE_SIZE) {
+        collectSlice();
+    } else if (vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC) {
+        if (gcMaxPauseUs > 0) {
+            collectSlice();
+        } else {
+            collectGarbage();
+        }
+    } else if (vm.youngBytes > GC_NURSERY_SIZE) {
+        collectYoung();
+    }
+}
 
 /**
  * Reallocates a memory assignment.
@@ -24,15 +442,10 @@
  * @return the result
  */
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
-#endif
-
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
+        allocated(newSize - oldSize);
+    } else {
+        vm.bytesAllocated -= oldSize - newSize;
     }
 
     if (newSize == 0) {
@@ -41,13 +454,88 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     }
 
     void *result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+    if (result == NULL) {
+        // The system is out of memory before the heap limit: free what can be freed and retry.
+        collectGarbage();
+        result = realloc(pointer, newSize);
+    }
+    if (result == NULL) exitOutOfMemory();
     return result;
 }
 
+void exitOutOfMemory() {
+    fprintf(stderr, "Out of memory.\n");
+    exit(exit_status(OUT_OF_MEMORY));
+}
+
+Obj *allocateSlot(size_t size) {
+    allocated(heapSlotSize(size));
+
+    // Room to list the object is made first, while a collection cannot yet free it.
+    if (vm.youngCapacity < vm.youngCount + 1) {
+        int capacity = GROW_CAPACITY(vm.youngCapacity);
+        Obj **youngObjects = (Obj **) realloc(vm.youngObjects, sizeof(Obj *) * capacity);
+        if (youngObjects == NULL) {
+            collectGarbage();
+            youngObjects = (Obj **) realloc(vm.youngObjects, sizeof(Obj *) * capacity);
+        }
+        if (youngObjects == NULL) exitOutOfMemory();
+        vm.youngObjects = youngObjects;
+        vm.youngCapacity = capacity;
+    }
+
+    Obj *object = heapAllocate(size);
+    if (object == NULL) {
+        // No page could be mapped: collecting may free whole pages to reuse.
+        collectGarbage();
+        object = heapAllocate(size);
+    }
+    if (object == NULL) exitOutOfMemory();
+    return object;
+}
+
+void addYoungObject(Obj *object) {
+    vm.youngObjects[vm.youngCount++] = object;
+}
+
+void countFreed(size_t bytes) {
+    vm.bytesAllocated -= bytes;
+    pacing.freed += bytes;
+}
+
+static void freeSlot(Obj *object) {
+    countFreed(pageOf(object)->slotSize);
+    heapFree(object);
+}
+
+static void pushGray(Obj *object) {
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj **) realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+
+        if (vm.grayStack == NULL) exitOutOfMemory();
+    }
+
+    vm.grayStack[vm.grayCount++] = object;
+}
+
 void markObject(Obj *object) {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (visitor.edge != NULL) {
+        visitor.edge(object, visitor.context);
+        return;
+    }
+#ifdef PARALLEL_MARK
+    if (currentWorker != NULL) {
+        markShared(object);
+        return;
+    }
+#endif
+    // A minor collection does not trace the old generation, it is live by assumption.
+    // Such objects' mark bits are left alone: the background sweeper may be clearing them.
+    if (vm.collectingYoung && object->isOld) return;
+    if (object->isPermanent) return;
+    if (isMarked(object)) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
@@ -55,20 +543,42 @@ void markObject(Obj *object) {
   printf("\n");
 #endif
 
-    object->isMarked = true;
+    setMarked(object, true);
+    // Major collections promote what they mark.
+    if (vm.gcPhase == GC_MARK) object->isOld = true;
+    pushGray(object);
+}
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj **) realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+/** Whether the collection in progress keeps [object], for clearing weak references. */
+bool isReachable(Obj *object) {
+    return (vm.collectingYoung && object->isOld) || object->isPermanent || isMarked(object);
+}
 
-        if (vm.grayStack == NULL) exit(1);
+void rememberObject(Obj *object) {
+    // Already blackened objects are traced again for what they gained.
+    if (vm.gcPhase == GC_MARK && isMarked(object)) pushGray(object);
+    if (!object->isOld || object->isRemembered) return;
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj **) realloc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exitOutOfMemory();
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm.remembered[vm.rememberedCount++] = object;
 }
 
-void markValue(Value value) {
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+static void forgetRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
 }
 
 static void markArray(ValueArray *array) {
@@ -77,6 +587,20 @@ static void markArray(ValueArray *array) {
     }
 }
 
+/** Marks what a function's inline caches and traces hold, which changes as it runs. */
+static void markFunctionCaches(ObjFunction *function) {
+    for (int i = 0; i < function->chunk.cacheCount; i++) {
+        InlineCache *cache = &function->chunk.caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            markObject(cache->entries[j].key);
+            markObject(cache->entries[j].target);
+        }
+    }
+#ifdef BASELINE_JIT
+    traceMark(function);
+#endif
+}
+
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
@@ -88,20 +612,21 @@ static void blackenObject(Obj *object) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod *) object;
             markValue(bound->receiver);
-            markObject((Obj *) bound->method);
+            markObject(FROM_REF(Obj, bound->method));
             break;
         }
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *) object;
             markObject((Obj *) klass->name);
             markTable(&klass->methods);
+            markObject((Obj *) klass->rootShape);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
-            markObject((Obj *) closure->function);
+            markObject(FROM_REF(Obj, closure->function));
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj *) closure->upvalues[i]);
+                markObject(FROM_REF(Obj, closure->upvalues[i]));
             }
             break;
         }
@@ -109,12 +634,28 @@ static void blackenObject(Obj *object) {
             ObjFunction *function = (ObjFunction *) object;
             markObject((Obj *) function->name);
             markArray(&function->chunk.constants);
+            markFunctionCaches(function);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
-            markObject((Obj *) instance->klass);
-            markTable(&instance->fields);
+            markObject(FROM_REF(Obj, instance->klass));
+            if (instance->shape == NULL_REF) {
+                markTable(instance->dictionary);
+                break;
+            }
+            ObjShape *shape = FROM_REF(ObjShape, instance->shape);
+            markObject((Obj *) shape);
+            for (int i = 0; i < shape->fieldCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            markObject((Obj *) shape->parent);
+            markObject((Obj *) shape->name);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
@@ -126,56 +667,91 @@ static void blackenObject(Obj *object) {
     }
 }
 
-static void freeObject(Obj *object) {
+void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
     switch (object->type) {
         case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+            freeSlot(object);
             break;
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *) object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeSlot(object);
             break;
         } // [braces]
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
-            FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(REF(ObjUpvalue), closure->upvalues, closure->upvalueCount);
+            freeSlot(object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+#ifdef BASELINE_JIT
+            if (function->jit != NULL) jitFree(function->jit);
+            traceFree(function);
+#endif
+            freeSlot(object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->shape == NULL_REF) {
+                freeTable(instance->dictionary);
+                FREE(Table, instance->dictionary);
+            } else if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(Value, instance->fields, instance->capacity);
+            }
+            freeSlot(object);
             break;
         }
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            freeSlot(object);
             break;
-        case OBJ_STRING: {
-            ObjString *string = (ObjString *) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_SHAPE:
+            freeTable(&((ObjShape *) object)->transitions);
+            freeSlot(object);
+            break;
+        case OBJ_STRING:
+            freeSlot(object);
             break;
-        }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            freeSlot(object);
             break;
     }
 }
 
+bool freesOnlySlot(Obj *object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_UPVALUE:
+            return true;
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *) object;
+            return instance->shape != NULL_REF && instance->fields == instance->inlineFields;
+        }
+        default:
+            return false;
+    }
+}
+
 static void markRoots() {
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    Value *stackTop = vm.stackTop;
+#ifdef GECCO_REGISTER_VM
+    // A call out of register code leaves the caller's registers above the
+    // callee's stack top. Keep marking them so they are still valid on return.
+    for (int i = 0; i < vm.frameCount; i++) {
+        Value *frameTop = vm.frames[i].slots + FROM_REF(ObjFunction, vm.frames[i].closure->function)->frameSize;
+        if (frameTop > stackTop) stackTop = frameTop;
+    }
+#endif
+    for (Value *slot = vm.stack; slot < stackTop; slot++) {
         markValue(*slot);
     }
 
@@ -185,72 +761,699 @@ static void markRoots() {
 
     for (ObjUpvalue *upvalue = vm.openUpvalues;
          upvalue != NULL;
-         upvalue = upvalue->next) {
+         upvalue = FROM_REF(ObjUpvalue, upvalue->next)) {
         markObject((Obj *) upvalue);
     }
 
+    for (int i = 0; i < vm.globalCount; i++) {
+        markObject((Obj *) vm.globalSlots[i].name);
+        markValue(vm.globalSlots[i].value);
+    }
     markTable(&vm.globals);
     markCompilerRoots();
     markObject((Obj *) vm.initString);
+
+    markObject((Obj *) vm.currentModule);
+    for (int i = 0; i < vm.moduleRegistry.count; i++) {
+        markObject((Obj *) vm.moduleRegistry.modules[i].name);
+        markTable(&vm.moduleRegistry.modules[i].exports);
+    }
+    markTable(&vm.moduleRegistry.moduleNames);
+
+    // Minor collections see what permanent functions gained through the remembered set.
+    if (!vm.collectingYoung) {
+        for (int i = 0; i < vm.permanentCount; i++) markFunctionCaches(vm.permanent[i]);
+    }
+}
+
+void visitReferences(Obj *object, void (*edge)(Obj *target, void *context), void *context) {
+    visitor.edge = edge;
+    visitor.context = context;
+    blackenObject(object);
+    visitor.edge = NULL;
+}
+
+void visitRoots(void (*edge)(Obj *target, void *context), void *context) {
+    visitor.edge = edge;
+    visitor.context = context;
+    markRoots();
+    visitor.edge = NULL;
 }
 
+#ifdef PARALLEL_MARK
+static Obj *stealWork(MarkWorker *worker) {
+    for (int i = 1; i < pool.count; i++) {
+        Obj *object = dequeSteal(&pool.workers[(worker->index + i) % pool.count].deque);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool anyWork() {
+    for (int i = 0; i < pool.count; i++) {
+        if (!dequeEmpty(&pool.workers[i].deque)) return true;
+    }
+    return false;
+}
+
+/** Blackens objects from [worker]'s deque, and stolen ones, until no worker has any left. */
+static void markWorker(MarkWorker *worker) {
+    currentWorker = worker;
+    for (;;) {
+        Obj *object;
+        while ((object = dequeTake(&worker->deque)) != NULL) blackenObject(object);
+        object = stealWork(worker);
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
+        }
+
+        // An idle worker's deque stays empty, so the last one to go idle ends the marking.
+        atomic_fetch_sub(&pool.active, 1);
+        while (atomic_load(&pool.active) > 0 && !anyWork()) thrd_yield();
+        if (atomic_load(&pool.active) == 0) break;
+        atomic_fetch_add(&pool.active, 1);
+    }
+    currentWorker = nullptr;
+}
+
+static int helperMain(void *argument) {
+    MarkWorker *worker = argument;
+    int generation = 0;
+    mtx_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == generation && !pool.stopping) cnd_wait(&pool.wake, &pool.lock);
+        if (pool.stopping) break;
+        generation = pool.generation;
+        bool joins = worker->index < pool.count;
+        mtx_unlock(&pool.lock);
+
+        if (joins) markWorker(worker);
+
+        mtx_lock(&pool.lock);
+        if (joins && ++pool.finished == pool.count - 1) cnd_signal(&pool.done);
+    }
+    mtx_unlock(&pool.lock);
+    return 0;
+}
+
+/** Starts helper threads up to gcThreads, returns how many workers there are to mark with. */
+static int startHelpers() {
+    int wanted = gcThreads < GC_MAX_THREADS ? gcThreads : GC_MAX_THREADS;
+    if (pool.helperCount == 0 && wanted > 1) {
+        if (mtx_init(&pool.lock, mtx_plain) != thrd_success || cnd_init(&pool.wake) != thrd_success ||
+            cnd_init(&pool.done) != thrd_success) {
+            return 1;
+        }
+        pool.workers[0].index = 0;
+    }
+
+    while (pool.helperCount + 1 < wanted) {
+        MarkWorker *worker = &pool.workers[pool.helperCount + 1];
+        worker->index = pool.helperCount + 1;
+        if (thrd_create(&worker->thread, helperMain, worker) != thrd_success) break;
+        pool.helperCount++;
+    }
+    return pool.helperCount + 1 < wanted ? pool.helperCount + 1 : wanted;
+}
+
+/** Marks everything reachable from the gray stack with the mutator thread and the helpers. */
+static void traceParallel(int count) {
+    for (int i = 0; i < count; i++) {
+        Deque *deque = &pool.workers[i].deque;
+        if (atomic_load(&deque->array) == NULL) atomic_store(&deque->array, newDequeArray(1024));
+        atomic_store(&deque->top, 0);
+        atomic_store(&deque->bottom, 0);
+    }
+
+    MarkWorker *mutator = &pool.workers[0];
+    while (vm.grayCount > 0) dequePush(&mutator->deque, vm.grayStack[--vm.grayCount]);
+
+    mtx_lock(&pool.lock);
+    pool.count = count;
+    pool.finished = 0;
+    atomic_store(&pool.active, count);
+    pool.generation++;
+    cnd_broadcast(&pool.wake);
+    mtx_unlock(&pool.lock);
+
+    markWorker(mutator);
+
+    mtx_lock(&pool.lock);
+    while (pool.finished < pool.count - 1) cnd_wait(&pool.done, &pool.lock);
+    mtx_unlock(&pool.lock);
+
+    for (int i = 0; i < count; i++) {
+        DequeArray *array = atomic_load(&pool.workers[i].deque.array);
+        while (array->previous != NULL) {
+            DequeArray *previous = array->previous;
+            array->previous = previous->previous;
+            free(previous);
+        }
+    }
+}
+
+static void stopHelpers() {
+    if (pool.helperCount > 0) {
+        mtx_lock(&pool.lock);
+        pool.stopping = true;
+        cnd_broadcast(&pool.wake);
+        mtx_unlock(&pool.lock);
+        for (int i = 1; i <= pool.helperCount; i++) thrd_join(pool.workers[i].thread, NULL);
+        mtx_destroy(&pool.lock);
+        cnd_destroy(&pool.wake);
+        cnd_destroy(&pool.done);
+    }
+    for (int i = 0; i < GC_MAX_THREADS; i++) free(atomic_load(&pool.workers[i].deque.array));
+}
+#endif
+
 static void traceReferences() {
+#ifdef PARALLEL_MARK
+    int work = 0;
+#endif
     while (vm.grayCount > 0) {
         Obj *object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
+#ifdef PARALLEL_MARK
+        // A major collection with much left to mark shares it with the helper threads.
+        if (++work == GC_PARALLEL_THRESHOLD && gcThreads > 1 && !vm.collectingYoung && vm.grayCount > 0) {
+            int count = startHelpers();
+            if (count > 1) traceParallel(count);
+        }
+#endif
     }
 }
 
-static void sweep() {
-    Obj *previous = nullptr;
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            //> unmark
-            object->isMarked = false;
-            //< unmark
-            previous = object;
-            object = object->next;
-        } else {
-            Obj *unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+/** Blackens gray objects until none are left or [deadline] has passed. Returns whether none are left. */
+static bool traceSlice(uint64_t deadline) {
+    int work = 0;
+    while (vm.grayCount > 0) {
+        Obj *object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+        if (++work % GC_SLICE_CHECK == 0 && nowNanos() > deadline) return false;
+    }
+    return true;
+}
 
-            freeObject(unreached);
+/** Sweeps pages until none are left to sweep or [deadline] has passed. Returns whether none are left. */
+static bool sweepSlice(uint64_t deadline) {
+    while (heapSweepPage()) {
+        if (nowNanos() > deadline) return false;
+    }
+    return true;
+}
+
+/** Frees the unreached young objects and promotes the others into the old generation. */
+static void sweepYoung() {
+    for (int i = 0; i < vm.youngCount; i++) {
+        Obj *object = vm.youngObjects[i];
+        if (isMarked(object)) {
+            setMarked(object, false);
+            object->isOld = true;
+        } else if (!object->isPermanent) {
+            freeObject(object);
         }
     }
+    vm.youngCount = 0;
+    vm.youngBytes = 0;
 }
 
-void collectGarbage() {
+/** A minor collection: reclaims young objects without tracing the old generation. */
+void collectYoung() {
+    // The young objects are left to the major collection that is marking.
+    if (vm.gcPhase == GC_MARK) return;
+
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  printf("-- minor gc begin\n");
   size_t before = vm.bytesAllocated;
 #endif
+    uint64_t start = nowNanos();
+    size_t freed = pacing.freed;
 
+    vm.collectingYoung = true;
     markRoots();
+    // Remembered objects may hold the only references to some young objects.
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.remembered[i]);
+    }
+    forgetRemembered();
     traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    stringSetRemoveWhite(&vm.strings);
+    vm.collectingYoung = false;
+    // Every survivor is promoted, so no old object references a young one afterwards.
+    sweepYoung();
+    pacing.minorFreed += pacing.freed - freed;
+
+    recordPause(PAUSE_MINOR, start);
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n", before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+static void beginMark() {
+    vm.gcPhase = GC_MARK;
+    markRoots();
+}
+
+/** Ends marking with a rescan of the roots and leaves every page to be swept. */
+static void finishMark() {
+    markRoots();
+    traceReferences();
+    stringSetRemoveWhite(&vm.strings);
+    // Every young object that was marked is old now, the others are swept with the old generation.
+    forgetRemembered();
+    vm.youngCount = 0;
+    vm.youngBytes = 0;
+    heapStartSweep(gcThreads > 1);
+    vm.gcPhase = GC_SWEEP;
+    pacing.freedAtMark = pacing.freed;
+    pacing.minorFreedAtMark = pacing.minorFreed;
+}
+
+/** Sets the growth factor for the next major cycle from what the last one cost. */
+static void pace(uint64_t now) {
+    if (!gcAdaptive) return;
+    uint64_t cycleNanos = now - pacing.cycleStart;
+    uint64_t gcNanos = pauses.totalNanos - pacing.gcNanosAtCycleStart;
+    if (gcNanos > cycleNanos) gcNanos = cycleNanos;
+    uint64_t mutatorNanos = cycleNanos - gcNanos;
+    size_t allocated = pacing.allocated - pacing.allocatedAtCycleStart;
+    if (vm.bytesAllocated == 0 || mutatorNanos == 0) return;
+
+    // Bytes per second of mutator time, and seconds of collection per cycle.
+    double rate = allocated * 1e9 / mutatorNanos;
+    double cost = pacing.cycleNanos / 1e9;
+    double factor = 1 + cost * rate * (1 - GC_TARGET_OVERHEAD) /
+                        (GC_TARGET_OVERHEAD * (double) vm.bytesAllocated);
+    // Averaged with the last factor, so that one unusual cycle does not swing the heap size.
+    factor = (factor + pacing.growFactor) / 2;
+    pacing.growFactor = fmin(fmax(factor, GC_MIN_GROW_FACTOR), GC_MAX_GROW_FACTOR);
+}
+
+static void finishSweep() {
+    vm.gcPhase = GC_IDLE;
+    size_t freed = (pacing.freed - pacing.freedAtMark) - (pacing.minorFreed - pacing.minorFreedAtMark);
+    pacing.majorFreed += freed;
+    if (freed > pacing.maxMajorFreed) pacing.maxMajorFreed = freed;
+    pacing.majorCycles++;
+
+    uint64_t now = nowNanos();
+    pace(now);
+    pacing.cycleStart = now;
+    pacing.gcNanosAtCycleStart = pauses.totalNanos;
+    pacing.allocatedAtCycleStart = pacing.allocated;
+    pacing.cycleNanos = 0;
+    vm.nextGC = nextCollection(vm.bytesAllocated);
+    if (!gcCompact) return;
+
+#ifdef DEBUG_STRESS_GC
+    vm.compactDue = true;
+#else
+    HeapUsage usage = heapUsage();
+    vm.compactDue = usage.pageBytes >= GC_COMPACT_MIN_HEAP &&
+                    usage.liveBytes < usage.pageBytes * (1 - GC_COMPACT_FRAGMENTATION);
+#endif
+}
+
+/**
+ * Runs the next slice of a major collection: marking in an incremental one, beginning it
+ * if none is running, or sweeping the pages allocation has not swept yet.
+ */
+static void collectSlice() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc slice begin\n");
+#endif
+    uint64_t start = nowNanos();
+    uint64_t deadline = start + (uint64_t) (gcMaxPauseUs > 0 ? gcMaxPauseUs : GC_SWEEP_SLICE_US) * 1000;
+    vm.sliceBytes = 0;
+
+    if (vm.gcPhase == GC_IDLE) beginMark();
+    if (vm.gcPhase == GC_MARK) {
+        // Rescanning the roots here leaves finishMark() only what the mutator did since.
+        if (traceSlice(deadline)) {
+            markRoots();
+            if (traceSlice(deadline)) finishMark();
+        }
+    } else if (sweepSlice(deadline)) {
+        finishSweep();
+    }
+
+    recordPause(PAUSE_SLICE, start);
+#ifdef DEBUG_LOG_GC
+  printf("-- gc slice end\n");
+#endif
+}
 
+/**
+ * Marks the heap in one pause: finishes the marking in progress, or runs a whole major
+ * collection after sweeping what the last one left. Its pages are swept lazily.
+ */
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+    uint64_t start = nowNanos();
+
+    if (vm.gcPhase == GC_SWEEP) {
+        sweepSlice(UINT64_MAX);
+        finishSweep();
+    }
+    if (vm.gcPhase == GC_IDLE) beginMark();
+    finishMark();
+
+    recordPause(PAUSE_MAJOR, start);
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
-void freeObjects() {
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        Obj *next = object->next;
-        freeObject(object);
-        object = next;
+// Where an evacuated object was copied to, kept in the first word after its header.
+// Every object has room for it: the smallest slot is 16 bytes.
+#define FORWARDED(object) (((Obj **) (object))[1])
+
+/** The address of [object] after heapEvacuate(). */
+static inline Obj *forward(Obj *object) {
+    return object != NULL && pageOf(object)->evacuating ? FORWARDED(object) : object;
+}
+
+#define FORWARD(pointer) ((pointer) = (void *) forward((Obj *) (pointer)))
+#define FORWARD_REF(ref) ((ref) = TO_REF(forward(FROM_REF(Obj, ref))))
+
+static void forwardValue(Value *value) {
+    if (IS_OBJ(*value)) *value = OBJ_VAL(forward(AS_OBJ(*value)));
+}
+
+static void forwardStringSet(StringSet *set) {
+    for (int i = 0; i < set->capacity; i++) {
+        if (STRING_SET_FULL(set, i)) FORWARD_REF(set->entries[i].string);
+    }
+}
+
+static void forwardTable(Table *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (!TABLE_FULL(table, i)) continue;
+        FORWARD_REF(table->keys[i]);
+        forwardValue(&table->values[i]);
     }
+}
+
+/** Fixes the pointers an object has into itself once heapEvacuate() has copied it, and forwards it. */
+static void relocated(Obj *from, Obj *to) {
+    if (from->type == OBJ_INSTANCE) {
+        ObjInstance *instance = (ObjInstance *) from;
+        if (instance->fields == instance->inlineFields) ((ObjInstance *) to)->fields = ((ObjInstance *) to)->inlineFields;
+    } else if (from->type == OBJ_UPVALUE) {
+        ObjUpvalue *upvalue = (ObjUpvalue *) from;
+        if (upvalue->location == &upvalue->closed) ((ObjUpvalue *) to)->location = &((ObjUpvalue *) to)->closed;
+    }
+    FORWARDED(from) = to;
+    compaction.objects++;
+    compaction.bytes += pageOf(from)->slotSize;
+}
+
+/** Rewrites the references [object] holds to moved objects. */
+static void forwardObject(Obj *object, void *context) {
+    (void) context;
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod *bound = (ObjBoundMethod *) object;
+            forwardValue(&bound->receiver);
+            FORWARD_REF(bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass *klass = (ObjClass *) object;
+            FORWARD(klass->name);
+            forwardTable(&klass->methods);
+            FORWARD(klass->rootShape);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *) object;
+            FORWARD_REF(closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                FORWARD_REF(closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *) object;
+            FORWARD(function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                forwardValue(&function->chunk.constants.values[i]);
+            }
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache *cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    FORWARD(cache->entries[j].key);
+                    FORWARD(cache->entries[j].target);
+                }
+            }
+#ifdef BASELINE_JIT
+            if (function->jit != NULL) {
+                jitFree(function->jit);
+                function->jit = nullptr;
+                function->hotness = 0;
+            }
+            traceFree(function);
+#endif
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *) object;
+            FORWARD_REF(instance->klass);
+            if (instance->shape == NULL_REF) {
+                forwardTable(instance->dictionary);
+                break;
+            }
+            FORWARD_REF(instance->shape);
+            for (int i = 0; i < FROM_REF(ObjShape, instance->shape)->fieldCount; i++) {
+                forwardValue(&instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            FORWARD(shape->parent);
+            FORWARD(shape->name);
+            forwardTable(&shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE:
+            // Only open upvalues have a meaningful next, forwardRoots() follows their list.
+            forwardValue(&((ObjUpvalue *) object)->closed);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+/** Rewrites the references markRoots() marks, and the collector's own lists. */
+static void forwardRoots() {
+    for (int i = 0; i < vm.frameCount; i++) {
+        FORWARD(vm.frames[i].closure);
+    }
+
+    Value *stackTop = vm.stackTop;
+#ifdef GECCO_REGISTER_VM
+    for (int i = 0; i < vm.frameCount; i++) {
+        Value *frameTop = vm.frames[i].slots + FROM_REF(ObjFunction, vm.frames[i].closure->function)->frameSize;
+        if (frameTop > stackTop) stackTop = frameTop;
+    }
+#endif
+    for (Value *slot = vm.stack; slot < stackTop; slot++) {
+        forwardValue(slot);
+    }
+
+    FORWARD(vm.openUpvalues);
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = FROM_REF(ObjUpvalue, upvalue->next)) {
+        FORWARD_REF(upvalue->next);
+    }
+
+    for (int i = 0; i < vm.globalCount; i++) {
+        FORWARD(vm.globalSlots[i].name);
+        forwardValue(&vm.globalSlots[i].value);
+    }
+    forwardTable(&vm.globals);
+    forwardStringSet(&vm.strings);
+    FORWARD(vm.initString);
+
+    FORWARD(vm.currentModule);
+    for (int i = 0; i < vm.moduleRegistry.count; i++) {
+        FORWARD(vm.moduleRegistry.modules[i].name);
+        forwardTable(&vm.moduleRegistry.modules[i].exports);
+    }
+    forwardTable(&vm.moduleRegistry.moduleNames);
+
+    for (int i = 0; i < vm.youngCount; i++) {
+        FORWARD(vm.youngObjects[i]);
+    }
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        FORWARD(vm.remembered[i]);
+    }
+    for (int i = 0; i < vm.permanentCount; i++) {
+        FORWARD(vm.permanent[i]);
+    }
+}
+
+static void makeObjectPermanent(Obj *object) {
+    if (object->isPermanent) return;
+    object->isPermanent = true;
+    // Old, so that the write barrier remembers it when it gains a young reference.
+    object->isOld = true;
+    permanent.objects++;
+    permanent.bytes += pageOf(object)->slotSize;
+}
+
+static void makeFunctionPermanent(ObjFunction *function) {
+    if (function->obj.isPermanent) return;
+    makeObjectPermanent((Obj *) function);
+    if (function->name != NULL) makeObjectPermanent((Obj *) function->name);
+    for (int i = 0; i < function->chunk.constants.count; i++) {
+        Value constant = function->chunk.constants.values[i];
+        if (IS_STRING(constant)) makeObjectPermanent(AS_OBJ(constant));
+        if (IS_FUNCTION(constant)) makeFunctionPermanent(AS_FUNCTION(constant));
+    }
+
+    if (vm.permanentCapacity < vm.permanentCount + 1) {
+        vm.permanentCapacity = GROW_CAPACITY(vm.permanentCapacity);
+        vm.permanent = (ObjFunction **) realloc(vm.permanent, sizeof(ObjFunction *) * vm.permanentCapacity);
+
+        if (vm.permanent == NULL) exitOutOfMemory();
+    }
+    vm.permanent[vm.permanentCount++] = function;
+}
+
+void makePermanent(ObjFunction *script) {
+    for (int i = 0; i < script->chunk.constants.count; i++) {
+        Value constant = script->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) makeFunctionPermanent(AS_FUNCTION(constant));
+    }
+}
+
+void compactHeap() {
+    vm.compactDue = false;
+    // Pages are only measured and moved between collections, once everything is swept.
+    if (vm.gcPhase != GC_IDLE || vm.isImporting) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compact begin\n");
+#endif
+    uint64_t start = nowNanos();
+
+    int pages = heapEvacuate(relocated);
+    if (pages > 0) {
+        // Objects in the new pages point to the old copies until they are visited too.
+        forwardRoots();
+        heapVisit(forwardObject, NULL);
+        heapReleaseEvacuated();
+        compaction.pages += pages;
+    }
+
+    recordPause(PAUSE_COMPACT, start);
+#ifdef DEBUG_LOG_GC
+  printf("-- compact end\n");
+  printf("   released %d pages\n", pages);
+#endif
+}
+
+static int compareNanos(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+    return (left > right) - (left < right);
+}
+
+static double percentileMicros(double fraction) {
+    int index = (int) (fraction * pauses.count + 0.999999) - 1;
+    if (index < 0) index = 0;
+    return pauses.nanos[index] / 1000.0;
+}
+
+typedef struct {
+    int count[OBJ_TYPE_COUNT];
+    size_t bytes[OBJ_TYPE_COUNT];
+} TypeTally;
+
+static void tallyObject(Obj *object, void *context) {
+    TypeTally *tally = context;
+    tally->count[object->type]++;
+    tally->bytes[object->type] += pageOf(object)->slotSize;
+}
+
+void printGCStats() {
+    // Without a pause budget, the only slices are the lazy sweep after a major collection.
+    if (gcMaxPauseUs > 0) {
+        fprintf(stderr, "GC: %d minor, %d major and %d incremental pauses, %.3f ms in total, max pause budget %d us\n",
+                pauses.kinds[PAUSE_MINOR], pauses.kinds[PAUSE_MAJOR], pauses.kinds[PAUSE_SLICE],
+                pauses.totalNanos / 1e6, gcMaxPauseUs);
+    } else {
+        fprintf(stderr, "GC: %d minor, %d major and %d sweep pauses, %.3f ms in total\n",
+                pauses.kinds[PAUSE_MINOR], pauses.kinds[PAUSE_MAJOR], pauses.kinds[PAUSE_SLICE],
+                pauses.totalNanos / 1e6);
+    }
+    fprintf(stderr, "GC freed: %zu KB by minor collections, %zu KB by %d major cycles (avg %zu KB, max %zu KB)\n",
+            pacing.minorFreed / 1024, pacing.majorFreed / 1024, pacing.majorCycles,
+            pacing.majorCycles > 0 ? pacing.majorFreed / pacing.majorCycles / 1024 : 0, pacing.maxMajorFreed / 1024);
+    uint64_t runNanos = nowNanos() - pacing.runStart;
+    double mutatorSeconds = (runNanos > pauses.totalNanos ? runNanos - pauses.totalNanos : 1) / 1e9;
+    fprintf(stderr, "GC pacing: %zu KB allocated at %.1f MB/s, %.1f%% of the run collecting, grow factor %.2f%s, "
+            "next major at %zu KB\n", pacing.allocated / 1024, pacing.allocated / mutatorSeconds / (1024 * 1024),
+            runNanos > 0 ? pauses.totalNanos * 100.0 / runNanos : 0, pacing.growFactor,
+            gcAdaptive ? " (adaptive)" : "", vm.nextGC / 1024);
+
+    fprintf(stderr, "GC pause histogram:");
+    for (int i = 0; i < GC_HISTOGRAM_BUCKETS; i++) {
+        if (pauses.histogram[i] == 0) continue;
+        if (i == 0) {
+            fprintf(stderr, " <1us %llu", (unsigned long long) pauses.histogram[i]);
+        } else {
+            fprintf(stderr, " <%lluus %llu", 1ull << i, (unsigned long long) pauses.histogram[i]);
+        }
+    }
+    fprintf(stderr, "\n");
+
+    // Objects still in the heap, unreached ones included until their pages are swept.
+    TypeTally tally = {{0}, {0}};
+    heapVisit(tallyObject, &tally);
+    fprintf(stderr, "GC heap:");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        if (tally.count[i] > 0) fprintf(stderr, " %s %d (%zu KB),", typeNames[i], tally.count[i], tally.bytes[i] / 1024);
+    }
+    fprintf(stderr, " %zu KB allocated\n", vm.bytesAllocated / 1024);
+    fprintf(stderr, "GC memory: peak %zu KB", vm.peakBytesAllocated / 1024);
+    if (gcHeapLimit > 0) {
+        fprintf(stderr, " of a %zu KB limit, %d emergency collections", gcHeapLimit / 1024, pacing.emergencies);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "GC permanent: %d functions, %zu objects (%zu KB) never traced\n", vm.permanentCount,
+            permanent.objects, permanent.bytes / 1024);
+    if (gcCompact) {
+        fprintf(stderr, "GC compaction: %d runs moved %zu objects (%zu KB) and released %d pages (%d KB)\n",
+                pauses.kinds[PAUSE_COMPACT], compaction.objects, compaction.bytes / 1024, compaction.pages,
+                compaction.pages * (HEAP_PAGE_SIZE / 1024));
+    }
+    if (pauses.count == 0) return;
+
+    qsort(pauses.nanos, pauses.count, sizeof(uint64_t), compareNanos);
+    fprintf(stderr, "GC pauses (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", percentileMicros(0.5),
+            percentileMicros(0.9), percentileMicros(0.99), percentileMicros(0.999), percentileMicros(1.0));
+}
+
+void freeObjects() {
+    heapFreeAll();
 
     free(vm.grayStack);
+    free(vm.remembered);
+    free(vm.youngObjects);
+    free(vm.permanent);
+    free(pauses.nanos);
+#ifdef PARALLEL_MARK
+    stopHelpers();
+#endif
 }
 
@@ -6,6 +6,8 @@
 #define memory_h
 
 #include "../object.h"
+#include "../geccovm/vm.h"
+#include "heap.h"
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -17,10 +19,82 @@
 
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Longest a slice of an incremental major collection may run, 0 for stop-the-world collections.
+extern int gcMaxPauseUs;
+// Threads that mark in a major collection, the mutator thread included.
+extern int gcThreads;
+extern bool gcStats;
+// Whether fragmented heaps are compacted, see compactHeap().
+extern bool gcCompact;
+// Heap size, in bytes, at which the first major collection runs.
+extern size_t gcInitialHeap;
+// Bounds on the heap size a major collection leaves for the next, gcMaxHeap 0 for none.
+extern size_t gcMinHeap;
+extern size_t gcMaxHeap;
+// Hard cap on the heap, 0 for none: a script that needs more fails with a runtime error.
+extern size_t gcHeapLimit;
+// How much the heap may grow between major collections, unless gcAdaptive paces them.
+extern double gcGrowFactor;
+extern bool gcAdaptive;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+/** Reports that the system has no memory left and exits with OUT_OF_MEMORY. */
+void exitOutOfMemory();
+/** Allocates the memory of a new object, of [size] bytes, from the heap, collecting once if it is full. */
+Obj *allocateSlot(size_t size);
+/** Lists a newly allocated [object] in vm.youngObjects, which allocateSlot() made room in. */
+void addYoungObject(Obj *object);
+void freeObject(Obj *object);
+/** Whether freeing [object] only gives back its slot, so that another thread may do it. */
+bool freesOnlySlot(Obj *object);
+/** Counts [bytes] of objects freed without freeObject(), by the background sweeper. */
+void countFreed(size_t bytes);
 void markObject(Obj * object);
 void markValue(Value value);
+bool isReachable(Obj *object);
+void rememberObject(Obj *object);
 void collectGarbage();
+void collectYoung();
 void freeObjects();
+/**
+ * Moves the objects of sparse pages together and releases the emptied pages. Only safe
+ * where no C code holds object pointers across the call: the interpreter runs it at a
+ * loop back edge of the outermost run() once vm.compactDue is set.
+ */
+void compactHeap();
+/**
+ * Makes the functions a script declares, however deeply, permanent along with their
+ * names and constants. The script itself runs once and is left to the collector.
+ */
+void makePermanent(ObjFunction *script);
+/** Calls [edge] with each object [object] references, as marking traces them. */
+void visitReferences(Obj *object, void (*edge)(Obj *target, void *context), void *context);
+/** Calls [edge] with each object the roots reference, as marking finds them. */
+void visitRoots(void (*edge)(Obj *target, void *context), void *context);
+
+/** Parses a byte count such as "512K", "64M" or "1G". Returns 0 if [text] is not one. */
+size_t parseGCSize(const char *text);
+/** Sets the options above from the GECCO_GC_* environment variables that are set. */
+void readGCEnvironment();
+/** Applies the options above to the VM, once they are set and before the program runs. */
+void configureGC();
+
+/** Prints the collector's pauses, what it freed, its pacing and the heap's contents to stderr. */
+void printGCStats();
+
+/**
+ * The write barrier, called when [value] is stored into a field of [owner]. An old
+ * object that gains a reference to a young one is remembered so that the next minor
+ * collection, which does not trace the old generation, still sees that reference.
+ * While a major collection is marking, a marked owner instead has [value] marked.
+ */
+static inline void writeBarrier(Obj *owner, Value value) {
+    if (!IS_OBJ(value)) return;
+    if (vm.gcPhase == GC_MARK && isMarked(owner)) {
+        markObject(AS_OBJ(value));
+    } else if (owner->isOld && !AS_OBJ(value)->isOld) {
+        rememberObject(owner);
+    }
+}
 
 #endif //memory_h
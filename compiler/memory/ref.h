@@ -0,0 +1,52 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef ref_h
+#define ref_h
+
+#include "../common.h"
+
+/*
+ * Object references held by other objects and by tables. A GECCO_COMPRESSED_HEAP build
+ * keeps every object in one 4 GB range reserved up front, the heap cage of heap.c, and
+ * stores these references as 32-bit offsets into it, 0 standing for null. Other builds
+ * store plain pointers and these macros cost nothing.
+ *
+ *   REF(ObjShape) shape;                       a field
+ *   instance->shape = TO_REF(shape);           a store
+ *   FROM_REF(ObjShape, instance->shape)        a load
+ *   instance->shape == NULL_REF                a null test
+ */
+#ifdef GECCO_COMPRESSED_HEAP
+
+#if !defined(__unix__) || UINTPTR_MAX <= UINT32_MAX
+#error "GECCO_COMPRESSED_HEAP needs a 64-bit Unix build."
+#endif
+
+// The start of the heap cage, null until the first page is mapped.
+extern char *heapCage;
+
+static inline uint32_t toRef(const void *object) {
+    return object == NULL ? 0 : (uint32_t) ((const char *) object - heapCage);
+}
+
+static inline void *fromRef(uint32_t ref) {
+    return ref == 0 ? NULL : heapCage + ref;
+}
+
+#define REF(type) uint32_t
+#define NULL_REF 0u
+#define TO_REF(object) toRef(object)
+#define FROM_REF(type, ref) ((type *) fromRef(ref))
+
+#else
+
+#define REF(type) type *
+#define NULL_REF NULL
+#define TO_REF(object) ((void *) (object))
+#define FROM_REF(type, ref) ((type *) (ref))
+
+#endif
+
+#endif //ref_h
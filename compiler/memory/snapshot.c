@@ -0,0 +1,782 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "heap.h"
+#include "memory.h"
+#include "../geccovm/vm.h"
+
+/*
+ * A snapshot is a header, the objects and the named roots, little-endian:
+ *
+ *   "GECSNAP1" u32 objectCount u32 namedRootCount
+ *   per object: u8 type, u32 size, u32 parent, u16 labelLength, label, u32 edgeCount, u32 edges[]
+ *   per named root: u32 object, u16 nameLength, name
+ *
+ * Objects are numbered from 1 in breadth-first order from the roots, and 0 stands for
+ * the roots themselves. The parent of an object is the one it was first reached from,
+ * so following parents gives a shortest path to a root. The size counts the arrays
+ * and tables the object owns as well as its slot. Named roots are the globals.
+ *
+ * The analyzer builds the dominator tree of that graph with the iterative algorithm of
+ * Cooper, Harvey and Kennedy: an object dominated by another is only reachable through
+ * it, so it is freed with it, and an object's retained size is the sum of the sizes
+ * of the objects it dominates.
+ */
+
+#define SNAPSHOT_MAGIC "GECSNAP1"
+#define SNAPSHOT_LABEL_MAX 64
+// Rows printed by the analyzer.
+#define SNAPSHOT_TOP_GROUPS 20
+#define SNAPSHOT_TOP_OBJECTS 10
+#define SNAPSHOT_PATH_DEPTH 8
+
+static const char *typeNames[] = {
+    [OBJ_BOUND_METHOD] = "bound method", [OBJ_CLASS] = "class", [OBJ_CLOSURE] = "closure",
+    [OBJ_FUNCTION] = "function", [OBJ_INSTANCE] = "instance", [OBJ_NATIVE] = "native",
+    [OBJ_SHAPE] = "shape", [OBJ_STRING] = "string", [OBJ_UPVALUE] = "upvalue",
+};
+
+#define TYPE_COUNT ((int) (sizeof(typeNames) / sizeof(typeNames[0])))
+
+static void *growArray(void *array, int *capacity, int needed, size_t size) {
+    if (*capacity >= needed) return array;
+    while (*capacity < needed) *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    return array;
+}
+
+// Writing
+
+/** Maps the objects found so far to their numbers, by open addressing on the address. */
+typedef struct {
+    Obj **keys;
+    uint32_t *ids;
+    uint32_t capacity; // A power of two.
+    uint32_t count;
+} ObjectMap;
+
+typedef struct {
+    ObjectMap map;
+    Obj **objects; // By number less one, which is also the breadth-first order.
+    uint32_t *parents;
+    int count;
+    int capacity;
+    uint32_t current; // The object whose references are being visited, 0 for the roots.
+    uint32_t *edges; // Those references.
+    int edgeCount;
+    int edgeCapacity;
+} SnapshotWriter;
+
+static uint32_t hashAddress(Obj *object) {
+    uint64_t bits = (uint64_t) (uintptr_t) object;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+static uint32_t *findId(ObjectMap *map, Obj *object) {
+    uint32_t index = hashAddress(object) & (map->capacity - 1);
+    while (map->keys[index] != NULL && map->keys[index] != object) index = (index + 1) & (map->capacity - 1);
+    map->keys[index] = object;
+    return &map->ids[index];
+}
+
+static void growMap(ObjectMap *map) {
+    ObjectMap grown = {NULL, NULL, map->capacity < 1024 ? 1024 : map->capacity * 2, map->count};
+    grown.keys = calloc(grown.capacity, sizeof(Obj *));
+    grown.ids = calloc(grown.capacity, sizeof(uint32_t));
+    if (grown.keys == NULL || grown.ids == NULL) exit(1);
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        if (map->keys[i] != NULL) *findId(&grown, map->keys[i]) = map->ids[i];
+    }
+    free(map->keys);
+    free(map->ids);
+    *map = grown;
+}
+
+/** Numbers [object] if it is new, with the object being visited as its parent. */
+static void discover(Obj *object, void *context) {
+    SnapshotWriter *writer = context;
+    if ((writer->map.count + 1) * 2 > writer->map.capacity) growMap(&writer->map);
+    uint32_t *id = findId(&writer->map, object);
+    if (*id != 0) return;
+
+    writer->map.count++;
+    int capacity = writer->capacity;
+    writer->objects = growArray(writer->objects, &capacity, writer->count + 1, sizeof(Obj *));
+    writer->parents = growArray(writer->parents, &writer->capacity, writer->count + 1, sizeof(uint32_t));
+    writer->objects[writer->count] = object;
+    writer->parents[writer->count] = writer->current;
+    *id = (uint32_t) ++writer->count;
+}
+
+static void collectEdge(Obj *object, void *context) {
+    SnapshotWriter *writer = context;
+    writer->edges = growArray(writer->edges, &writer->edgeCapacity, writer->edgeCount + 1, sizeof(uint32_t));
+    writer->edges[writer->edgeCount++] = *findId(&writer->map, object);
+}
+
+static void writeU16(FILE *file, uint16_t value) {
+    uint8_t bytes[2] = {value & 0xff, value >> 8};
+    fwrite(bytes, 1, 2, file);
+}
+
+static void writeU32(FILE *file, uint32_t value) {
+    uint8_t bytes[4] = {value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24};
+    fwrite(bytes, 1, 4, file);
+}
+
+static void writeLabel(FILE *file, const char *chars, int length) {
+    if (length > SNAPSHOT_LABEL_MAX) length = SNAPSHOT_LABEL_MAX;
+    writeU16(file, (uint16_t) length);
+    fwrite(chars, 1, length, file);
+}
+
+static const char *nameOf(ObjString *name, const char *unnamed) {
+    return name != NULL ? name->chars : unnamed;
+}
+
+/** The name an object is grouped by: its class, its function or its characters. */
+static const char *labelOf(Obj *object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjClosure *method = FROM_REF(ObjClosure, ((ObjBoundMethod *) object)->method);
+            return nameOf(FROM_REF(ObjFunction, method->function)->name, "script");
+        }
+        case OBJ_CLASS: return ((ObjClass *) object)->name->chars;
+        case OBJ_CLOSURE: return nameOf(FROM_REF(ObjFunction, ((ObjClosure *) object)->function)->name, "script");
+        case OBJ_FUNCTION: return nameOf(((ObjFunction *) object)->name, "script");
+        case OBJ_INSTANCE: return FROM_REF(ObjClass, ((ObjInstance *) object)->klass)->name->chars;
+        case OBJ_SHAPE: return nameOf(((ObjShape *) object)->name, "");
+        case OBJ_STRING: return ((ObjString *) object)->chars;
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE: return "";
+    }
+    return "";
+}
+
+static size_t tableSize(Table *table) {
+    return TABLE_BYTES(table->capacity);
+}
+
+/** The bytes [object] holds: its slot and what freeObject() frees with it. */
+static size_t sizeOf(Obj *object) {
+    size_t size = pageOf(object)->slotSize;
+    switch (object->type) {
+        case OBJ_CLASS:
+            return size + tableSize(&((ObjClass *) object)->methods);
+        case OBJ_CLOSURE:
+            return size + sizeof(REF(ObjUpvalue)) * ((ObjClosure *) object)->upvalueCount;
+        case OBJ_FUNCTION: {
+            Chunk *chunk = &((ObjFunction *) object)->chunk;
+            return size + (sizeof(uint8_t) + sizeof(int)) * chunk->capacity + sizeof(Value) * chunk->constants.capacity +
+                   sizeof(InlineCache) * chunk->cacheCapacity;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance *instance = (ObjInstance *) object;
+            if (instance->shape == NULL_REF) return size + sizeof(Table) + tableSize(instance->dictionary);
+            if (instance->fields != instance->inlineFields) return size + sizeof(Value) * instance->capacity;
+            return size;
+        }
+        case OBJ_SHAPE:
+            return size + tableSize(&((ObjShape *) object)->transitions);
+        default:
+            return size;
+    }
+}
+
+static void writeNamedRoot(FILE *file, SnapshotWriter *writer, ObjString *name, Value value) {
+    writeU32(file, *findId(&writer->map, AS_OBJ(value)));
+    writeLabel(file, name->chars, name->length);
+}
+
+bool writeHeapSnapshot(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    SnapshotWriter writer = {0};
+    growMap(&writer.map);
+    visitRoots(discover, &writer);
+    // The objects found so far are the roots' references, numbered before any of theirs.
+    for (int i = 0; i < writer.count; i++) {
+        writer.current = (uint32_t) i + 1;
+        visitReferences(writer.objects[i], discover, &writer);
+    }
+
+    int namedRoots = 0;
+    for (int i = 0; i < vm.globalCount; i++) {
+        if (IS_OBJ(vm.globalSlots[i].value)) namedRoots++;
+    }
+    for (int i = 0; i < vm.globals.capacity; i++) {
+        if (TABLE_FULL(&vm.globals, i) && IS_OBJ(vm.globals.values[i])) namedRoots++;
+    }
+
+    fwrite(SNAPSHOT_MAGIC, 1, 8, file);
+    writeU32(file, (uint32_t) writer.count);
+    writeU32(file, (uint32_t) namedRoots);
+    for (int i = 0; i < writer.count; i++) {
+        Obj *object = writer.objects[i];
+        fputc(object->type, file);
+        writeU32(file, (uint32_t) sizeOf(object));
+        writeU32(file, writer.parents[i]);
+        const char *label = labelOf(object);
+        writeLabel(file, label, (int) strlen(label));
+
+        writer.edgeCount = 0;
+        visitReferences(object, collectEdge, &writer);
+        writeU32(file, (uint32_t) writer.edgeCount);
+        for (int j = 0; j < writer.edgeCount; j++) writeU32(file, writer.edges[j]);
+    }
+    for (int i = 0; i < vm.globalCount; i++) {
+        GlobalSlot *slot = &vm.globalSlots[i];
+        if (IS_OBJ(slot->value)) writeNamedRoot(file, &writer, slot->name, slot->value);
+    }
+    for (int i = 0; i < vm.globals.capacity; i++) {
+        if (TABLE_FULL(&vm.globals, i) && IS_OBJ(vm.globals.values[i])) {
+            writeNamedRoot(file, &writer, FROM_REF(ObjString, vm.globals.keys[i]), vm.globals.values[i]);
+        }
+    }
+
+    free(writer.map.keys);
+    free(writer.map.ids);
+    free(writer.objects);
+    free(writer.parents);
+    free(writer.edges);
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
+}
+
+// Reading
+
+typedef struct {
+    int count; // Objects, numbered 1 to count; 0 is the roots.
+    uint8_t *types;
+    uint32_t *sizes;
+    uint32_t *parents;
+    const char **labels;
+    uint16_t *labelLengths;
+    uint32_t *edgeStarts; // count + 2 entries: the roots' edges, then each object's.
+    uint32_t *edges;
+    const char **rootNames; // The global holding an object, if one does.
+    uint16_t *rootNameLengths;
+    uint8_t *data; // The file, which labels point into.
+} Snapshot;
+
+typedef struct {
+    const uint8_t *at;
+    const uint8_t *end;
+    bool failed;
+} Reader;
+
+static const uint8_t *readBytes(Reader *reader, size_t length) {
+    if (reader->failed || (size_t) (reader->end - reader->at) < length) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->at;
+    reader->at += length;
+    return bytes;
+}
+
+static uint32_t readU32(Reader *reader) {
+    const uint8_t *bytes = readBytes(reader, 4);
+    if (bytes == NULL) return 0;
+    return bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+static const char *readLabel(Reader *reader, uint16_t *length) {
+    const uint8_t *bytes = readBytes(reader, 2);
+    *length = bytes == NULL ? 0 : (uint16_t) (bytes[0] | bytes[1] << 8);
+    const char *label = (const char *) readBytes(reader, *length);
+    return label == NULL ? "" : label;
+}
+
+static void freeSnapshot(Snapshot *snapshot) {
+    free(snapshot->types);
+    free(snapshot->sizes);
+    free(snapshot->parents);
+    free(snapshot->labels);
+    free(snapshot->labelLengths);
+    free(snapshot->edgeStarts);
+    free(snapshot->edges);
+    free(snapshot->rootNames);
+    free(snapshot->rootNameLengths);
+    free(snapshot->data);
+}
+
+static bool loadSnapshot(const char *path, Snapshot *snapshot) {
+    memset(snapshot, 0, sizeof(Snapshot));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open heap snapshot \"%s\".\n", path);
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    snapshot->data = malloc(length > 0 ? length : 1);
+    if (snapshot->data == NULL) exit(1);
+    size_t read = fread(snapshot->data, 1, length, file);
+    fclose(file);
+
+    Reader reader = {snapshot->data, snapshot->data + read, false};
+    const uint8_t *magic = readBytes(&reader, 8);
+    if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, 8) != 0) {
+        fprintf(stderr, "\"%s\" is not a heap snapshot.\n", path);
+        freeSnapshot(snapshot);
+        return false;
+    }
+
+    int count = (int) readU32(&reader);
+    uint32_t namedRoots = readU32(&reader);
+    // Each object takes at least 15 bytes, which bounds what a damaged count can allocate.
+    if (count < 0 || (size_t) count > read / 15) reader.failed = true;
+    if (reader.failed) count = 0;
+    snapshot->count = count;
+    snapshot->types = calloc(count + 1, sizeof(uint8_t));
+    snapshot->sizes = calloc(count + 1, sizeof(uint32_t));
+    snapshot->parents = calloc(count + 1, sizeof(uint32_t));
+    snapshot->labels = calloc(count + 1, sizeof(const char *));
+    snapshot->labelLengths = calloc(count + 1, sizeof(uint16_t));
+    snapshot->edgeStarts = calloc(count + 2, sizeof(uint32_t));
+    snapshot->rootNames = calloc(count + 1, sizeof(const char *));
+    snapshot->rootNameLengths = calloc(count + 1, sizeof(uint16_t));
+    if (snapshot->types == NULL || snapshot->sizes == NULL || snapshot->parents == NULL || snapshot->labels == NULL ||
+        snapshot->labelLengths == NULL || snapshot->edgeStarts == NULL || snapshot->rootNames == NULL ||
+        snapshot->rootNameLengths == NULL) exit(1);
+
+    int edgeCapacity = 0;
+    int edgeCount = 0;
+    // The roots reference the objects that were reached from them.
+    for (int pass = 0; pass < 2; pass++) {
+        Reader objects = reader;
+        if (pass == 1) snapshot->edgeStarts[1] = (uint32_t) edgeCount;
+        for (int id = 1; id <= count && !objects.failed; id++) {
+            const uint8_t *type = readBytes(&objects, 1);
+            uint32_t size = readU32(&objects);
+            uint32_t parent = readU32(&objects);
+            uint16_t labelLength;
+            const char *label = readLabel(&objects, &labelLength);
+            uint32_t edges = readU32(&objects);
+            if (pass == 0) {
+                if (parent == 0) {
+                    snapshot->edges = growArray(snapshot->edges, &edgeCapacity, edgeCount + 1, sizeof(uint32_t));
+                    snapshot->edges[edgeCount++] = (uint32_t) id;
+                }
+                readBytes(&objects, (size_t) edges * 4);
+                continue;
+            }
+
+            snapshot->types[id] = type == NULL || *type >= TYPE_COUNT ? OBJ_NATIVE : *type;
+            snapshot->sizes[id] = size;
+            snapshot->parents[id] = parent <= (uint32_t) count ? parent : 0;
+            snapshot->labels[id] = label;
+            snapshot->labelLengths[id] = labelLength;
+            for (uint32_t i = 0; i < edges && !objects.failed; i++) {
+                uint32_t target = readU32(&objects);
+                if (target == 0 || target > (uint32_t) count) continue;
+                snapshot->edges = growArray(snapshot->edges, &edgeCapacity, edgeCount + 1, sizeof(uint32_t));
+                snapshot->edges[edgeCount++] = target;
+            }
+            snapshot->edgeStarts[id + 1] = (uint32_t) edgeCount;
+        }
+        if (pass == 1) reader = objects;
+    }
+
+    for (uint32_t i = 0; i < namedRoots && !reader.failed; i++) {
+        uint32_t id = readU32(&reader);
+        uint16_t nameLength;
+        const char *name = readLabel(&reader, &nameLength);
+        if (id == 0 || id > (uint32_t) count || snapshot->rootNames[id] != NULL) continue;
+        snapshot->rootNames[id] = name;
+        snapshot->rootNameLengths[id] = nameLength;
+    }
+
+    if (reader.failed) {
+        fprintf(stderr, "Heap snapshot \"%s\" is truncated.\n", path);
+        freeSnapshot(snapshot);
+        return false;
+    }
+    return true;
+}
+
+// Dominators
+
+static uint32_t intersect(const uint32_t *idom, const int *order, uint32_t a, uint32_t b) {
+    while (a != b) {
+        while (order[a] > order[b]) a = idom[a];
+        while (order[b] > order[a]) b = idom[b];
+    }
+    return a;
+}
+
+/** Sets each object's immediate dominator, and the objects' retained sizes. */
+static void computeDominators(Snapshot *snapshot, uint32_t *idom, uint64_t *retained) {
+    int count = snapshot->count;
+    // Reverse postorder from the roots, by an explicit depth-first stack.
+    uint32_t *rpo = malloc(sizeof(uint32_t) * (count + 1));
+    int *order = malloc(sizeof(int) * (count + 1)); // Position in rpo, -1 until visited.
+    uint32_t *stack = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t *next = malloc(sizeof(uint32_t) * (count + 1)); // The stacked nodes' next edges.
+    uint32_t *predecessorStarts = calloc(count + 2, sizeof(uint32_t));
+    if (rpo == NULL || order == NULL || stack == NULL || next == NULL || predecessorStarts == NULL) exit(1);
+    for (int i = 0; i <= count; i++) order[i] = -1;
+
+    int visited = 0;
+    int depth = 0;
+    stack[depth++] = 0;
+    order[0] = 0;
+    next[0] = snapshot->edgeStarts[0];
+    int position = count + 1;
+    while (depth > 0) {
+        uint32_t node = stack[depth - 1];
+        if (next[node] < snapshot->edgeStarts[node + 1]) {
+            uint32_t target = snapshot->edges[next[node]++];
+            if (order[target] != -1) continue;
+            order[target] = 0;
+            next[target] = snapshot->edgeStarts[target];
+            stack[depth++] = target;
+            continue;
+        }
+        depth--;
+        rpo[--position] = node;
+        visited++;
+    }
+    // Every object was reached from the roots when the snapshot was taken.
+    memmove(rpo, rpo + position, sizeof(uint32_t) * visited);
+    for (int i = 0; i < visited; i++) order[rpo[i]] = i;
+
+    uint32_t total = snapshot->edgeStarts[count + 1];
+    uint32_t *predecessors = malloc(sizeof(uint32_t) * (total > 0 ? total : 1));
+    if (predecessors == NULL) exit(1);
+    for (uint32_t i = 0; i < total; i++) predecessorStarts[snapshot->edges[i] + 1]++;
+    for (int i = 0; i <= count; i++) predecessorStarts[i + 1] += predecessorStarts[i];
+    uint32_t *fill = malloc(sizeof(uint32_t) * (count + 1));
+    if (fill == NULL) exit(1);
+    memcpy(fill, predecessorStarts, sizeof(uint32_t) * (count + 1));
+    for (int node = 0; node <= count; node++) {
+        for (uint32_t i = snapshot->edgeStarts[node]; i < snapshot->edgeStarts[node + 1]; i++) {
+            predecessors[fill[snapshot->edges[i]]++] = (uint32_t) node;
+        }
+    }
+
+    const uint32_t undefined = UINT32_MAX;
+    for (int i = 0; i <= count; i++) idom[i] = undefined;
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < visited; i++) {
+            uint32_t node = rpo[i];
+            uint32_t dominator = undefined;
+            for (uint32_t j = predecessorStarts[node]; j < predecessorStarts[node + 1]; j++) {
+                uint32_t predecessor = predecessors[j];
+                if (idom[predecessor] == undefined) continue;
+                dominator = dominator == undefined ? predecessor : intersect(idom, order, predecessor, dominator);
+            }
+            if (dominator != idom[node]) {
+                idom[node] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    for (int i = 0; i <= count; i++) retained[i] = snapshot->sizes[i];
+    for (int i = visited - 1; i > 0; i--) retained[idom[rpo[i]]] += retained[rpo[i]];
+    for (int i = 1; i <= count; i++) {
+        if (idom[i] == undefined) idom[i] = 0;
+    }
+
+    free(rpo);
+    free(order);
+    free(stack);
+    free(next);
+    free(predecessorStarts);
+    free(predecessors);
+    free(fill);
+}
+
+// Groups
+
+/** Objects of one type and, for most types, one label: the instances of a class, say. */
+typedef struct {
+    uint8_t type;
+    const char *label;
+    uint16_t labelLength;
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t retained;
+} Group;
+
+typedef struct {
+    Group *groups;
+    int count;
+    int capacity;
+    int *slots; // Open addressing over groups, -1 when empty.
+    int slotCapacity;
+} GroupTable;
+
+static bool labelsGroup(uint8_t type) {
+    return type != OBJ_STRING && type != OBJ_SHAPE && type != OBJ_UPVALUE && type != OBJ_NATIVE;
+}
+
+static uint32_t hashGroup(uint8_t type, const char *label, uint16_t length) {
+    uint32_t hash = 2166136261u ^ type;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) label[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static Group *findGroup(GroupTable *table, uint8_t type, const char *label, uint16_t length) {
+    if (!labelsGroup(type)) length = 0;
+    if ((table->count + 1) * 2 > table->slotCapacity) {
+        int capacity = table->slotCapacity < 256 ? 256 : table->slotCapacity * 2;
+        int *slots = malloc(sizeof(int) * capacity);
+        if (slots == NULL) exit(1);
+        for (int i = 0; i < capacity; i++) slots[i] = -1;
+        for (int i = 0; i < table->count; i++) {
+            Group *group = &table->groups[i];
+            uint32_t index = hashGroup(group->type, group->label, group->labelLength) & (capacity - 1);
+            while (slots[index] != -1) index = (index + 1) & (capacity - 1);
+            slots[index] = i;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->slotCapacity = capacity;
+    }
+
+    uint32_t index = hashGroup(type, label, length) & (table->slotCapacity - 1);
+    while (table->slots[index] != -1) {
+        Group *group = &table->groups[table->slots[index]];
+        if (group->type == type && group->labelLength == length && memcmp(group->label, label, length) == 0) {
+            return group;
+        }
+        index = (index + 1) & (table->slotCapacity - 1);
+    }
+    table->groups = growArray(table->groups, &table->capacity, table->count + 1, sizeof(Group));
+    table->slots[index] = table->count;
+    Group *group = &table->groups[table->count++];
+    *group = (Group) {type, label, length, 0, 0, 0};
+    return group;
+}
+
+static void freeGroups(GroupTable *table) {
+    free(table->groups);
+    free(table->slots);
+}
+
+/**
+ * Sums each group's objects and their retained sizes. An object dominated by another
+ * of its group is already in that one's retained size.
+ */
+static void groupObjects(Snapshot *snapshot, const uint32_t *idom, const uint64_t *retained, GroupTable *table) {
+    // Indices rather than pointers, as the groups move while the table grows.
+    int *groups = malloc(sizeof(int) * (snapshot->count + 1));
+    if (groups == NULL) exit(1);
+    groups[0] = -1;
+    for (int i = 1; i <= snapshot->count; i++) {
+        Group *group = findGroup(table, snapshot->types[i], snapshot->labels[i], snapshot->labelLengths[i]);
+        group->count++;
+        group->bytes += snapshot->sizes[i];
+        groups[i] = (int) (group - table->groups);
+    }
+    for (int i = 1; i <= snapshot->count; i++) {
+        if (groups[idom[i]] != groups[i]) table->groups[groups[i]].retained += retained[i];
+    }
+    free(groups);
+}
+
+/** Groups the objects of a loaded snapshot, for a diff. */
+static void groupSnapshot(Snapshot *snapshot, GroupTable *table) {
+    uint32_t *idom = malloc(sizeof(uint32_t) * (snapshot->count + 1));
+    uint64_t *retained = malloc(sizeof(uint64_t) * (snapshot->count + 1));
+    if (idom == NULL || retained == NULL) exit(1);
+    computeDominators(snapshot, idom, retained);
+    groupObjects(snapshot, idom, retained, table);
+    free(idom);
+    free(retained);
+}
+
+static int compareRetained(const void *a, const void *b) {
+    const Group *left = a;
+    const Group *right = b;
+    return left->retained < right->retained ? 1 : left->retained > right->retained ? -1 : 0;
+}
+
+static void printGroupName(const Group *group) {
+    if (group->labelLength == 0) {
+        printf("%-40s", typeNames[group->type]);
+    } else {
+        int width = 39 - (int) strlen(typeNames[group->type]);
+        printf("%s %-*.*s", typeNames[group->type], width < 0 ? 0 : width, group->labelLength, group->label);
+    }
+}
+
+/** Prints the path from a root to [id] as the labels along it, the root end first. */
+static void printRootPath(Snapshot *snapshot, uint32_t id) {
+    uint32_t path[SNAPSHOT_PATH_DEPTH];
+    int length = 0;
+    for (uint32_t node = id; node != 0 && length < SNAPSHOT_PATH_DEPTH; node = snapshot->parents[node]) {
+        path[length++] = node;
+    }
+    uint32_t top = path[length - 1];
+    if (snapshot->parents[top] != 0) {
+        printf("    ...");
+    } else if (snapshot->rootNames[top] != NULL) {
+        printf("    global %.*s", snapshot->rootNameLengths[top], snapshot->rootNames[top]);
+    } else {
+        printf("    root");
+    }
+    for (int i = length - 1; i >= 0; i--) {
+        uint32_t node = path[i];
+        printf(" -> %s", typeNames[snapshot->types[node]]);
+        if (snapshot->labelLengths[node] > 0) {
+            printf(" %.*s", snapshot->labelLengths[node], snapshot->labels[node]);
+        }
+    }
+    printf("\n");
+}
+
+bool printHeapSnapshot(const char *path) {
+    Snapshot snapshot;
+    if (!loadSnapshot(path, &snapshot)) return false;
+
+    uint32_t *idom = malloc(sizeof(uint32_t) * (snapshot.count + 1));
+    uint64_t *retained = malloc(sizeof(uint64_t) * (snapshot.count + 1));
+    if (idom == NULL || retained == NULL) exit(1);
+    computeDominators(&snapshot, idom, retained);
+    printf("%d objects, %llu bytes\n\n", snapshot.count, (unsigned long long) retained[0]);
+
+    GroupTable table = {0};
+    groupObjects(&snapshot, idom, retained, &table);
+    qsort(table.groups, table.count, sizeof(Group), compareRetained);
+    printf("%-40s %10s %12s %12s\n", "group", "count", "bytes", "retained");
+    for (int i = 0; i < table.count && i < SNAPSHOT_TOP_GROUPS; i++) {
+        Group *group = &table.groups[i];
+        printGroupName(group);
+        printf(" %10u %12llu %12llu\n", group->count, (unsigned long long) group->bytes,
+               (unsigned long long) group->retained);
+    }
+
+    // The objects retaining the most, by selection: only the first few are wanted. Those
+    // dominated by an object like them, down a linked list say, would repeat its entry.
+    uint32_t top[SNAPSHOT_TOP_OBJECTS];
+    int topCount = 0;
+    for (uint32_t i = 1; i <= (uint32_t) snapshot.count; i++) {
+        uint32_t dominator = idom[i];
+        if (dominator != 0 && snapshot.types[dominator] == snapshot.types[i] &&
+            snapshot.labelLengths[dominator] == snapshot.labelLengths[i] &&
+            memcmp(snapshot.labels[dominator], snapshot.labels[i], snapshot.labelLengths[i]) == 0) continue;
+        int at = topCount < SNAPSHOT_TOP_OBJECTS ? topCount++ : SNAPSHOT_TOP_OBJECTS;
+        while (at > 0 && retained[top[at - 1]] < retained[i]) {
+            if (at < SNAPSHOT_TOP_OBJECTS) top[at] = top[at - 1];
+            at--;
+        }
+        if (at < SNAPSHOT_TOP_OBJECTS) top[at] = i;
+    }
+    printf("\n%-40s %12s %12s\n", "largest retainers", "bytes", "retained");
+    for (int i = 0; i < topCount; i++) {
+        uint32_t id = top[i];
+        Group group = {snapshot.types[id], snapshot.labels[id], snapshot.labelLengths[id], 0, 0, 0};
+        printGroupName(&group);
+        printf(" %12u %12llu\n", snapshot.sizes[id], (unsigned long long) retained[id]);
+        printRootPath(&snapshot, id);
+    }
+
+    free(idom);
+    free(retained);
+    freeGroups(&table);
+    freeSnapshot(&snapshot);
+    return true;
+}
+
+typedef struct {
+    Group *group;
+    int64_t countDelta;
+    int64_t bytesDelta;
+    int64_t retainedDelta;
+} GroupChange;
+
+static int compareChange(const void *a, const void *b) {
+    const GroupChange *left = a;
+    const GroupChange *right = b;
+    int64_t leftSize = llabs(left->bytesDelta);
+    int64_t rightSize = llabs(right->bytesDelta);
+    return leftSize < rightSize ? 1 : leftSize > rightSize ? -1 : 0;
+}
+
+bool diffHeapSnapshots(const char *oldPath, const char *newPath) {
+    Snapshot before;
+    Snapshot after;
+    if (!loadSnapshot(oldPath, &before)) return false;
+    if (!loadSnapshot(newPath, &after)) {
+        freeSnapshot(&before);
+        return false;
+    }
+
+    GroupTable oldGroups = {0};
+    GroupTable newGroups = {0};
+    groupSnapshot(&before, &oldGroups);
+    groupSnapshot(&after, &newGroups);
+
+    // Every group of either snapshot, the old ones subtracted from a merged table.
+    GroupTable merged = {0};
+    for (int i = 0; i < newGroups.count; i++) {
+        Group *group = &newGroups.groups[i];
+        *findGroup(&merged, group->type, group->label, group->labelLength) = *group;
+    }
+    GroupChange *changes = malloc(sizeof(GroupChange) * (oldGroups.count + newGroups.count + 1));
+    if (changes == NULL) exit(1);
+    for (int i = 0; i < oldGroups.count; i++) findGroup(&merged, oldGroups.groups[i].type, oldGroups.groups[i].label,
+                                                        oldGroups.groups[i].labelLength);
+    for (int i = 0; i < merged.count; i++) {
+        Group *group = &merged.groups[i];
+        changes[i] = (GroupChange) {group, group->count, (int64_t) group->bytes, (int64_t) group->retained};
+    }
+    for (int i = 0; i < oldGroups.count; i++) {
+        Group *old = &oldGroups.groups[i];
+        Group *group = findGroup(&merged, old->type, old->label, old->labelLength);
+        GroupChange *change = &changes[group - merged.groups];
+        change->countDelta -= old->count;
+        change->bytesDelta -= (int64_t) old->bytes;
+        change->retainedDelta -= (int64_t) old->retained;
+    }
+
+    uint64_t oldBytes = 0;
+    uint64_t newBytes = 0;
+    for (int i = 1; i <= before.count; i++) oldBytes += before.sizes[i];
+    for (int i = 1; i <= after.count; i++) newBytes += after.sizes[i];
+    printf("%d -> %d objects, %llu -> %llu bytes (%+lld)\n\n", before.count, after.count,
+           (unsigned long long) oldBytes, (unsigned long long) newBytes, (long long) (newBytes - oldBytes));
+
+    qsort(changes, merged.count, sizeof(GroupChange), compareChange);
+    printf("%-40s %10s %12s %12s\n", "group", "count", "bytes", "retained");
+    int printed = 0;
+    for (int i = 0; i < merged.count && printed < SNAPSHOT_TOP_GROUPS; i++) {
+        GroupChange *change = &changes[i];
+        if (change->countDelta == 0 && change->bytesDelta == 0) continue;
+        printGroupName(change->group);
+        printf(" %+10lld %+12lld %+12lld\n", (long long) change->countDelta, (long long) change->bytesDelta,
+               (long long) change->retainedDelta);
+        printed++;
+    }
+    if (printed == 0) printf("no group changed\n");
+
+    free(changes);
+    freeGroups(&oldGroups);
+    freeGroups(&newGroups);
+    freeGroups(&merged);
+    freeSnapshot(&before);
+    freeSnapshot(&after);
+    return true;
+}
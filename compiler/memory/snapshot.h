@@ -0,0 +1,21 @@
+//
+// Created by wylan on 10/16/26.
+//
+
+#ifndef snapshot_h
+#define snapshot_h
+
+#include "../common.h"
+
+/**
+ * Writes every object reachable from the roots to [path]: its type, size, label,
+ * references and the object it was first reached from, so that each has a shortest
+ * path to a root. Returns whether the file was written.
+ */
+bool writeHeapSnapshot(const char *path);
+/** Prints what holds the memory in a snapshot: retained sizes by group and the largest objects. */
+bool printHeapSnapshot(const char *path);
+/** Prints the groups of objects that grew or shrank the most between two snapshots. */
+bool diffHeapSnapshots(const char *oldPath, const char *newPath);
+
+#endif //snapshot_h
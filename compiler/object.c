@@ -16,12 +16,13 @@
 #define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = reallocate(NULL, 0, size);
+    Obj *object = allocateSlot(size);
     object->type = type;
-    object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
+    object->isPermanent = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    addYoungObject(object);
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -33,7 +34,7 @@ static Obj *allocateObject(size_t size, ObjType type) {
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
     ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
-    bound->method = method;
+    bound->method = TO_REF(method);
     return bound;
 }
 
@@ -41,17 +42,24 @@ ObjClass *newClass(ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name; // [klass]
     initTable(&klass->methods);
+    klass->rootShape = nullptr;
+    klass->instanceSlots = 0;
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    writeBarrier((Obj *) klass, OBJ_VAL(klass->rootShape));
+    pop();
     return klass;
 }
 
 ObjClosure *newClosure(ObjFunction *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    REF(ObjUpvalue) *upvalues = ALLOCATE(REF(ObjUpvalue), function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = nullptr;
+        upvalues[i] = NULL_REF;
     }
 
     ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
+    closure->function = TO_REF(function);
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
@@ -62,15 +70,27 @@ ObjFunction *newFunction() {
     function->arity = 0;
     //> Closures init-upvalue-count
     function->upvalueCount = 0;
+    function->frameSize = 0;
+    function->hotness = 0;
+    function->jit = nullptr;
+    function->loops = nullptr;
     function->name = nullptr;
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->klass = klass;
-    initTable(&instance->fields);
+    int inlineCapacity = klass->instanceSlots;
+    if (inlineCapacity > INSTANCE_MAX_INLINE) inlineCapacity = INSTANCE_MAX_INLINE;
+
+    ObjInstance *instance = (ObjInstance *) allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
+    instance->klass = TO_REF(klass);
+    instance->shape = TO_REF(klass->rootShape);
+    instance->fields = instance->inlineFields;
+    instance->dictionary = nullptr;
+    instance->capacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
     return instance;
 }
 
@@ -80,55 +100,240 @@ ObjNative *newNative(NativeFn function) {
     return native;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
 
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NULL_VAL);
+/** Returns the slot holding [name] in instances of [shape], or -1 if the shape lacks it. */
+int shapeLookup(ObjShape *shape, ObjString *name) {
+    // Names are interned, so walking back from the newest field compares pointers only.
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+static ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) return AS_SHAPE(child);
+
+    ObjShape *added = newShape(shape, name);
+    push(OBJ_VAL(added));
+    tableSet(&shape->transitions, name, OBJ_VAL(added));
+    writeBarrier((Obj *) shape, OBJ_VAL(added));
     pop();
+    return added;
+}
+
+static void freeFieldStorage(ObjInstance *instance) {
+    if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+    instance->fields = instance->inlineFields;
+    instance->capacity = instance->inlineCapacity;
+}
+
+static void growFields(ObjInstance *instance) {
+    int capacity = GROW_CAPACITY(instance->capacity);
+    Value *fields = ALLOCATE(Value, capacity);
+    // The old slots stay live until the copy, so a collection above still sees them.
+    for (int i = 0; i < FROM_REF(ObjShape, instance->shape)->fieldCount; i++) {
+        fields[i] = instance->fields[i];
+    }
+    freeFieldStorage(instance);
+    instance->fields = fields;
+    instance->capacity = capacity;
+}
+
+static void convertToDictionary(ObjInstance *instance) {
+    Table *dictionary = ALLOCATE(Table, 1);
+    initTable(dictionary);
+    // Keys are reachable through the shape and values through the slots until the switch.
+    for (ObjShape *shape = FROM_REF(ObjShape, instance->shape); shape->name != NULL; shape = shape->parent) {
+        tableSet(dictionary, shape->name, instance->fields[shape->fieldCount - 1]);
+    }
+    freeFieldStorage(instance);
+    instance->dictionary = dictionary;
+    instance->shape = NULL_REF;
+    // The dictionary holds the values the slots held.
+    rememberObject((Obj *) instance);
+}
+
+bool getInstanceField(ObjInstance *instance, ObjString *name, Value *value) {
+    if (instance->shape == NULL_REF) return tableGet(instance->dictionary, name, value);
+
+    int slot = shapeLookup(FROM_REF(ObjShape, instance->shape), name);
+    if (slot == -1) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+/**
+ * Stores [value] in the field [name], adding the field if needed. The instance, name and
+ * value must be reachable by the collector because adding a field may allocate.
+ */
+void setInstanceField(ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->shape != NULL_REF) {
+        ObjShape *current = FROM_REF(ObjShape, instance->shape);
+        int slot = shapeLookup(current, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+            writeBarrier((Obj *) instance, value);
+            return;
+        }
+
+        if (current->fieldCount < SHAPE_MAX_FIELDS) {
+            ObjShape *shape = shapeTransition(current, name);
+            if (shape->fieldCount > instance->capacity) growFields(instance);
+            instance->fields[shape->fieldCount - 1] = value;
+            instance->shape = TO_REF(shape);
+            writeBarrier((Obj *) instance, value);
+            writeBarrier((Obj *) instance, OBJ_VAL(shape));
+
+            ObjClass *klass = FROM_REF(ObjClass, instance->klass);
+            if (shape->fieldCount > klass->instanceSlots) klass->instanceSlots = shape->fieldCount;
+            return;
+        }
 
+        convertToDictionary(instance);
+    }
+
+    tableSet(instance->dictionary, name, value);
+    writeBarrier((Obj *) instance, value);
+}
+
+/**
+ * A string of [length] characters, not yet interned. The caller writes the characters
+ * and hands it to takeString() before anything else allocates.
+ */
+ObjString *makeString(int length) {
+    ObjString *string = (ObjString *) allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
     return string;
 }
 
+// The seed and secret of wyhash, the word-at-a-time hash hashString() is modelled on.
+static const uint64_t HASH_SECRET[] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull};
+#define HASH_SEED 0x589965cc75374cc3ull
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/** Both halves of the 128-bit product of [a] and [b], folded into one word. */
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+#else
+    uint64_t high = (a >> 32) * (b >> 32), low = (uint32_t) a * (uint64_t) (uint32_t) b;
+    uint64_t middle1 = (a >> 32) * (uint32_t) b, middle2 = (uint32_t) a * (b >> 32);
+    uint64_t carry = ((low >> 32) + (uint32_t) middle1 + (uint32_t) middle2) >> 32;
+    low += (middle1 << 32) + (middle2 << 32);
+    high += (middle1 >> 32) + (middle2 >> 32) + carry;
+    return low ^ high;
+#endif
+}
+
+/** Hashes eight bytes at a time, and three such lanes at a time for strings past 48 bytes. */
 static uint32_t hashString(const char *key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t) key[i];
-        hash *= 16777619;
+    const uint8_t *p = (const uint8_t *) key;
+    size_t remaining = (size_t) length;
+    uint64_t seed = HASH_SEED ^ mix(HASH_SEED ^ HASH_SECRET[0], HASH_SECRET[1]);
+    uint64_t a, b;
+
+    if (remaining <= 16) {
+        if (remaining >= 4) {
+            // Two overlapping pairs of 4-byte reads cover 4 to 16 bytes without a loop.
+            size_t middle = (remaining >> 3) << 2;
+            a = read32(p) << 32 | read32(p + middle);
+            b = read32(p + remaining - 4) << 32 | read32(p + remaining - 4 - middle);
+        } else if (remaining > 0) {
+            a = (uint64_t) p[0] << 16 | (uint64_t) p[remaining >> 1] << 8 | p[remaining - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (remaining > 48) {
+            uint64_t lane1 = seed, lane2 = seed;
+            do {
+                seed = mix(read64(p) ^ HASH_SECRET[0], read64(p + 8) ^ seed);
+                lane1 = mix(read64(p + 16) ^ HASH_SECRET[1], read64(p + 24) ^ lane1);
+                lane2 = mix(read64(p + 32) ^ HASH_SECRET[2], read64(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while (remaining > 16) {
+            seed = mix(read64(p) ^ HASH_SECRET[0], read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes of the string, some of them hashed already.
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
     }
-    return hash;
+
+    uint64_t hash = mix(HASH_SECRET[0] ^ (uint64_t) length, mix(a ^ HASH_SECRET[0], b ^ seed) ^ HASH_SECRET[1]);
+    return (uint32_t) (hash ^ hash >> 32);
 }
 
-ObjString *takeString(char *chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
+/**
+ * Interns a string from makeString(). Returns the equal string already interned instead, if
+ * there is one. A string longer than STRING_INTERN_MAX is returned as it is, unhashed.
+ */
+ObjString *takeString(ObjString *string) {
+    // Long strings are built in loops and rarely compared, so they skip a hashing pass.
+    if (string->length > STRING_INTERN_MAX) return string;
+
+    string->hash = hashString(string->chars, string->length);
+    // A duplicate stays young and unreachable, so the next minor collection frees it.
+    ObjString *interned = stringSetFind(&vm.strings, string->chars, string->length, string->hash);
+    if (interned != NULL) return interned;
 
-    return allocateString(chars, length, hash);
+    stringSetAdd(&vm.strings, string);
+    return string;
+}
+
+/** Whether two different string objects are equal, which only long strings can be. */
+bool longStringsEqual(ObjString *a, ObjString *b) {
+    return a->length > STRING_INTERN_MAX && a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 ObjString *copyString(const char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = stringSetFind(&vm.strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString *string = makeString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    stringSetAdd(&vm.strings, string);
+    return string;
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NULL_VAL;
     upvalue->location = slot;
-    upvalue->next = nullptr;
+    upvalue->next = NULL_REF;
     return upvalue;
 }
 
@@ -143,24 +348,27 @@ static void printFunction(ObjFunction *function) {
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
+            printFunction(FROM_REF(ObjFunction, FROM_REF(ObjClosure, AS_BOUND_METHOD(value)->method)->function));
             break;
         case OBJ_CLASS:
             printf("%s", AS_CLASS(value)->name->chars);
             break;
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function);
+            printFunction(FROM_REF(ObjFunction, AS_CLOSURE(value)->function));
             break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
             printf("%s instance",
-                   AS_INSTANCE(value)->klass->name->chars);
+                   FROM_REF(ObjClass, AS_INSTANCE(value)->klass)->name->chars);
             break;
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
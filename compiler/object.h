@@ -17,6 +17,7 @@
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -25,6 +26,7 @@
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
@@ -35,20 +37,36 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
 
+// Native code emitted by the baseline JIT, see geccovm/jit.h.
+typedef struct JitCode JitCode;
+// Loop headers seen by the trace JIT and their traces, see geccovm/trace.h.
+typedef struct TraceSite TraceSite;
+
+/**
+ * The header of every object: one word, padded to 8 bytes by whatever field follows.
+ * Mark bits live in the object's heap page and vm.youngObjects lists the young objects,
+ * so the header holds no pointers.
+ */
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    Obj *next;
+    uint8_t type; // An ObjType.
+    bool isOld; // Survived or was marked by a collection; only major collections trace it.
+    bool isRemembered; // Old and in vm.remembered until the next collection.
+    bool isPermanent; // Compiled code or one of its constants, never traced or freed; see makePermanent().
 };
 
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int frameSize; // Registers used when the chunk holds register code, 0 for stack code.
+    int hotness; // Calls and loop back edges counted for the JIT, negative once it gave up.
+    JitCode *jit; // Native code, null until the function is compiled.
+    TraceSite *loops; // Loops the trace JIT has counted, null until one turns hot.
     Chunk chunk;
     ObjString *name;
 } ObjFunction;
@@ -60,43 +78,85 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+// Strings built at run time that are longer than this are neither hashed nor interned.
+#define STRING_INTERN_MAX 40
+
+/*
+ * Strings are interned, so two equal strings are usually the same object. A string built
+ * at run time, by concatenation, that is longer than STRING_INTERN_MAX is the exception: it
+ * is compared by its characters, and its hash stays 0 because it never becomes a table key.
+ * Keys are names from the source, which copyString() always interns.
+ */
 struct ObjString {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    char chars[]; // length characters and a terminating NUL, in the object itself.
 };
 
+/*
+ * The references below that objects hold to other objects are REF fields, 32-bit heap
+ * offsets in a GECCO_COMPRESSED_HEAP build (see memory/ref.h), placed next to the header
+ * so that they fill its padding.
+ */
+
 typedef struct ObjUpvalue {
     Obj obj;
+    REF(struct ObjUpvalue) next;
     Value *location;
     Value closed;
-    struct ObjUpvalue *next;
 } ObjUpvalue;
 
 typedef struct {
     Obj obj;
-    ObjFunction *function;
-    ObjUpvalue **upvalues;
+    REF(ObjFunction) function;
+    REF(ObjUpvalue) *upvalues;
     int upvalueCount;
 } ObjClosure;
 
+// Instances with more fields than this fall back to a dictionary.
+#define SHAPE_MAX_FIELDS 64
+// Upper bound on the slots reserved inside the instance allocation itself.
+#define INSTANCE_MAX_INLINE 16
+
+/**
+ * A hidden class describing the field layout of instances. Each class roots its own tree
+ * of shapes: adding field "name" to an instance moves it from its shape to the child
+ * reached through that name, so instances that gain the same fields in the same order
+ * share one shape and keep their values at the same slot indices. Because trees are not
+ * shared, a shape also identifies the instance's class.
+ */
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape *parent;
+    ObjString *name;    // Field added by this transition, null for the root.
+    int fieldCount;     // Fields described by this shape; name lives in slot fieldCount - 1.
+    Table transitions;  // Field name -> child shape.
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString *name;
     Table methods;
+    ObjShape *rootShape; // Shape of a new instance with no fields.
+    int instanceSlots; // Most fields seen on an instance, used to size new instances' inline slots.
 } ObjClass;
 
 typedef struct {
     Obj obj;
-    ObjClass *klass;
-    Table fields; // [fields]
+    REF(ObjClass) klass;
+    REF(ObjShape) shape; // Null once the instance has fallen back to dictionary mode.
+    int capacity;
+    int inlineCapacity;
+    Value *fields;       // Slot values indexed by the shape; points at inlineFields until they overflow.
+    Table *dictionary;   // Name -> value table used in dictionary mode.
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
     Obj obj;
+    REF(ObjClosure) method;
     Value receiver;
-    ObjClosure *method;
 } ObjBoundMethod;
 
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
@@ -105,7 +165,13 @@ ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
 ObjNative *newNative(NativeFn function);
-ObjString *takeString(char *chars, int length);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+int shapeLookup(ObjShape *shape, ObjString *name);
+bool getInstanceField(ObjInstance *instance, ObjString *name, Value *value);
+void setInstanceField(ObjInstance *instance, ObjString *name, Value value);
+ObjString *makeString(int length);
+ObjString *takeString(ObjString *string);
+bool longStringsEqual(ObjString *a, ObjString *b);
 ObjString *copyString(const char *chars, int length);
 ObjUpvalue *newUpvalue(Value * slot);
 void printObject(Value value);
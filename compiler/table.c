@@ -12,138 +12,343 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Full slots are at most 7/8 of the table; the control bytes find a key long before
+// the probe sequences grow as long as they would under linear probing at that load.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#define CONTROL_EMPTY ((int8_t) -128)
+#define CONTROL_DELETED ((int8_t) -2)
+
+// Slot bits of the hash pick the first group; the top 7 bits are the control byte.
+#define FRAGMENT(hash) ((int8_t) ((hash) >> 25))
+
+#ifdef __SSE2__
+typedef __m128i Group;
+
+static inline Group loadGroup(const int8_t *control) {
+    return _mm_loadu_si128((const __m128i *) control);
+}
+
+/** A bit per slot of [group] whose control byte is [byte]. */
+static inline uint32_t matchByte(Group group, int8_t byte) {
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+}
+
+/** A bit per slot of [group] that is empty or deleted, the two negative bytes. */
+static inline uint32_t matchFree(Group group) {
+    return (uint32_t) _mm_movemask_epi8(group);
+}
+#else
+// Without SSE2 a group is two 64-bit words, compared a byte lane at a time with the usual
+// word tricks. The high bit of each lane that matches is set; lanes are gathered into a
+// bit per slot so both versions return the same masks.
+typedef struct {
+    uint64_t low;
+    uint64_t high;
+} Group;
+
+#define LANES_LOW 0x0101010101010101ull
+#define LANES_HIGH 0x8080808080808080ull
+
+static inline Group loadGroup(const int8_t *control) {
+    Group group;
+    memcpy(&group, control, sizeof(group));
+    return group;
+}
+
+/** One bit per byte lane of [word] with its high bit set, lane i landing on bit i. */
+static inline uint32_t gatherLanes(uint64_t word) {
+    return (uint32_t) ((((word & LANES_HIGH) >> 7) * 0x0102040810204080ull) >> 56);
+}
+
+static inline uint64_t zeroLanes(uint64_t word) {
+    // Exact, unlike the shorter (x - 1) & ~x test, which can flag the lane above a zero.
+    return ~(((word & ~LANES_HIGH) + ~LANES_HIGH) | word | ~LANES_HIGH);
+}
+
+static inline uint32_t matchByte(Group group, int8_t byte) {
+    uint64_t repeated = LANES_LOW * (uint8_t) byte;
+    return gatherLanes(zeroLanes(group.low ^ repeated))
+           | gatherLanes(zeroLanes(group.high ^ repeated)) << 8;
+}
+
+static inline uint32_t matchFree(Group group) {
+    return gatherLanes(group.low) | gatherLanes(group.high) << 8;
+}
+#endif
+
+static inline int lowestSlot(uint32_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+/** The first group probed for [hash]. Groups are aligned, so a group never wraps around. */
+static inline uint32_t firstGroup(int capacity, uint32_t hash) {
+    return hash & (uint32_t) (capacity - 1) & ~(uint32_t) (TABLE_GROUP - 1);
+}
+
+// Steps of TABLE_GROUP, 2 * TABLE_GROUP, ... visit every group of a power-of-two table once.
+#define NEXT_GROUP(capacity, group, step) (((group) + ((step) += TABLE_GROUP)) & (uint32_t) ((capacity) - 1))
+
+/** The first empty or deleted slot on the probe sequence of [hash]. */
+static inline int findFreeSlot(const int8_t *control, int capacity, uint32_t hash) {
+    uint32_t group = firstGroup(capacity, hash);
+    for (uint32_t step = 0;; group = NEXT_GROUP(capacity, group, step)) {
+        uint32_t free = matchFree(loadGroup(&control[group]));
+        if (free != 0) return (int) group + lowestSlot(free);
+    }
+}
+
+/**
+ * The slot for [hash] in control bytes being rebuilt. Nothing is deleted from them, so each
+ * group fills from its first slot and is full once its last is. Scanning bytes here, rather
+ * than loading a group right after storing into it, keeps the loads from stalling on those
+ * stores.
+ */
+static inline int rebuiltSlot(int8_t *control, int capacity, uint32_t hash) {
+    uint32_t group = firstGroup(capacity, hash);
+    for (uint32_t step = 0; control[group + TABLE_GROUP - 1] >= 0;) group = NEXT_GROUP(capacity, group, step);
+
+    int slot = (int) group;
+    while (control[slot] >= 0) slot++;
+    control[slot] = FRAGMENT(hash);
+    return slot;
+}
+
+/** Empties [slot], returning whether it may be filled again without a rebuild. */
+static inline bool clearSlot(int8_t *control, int slot) {
+    // A group that still has an empty slot has ended every probe that reached it, so no
+    // key lies beyond it on that account and the slot can become empty again.
+    uint32_t group = (uint32_t) slot & ~(uint32_t) (TABLE_GROUP - 1);
+    if (matchByte(loadGroup(&control[group]), CONTROL_EMPTY) != 0) {
+        control[slot] = CONTROL_EMPTY;
+        return true;
+    }
+    control[slot] = CONTROL_DELETED;
+    return false;
+}
 
 void initTable(Table *table) {
     table->count = 0;
     table->capacity = 0;
-    table->entries = nullptr;
+    table->growthLeft = 0;
+    table->control = nullptr;
+    table->keys = nullptr;
+    table->values = nullptr;
 }
 
 void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(char, table->values, TABLE_BYTES(table->capacity));
     initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-
-    uint32_t index = key->hash & (capacity - 1);
-
-    Entry *tombstone = nullptr;
-
-    for (;;) {
-        Entry *entry = &entries[index];
+/**
+ * The slot holding [key] or, when the table lacks it, ~slot for the first empty or deleted
+ * slot on the key's probe sequence, where tableSet() would put it.
+ */
+static inline int findSlot(const Table *table, ObjString *key) {
+    REF(ObjString) ref = TO_REF(key);
+    int8_t fragment = FRAGMENT(key->hash);
+    uint32_t group = firstGroup(table->capacity, key->hash);
+    int free = -1;
 
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+    for (uint32_t step = 0;; group = NEXT_GROUP(table->capacity, group, step)) {
+        Group control = loadGroup(&table->control[group]);
+        for (uint32_t matches = matchByte(control, fragment); matches != 0; matches &= matches - 1) {
+            int slot = (int) group + lowestSlot(matches);
+            if (table->keys[slot] == ref) return slot;
         }
-
-        index = (index + 1) & (capacity - 1);
+        uint32_t unused = matchFree(control);
+        if (free < 0 && unused != 0) free = (int) group + lowestSlot(unused);
+        if (matchByte(control, CONTROL_EMPTY) != 0) return ~free;
     }
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
     if (table->count == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->values[slot];
     return true;
 }
 
+/** Rebuilds the table with [capacity] slots, dropping its tombstones. */
 static void adjustCapacity(Table *table, int capacity) {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = nullptr;
-        entries[i].value = NULL_VAL;
-    }
+    // One allocation: values, then keys, then control bytes, each suitably aligned.
+    Value *values = (Value *) reallocate(NULL, 0, TABLE_BYTES(capacity));
+    Table grown = {
+        .count = table->count,
+        .capacity = capacity,
+        .growthLeft = TABLE_MAX_LOAD(capacity) - table->count,
+        .control = (int8_t *) ((char *) values + (sizeof(Value) + sizeof(REF(ObjString))) * capacity),
+        .keys = (REF(ObjString) *) (values + capacity),
+        .values = values,
+    };
+    memset(grown.control, CONTROL_EMPTY, capacity);
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (!TABLE_FULL(table, i)) continue;
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        int slot = rebuiltSlot(grown.control, capacity, FROM_REF(ObjString, table->keys[i])->hash);
+        grown.keys[slot] = table->keys[i];
+        grown.values[slot] = table->values[i];
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(char, table->values, TABLE_BYTES(table->capacity));
+    *table = grown;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    int slot = table->capacity == 0 ? ~0 : findSlot(table, key);
+    if (slot >= 0) {
+        table->values[slot] = value;
+        return false;
     }
+    slot = ~slot;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NULL(entry->value)) table->count++;
+    if (table->capacity == 0 || (table->growthLeft == 0 && table->control[slot] == CONTROL_EMPTY)) {
+        // Grow unless tombstones, not entries, are what filled the table.
+        int capacity = table->capacity;
+        if (capacity == 0) {
+            capacity = TABLE_GROUP;
+        } else if (table->count + 1 > TABLE_MAX_LOAD(capacity) / 2) {
+            capacity *= 2;
+        }
+        adjustCapacity(table, capacity);
+        slot = findFreeSlot(table->control, table->capacity, key->hash);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    if (table->control[slot] == CONTROL_EMPTY) table->growthLeft--;
+    table->control[slot] = FRAGMENT(key->hash);
+    table->keys[slot] = TO_REF(key);
+    table->values[slot] = value;
+    table->count++;
+    return true;
 }
 
 bool tableDelete(Table *table, ObjString *key) {
     if (table->count == 0) return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    entry->key = nullptr;
-    entry->value = BOOL_VAL(true);
+    if (clearSlot(table->control, slot)) table->growthLeft++;
+    table->keys[slot] = NULL_REF;
+    table->values[slot] = NULL_VAL;
+    table->count--;
     return true;
 }
 
 void tableAddAll(Table *from, Table *to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
-        }
+        if (TABLE_FULL(from, i)) tableSet(to, FROM_REF(ObjString, from->keys[i]), from->values[i]);
     }
 }
 
-ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash) {
-    if (table->count == 0) return nullptr;
+void initStringSet(StringSet *set) {
+    set->count = 0;
+    set->capacity = 0;
+    set->growthLeft = 0;
+    set->control = nullptr;
+    set->entries = nullptr;
+}
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->value)) return nullptr;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+void freeStringSet(StringSet *set) {
+    free(set->entries);
+    initStringSet(set);
+}
+
+/** Rebuilds the set with [capacity] slots, dropping its tombstones. */
+static void resizeStringSet(StringSet *set, int capacity) {
+    // The collector shrinks the set, so its storage is allocated without reallocate(),
+    // which may start a collection.
+    InternEntry *entries = (InternEntry *) malloc(STRING_SET_BYTES(capacity));
+    if (entries == NULL) exit(1);
+
+    int8_t *control = (int8_t *) (entries + capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+    for (int i = 0; i < set->capacity; i++) {
+        if (STRING_SET_FULL(set, i)) entries[rebuiltSlot(control, capacity, set->entries[i].hash)] = set->entries[i];
+    }
+
+    free(set->entries);
+    set->capacity = capacity;
+    set->growthLeft = TABLE_MAX_LOAD(capacity) - set->count;
+    set->control = control;
+    set->entries = entries;
+}
+
+void stringSetAdd(StringSet *set, ObjString *string) {
+    if (set->growthLeft == 0) {
+        int capacity = set->capacity;
+        if (capacity == 0) {
+            capacity = TABLE_GROUP;
+        } else if (set->count + 1 > TABLE_MAX_LOAD(capacity) / 2) {
+            capacity *= 2;
         }
+        resizeStringSet(set, capacity);
+    }
 
-        index = (index + 1) & (table->capacity - 1);
+    int slot = findFreeSlot(set->control, set->capacity, string->hash);
+    if (set->control[slot] == CONTROL_EMPTY) set->growthLeft--;
+    set->control[slot] = FRAGMENT(string->hash);
+    set->entries[slot] = (InternEntry) {.string = TO_REF(string), .hash = string->hash, .length = string->length};
+    set->count++;
+}
+
+ObjString *stringSetFind(StringSet *set, const char *chars, int length, uint32_t hash) {
+    if (set->count == 0) return nullptr;
+
+    int8_t fragment = FRAGMENT(hash);
+    uint32_t group = firstGroup(set->capacity, hash);
+    for (uint32_t step = 0;; group = NEXT_GROUP(set->capacity, group, step)) {
+        Group control = loadGroup(&set->control[group]);
+        for (uint32_t matches = matchByte(control, fragment); matches != 0; matches &= matches - 1) {
+            // Only a string with the same hash and length is loaded to compare characters.
+            InternEntry *entry = &set->entries[group + lowestSlot(matches)];
+            if (entry->hash != hash || entry->length != length) continue;
+
+            ObjString *string = FROM_REF(ObjString, entry->string);
+            if (memcmp(string->chars, chars, length) == 0) return string;
+        }
+        if (matchByte(control, CONTROL_EMPTY) != 0) return nullptr;
     }
 }
 
 //< table-find-string
 /**
- * Garbage Collection table-remove-white
- * @param table
+ * Garbage Collection table-remove-white. Drops the strings the collection found unreachable,
+ * then rebuilds the set at a smaller size once they leave most of it unused.
+ * @param set
  */
-void tableRemoveWhite(Table *table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+void stringSetRemoveWhite(StringSet *set) {
+    for (int i = 0; i < set->capacity; i++) {
+        if (STRING_SET_FULL(set, i) && !isReachable(FROM_REF(Obj, set->entries[i].string))) {
+            if (clearSlot(set->control, i)) set->growthLeft++;
+            set->count--;
         }
     }
+
+    if (set->capacity > TABLE_GROUP && set->count <= TABLE_MAX_LOAD(set->capacity) / 4) {
+        // Half full at the new size, so the strings that follow do not grow it straight back.
+        int capacity = TABLE_GROUP;
+        while (set->count > TABLE_MAX_LOAD(capacity) / 2) capacity *= 2;
+        resizeStringSet(set, capacity);
+    }
 }
 
 /**
@@ -152,8 +357,8 @@ void tableRemoveWhite(Table *table) {
  */
 void markTable(Table *table) {
     for (int i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        markObject((Obj *) entry->key);
-        markValue(entry->value);
+        if (!TABLE_FULL(table, i)) continue;
+        markObject(FROM_REF(Obj, table->keys[i]));
+        markValue(table->values[i]);
     }
 }
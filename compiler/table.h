@@ -6,17 +6,54 @@
 #define table_h
 
 #include "value.h"
+#include "memory/ref.h"
 
+// Slots probed at once: their control bytes are compared in one SSE2 instruction.
+#define TABLE_GROUP 16
+
+/**
+ * A hash table from strings to values in the SwissTable style. Keys, values and one
+ * control byte per slot are kept in separate arrays. A control byte is CONTROL_EMPTY,
+ * CONTROL_DELETED or, for a full slot, the top 7 bits of the key's hash, so a lookup
+ * compares the fragment against a whole group of slots at a time and only loads the
+ * keys that match it. Groups are probed quadratically until one has an empty slot.
+ */
+typedef struct {
+    int count;
+    int capacity; // 0 or a power of two no smaller than TABLE_GROUP.
+    int growthLeft; // Empty slots that may still be filled before the table is rebuilt.
+    int8_t *control;
+    REF(ObjString) *keys;
+    Value *values;
+} Table;
+
+// Whether slot [index] holds an entry, for loops over the slots of a table.
+#define TABLE_FULL(table, index) ((table)->control[index] >= 0)
+// The bytes a table of [capacity] slots allocates.
+#define TABLE_BYTES(capacity) ((size_t) (capacity) * (sizeof(Value) + sizeof(REF(ObjString)) + 1))
+
+/** An interned string with the hash and length a lookup compares before its characters. */
 typedef struct {
-    ObjString* key;
-    Value value;
-} Entry;
+    REF(ObjString) string;
+    uint32_t hash;
+    int length;
+} InternEntry;
 
+/**
+ * The set of interned strings, vm.strings. It probes like a Table but has no values, and
+ * keeps each string's hash and length next to it, so a lookup loads only the strings whose
+ * hash and length both match. The collector removes the strings nothing else reaches.
+ */
 typedef struct {
     int count;
     int capacity;
-    Entry* entries;
-} Table;
+    int growthLeft;
+    int8_t *control;
+    InternEntry *entries;
+} StringSet;
+
+#define STRING_SET_FULL(set, index) ((set)->control[index] >= 0)
+#define STRING_SET_BYTES(capacity) ((size_t) (capacity) * (sizeof(InternEntry) + 1))
 
 void initTable(Table* table);
 void freeTable(Table* table);
@@ -24,9 +61,12 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
+void initStringSet(StringSet* set);
+void freeStringSet(StringSet* set);
+void stringSetAdd(StringSet* set, ObjString* string);
+ObjString* stringSetFind(StringSet* set, const char* chars, int length, uint32_t hash);
+void stringSetRemoveWhite(StringSet* set);
+
 #endif //table_h
@@ -51,6 +51,7 @@ void printValue(Value value) {
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: printObject(value); break;
+    case VAL_UNDEFINED: break;
   }
 #endif
 }
@@ -60,7 +61,8 @@ bool valuesEqual(Value a, Value b) {
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) return true;
+    return IS_STRING(a) && IS_STRING(b) && longStringsEqual(AS_STRING(a), AS_STRING(b));
 #else
 //< Optimization values-equal
   if (a.type != b.type) return false;
@@ -68,7 +70,9 @@ bool valuesEqual(Value a, Value b) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      if (AS_OBJ(a) == AS_OBJ(b)) return true;
+      return IS_STRING(a) && IS_STRING(b) && longStringsEqual(AS_STRING(a), AS_STRING(b));
     default:         return false; // Unreachable.
   }
 #endif
@@ -16,11 +16,13 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100. Marks unassigned global slots, never seen by programs.
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NULL(value)      ((value) == NULL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
@@ -30,6 +32,7 @@ typedef uint64_t Value;
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NULL_VAL            ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 // Include math functions prototypes to fix linking
 double modulo(double inputA, double inputB);
 float power(float inputA, int inputB);
@@ -54,7 +57,8 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL, // [user-types]
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED // Unassigned global slots, never seen by programs.
 } ValueType;
 
 //< Types of Values value-type
@@ -78,6 +82,7 @@ typedef struct {
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 //> Strings is-obj
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 //< Strings is-obj
@@ -95,6 +100,7 @@ typedef struct {
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NULL_VAL           NIL_VAL
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 //> Strings obj-val
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})